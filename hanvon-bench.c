@@ -0,0 +1,1079 @@
+/*
+* =====================================================================================
+*
+*       Filename:  hanvon-bench.c
+*
+*    Description:  Decode and emit microbenchmarks and a hotplug soak test
+*                  for the userspace driver
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+// Simulated USB bus of the soak test (-s). The driver's libusb and uinput
+// calls are redirected here before its source is included, so hotplug,
+// attach, the transfer ring and teardown run unmodified against tablets
+// that only exist in memory. Transfers follow libusb's rules: a cancelled
+// transfer still gets its callback (status CANCELLED) from the event loop
+// later and must not be freed before that. The bus never frees memory the
+// driver could still reach, a transfer freed too early is counted instead.
+enum sim_state {
+    SIM_IDLE,                       // Allocated or completed, not queued
+    SIM_QUEUED,                     // Submitted, waiting for its packet
+    SIM_CANCELLING,                 // Cancelled, the CANCELLED callback is still due
+    SIM_RUNNING,                    // Its callback is executing
+    SIM_FREED,                      // Freed by the driver before the bus let go of it
+};
+
+struct sim_device {                 // Stands in for libusb_device
+    int refs;
+    int present;                    // Still plugged in
+    uint16_t product_id;
+    uint8_t bus, address, port;
+    uint64_t tick;                  // Last tick one of its transfers completed in
+    uint64_t sequence;              // Packets generated
+};
+
+struct sim_handle {                 // Stands in for libusb_device_handle
+    struct sim_device *dev;
+    int claimed;
+};
+
+struct sim_transfer {
+    enum sim_state state;
+    struct sim_device *dev;         // Referenced while queued
+    struct sim_transfer *prev, *next; // Oldest submission first
+    struct libusb_transfer tx;      // Last, it ends in a flexible array
+};
+
+struct sim_uinput {                 // Stands in for libevdev_uinput
+    int fd;                         // /dev/null
+    struct libevdev *evdev;         // Managed, freed with the node
+};
+
+#define SIM_TRANSFER(t) ((struct sim_transfer *)((char *)(t) - offsetof(struct sim_transfer, tx)))
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;                    // Redirect uinput too (soak running)
+    struct sim_transfer *head, *tail;
+    size_t listed;                  // Entries between head and tail
+    struct sim_device **port;       // Plugged tablet of each port, or NULL (the enumerated bus)
+    int ports;
+    // Live objects, all zero after a clean teardown
+    long devices, handles, claims, transfers, uinputs;
+    // Broken libusb rules
+    unsigned long long freed_busy, double_free, submit_freed, submit_busy;
+    // Completions by status
+    unsigned long long completed, cancelled, no_device;
+} g_sim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct libusb_endpoint_descriptor g_sim_endpoint = {
+    .bEndpointAddress = 0x81,
+    .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT,
+    .wMaxPacketSize = 10,
+    .bInterval = 1,
+};
+static struct libusb_interface_descriptor g_sim_altsetting = { .bNumEndpoints = 1, .endpoint = &g_sim_endpoint };
+static struct libusb_interface g_sim_interface = { .altsetting = &g_sim_altsetting, .num_altsetting = 1 };
+static struct libusb_config_descriptor g_sim_config = { .bNumInterfaces = 1, .interface = &g_sim_interface };
+
+static void sim_unref_locked(struct sim_device *d) {
+    if (--d->refs == 0) {
+        free(d);
+        g_sim.devices--;
+    }
+}
+
+static libusb_device *sim_ref_device(libusb_device *dev) {
+    pthread_mutex_lock(&g_sim.lock);
+    ((struct sim_device *)dev)->refs++;
+    pthread_mutex_unlock(&g_sim.lock);
+    return dev;
+}
+
+static void sim_unref_device(libusb_device *dev) {
+    pthread_mutex_lock(&g_sim.lock);
+    sim_unref_locked((struct sim_device *)dev);
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+static ssize_t sim_get_device_list(libusb_context *ctx, libusb_device ***list) {
+    pthread_mutex_lock(&g_sim.lock);
+    libusb_device **l = calloc(g_sim.ports + 1, sizeof(*l));
+    ssize_t n = 0;
+    for (int i = 0; l && i < g_sim.ports; i++) {
+        if (!g_sim.port[i]) continue;
+        g_sim.port[i]->refs++;
+        l[n++] = (libusb_device *)g_sim.port[i];
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    if (!l) return LIBUSB_ERROR_NO_MEM;
+    *list = l;
+    return n;
+}
+
+static void sim_free_device_list(libusb_device **list, int unref) {
+    if (unref) {
+        for (libusb_device **d = list; *d; d++) sim_unref_device(*d);
+    }
+    free(list);
+}
+
+static int sim_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    memset(desc, 0, sizeof(*desc));
+    desc->idVendor = 0x0b57;
+    desc->idProduct = ((struct sim_device *)dev)->product_id;
+    desc->bcdDevice = 0x0100;
+    desc->iSerialNumber = 3;
+    return LIBUSB_SUCCESS;
+}
+
+static uint8_t sim_get_device_address(libusb_device *dev) {
+    return ((struct sim_device *)dev)->address;
+}
+
+static uint8_t sim_get_bus_number(libusb_device *dev) {
+    return ((struct sim_device *)dev)->bus;
+}
+
+static int sim_get_port_numbers(libusb_device *dev, uint8_t *ports, int len) {
+    if (len < 1) return LIBUSB_ERROR_OVERFLOW;
+    ports[0] = ((struct sim_device *)dev)->port;
+    return 1;
+}
+
+static int sim_get_device_speed(libusb_device *dev) {
+    return LIBUSB_SPEED_FULL;
+}
+
+static int sim_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config) {
+    *config = &g_sim_config;
+    return LIBUSB_SUCCESS;
+}
+
+static void sim_free_config_descriptor(struct libusb_config_descriptor *config) {
+}
+
+static int sim_open(libusb_device *dev, libusb_device_handle **handle) {
+    struct sim_device *d = (struct sim_device *)dev;
+    int rc = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&g_sim.lock);
+    struct sim_handle *h = d->present ? calloc(1, sizeof(*h)) : NULL;
+    if (h) {
+        h->dev = d;
+        d->refs++;
+        g_sim.handles++;
+        *handle = (libusb_device_handle *)h;
+    } else {
+        rc = d->present ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_NO_DEVICE;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return rc;
+}
+
+static void sim_close(libusb_device_handle *handle) {
+    struct sim_handle *h = (struct sim_handle *)handle;
+    pthread_mutex_lock(&g_sim.lock);
+    sim_unref_locked(h->dev);
+    g_sim.handles--;
+    pthread_mutex_unlock(&g_sim.lock);
+    free(h);
+}
+
+static libusb_device *sim_get_device(libusb_device_handle *handle) {
+    return (libusb_device *)((struct sim_handle *)handle)->dev;
+}
+
+static int sim_get_string_descriptor_ascii(libusb_device_handle *handle, uint8_t index,
+                                           unsigned char *data, int len) {
+    return snprintf((char *)data, len, "SIM%03u", ((struct sim_handle *)handle)->dev->port);
+}
+
+static int sim_kernel_driver_active(libusb_device_handle *handle, int interface) {
+    return 0;
+}
+
+static int sim_detach_kernel_driver(libusb_device_handle *handle, int interface) {
+    return LIBUSB_SUCCESS;
+}
+
+static int sim_attach_kernel_driver(libusb_device_handle *handle, int interface) {
+    return ((struct sim_handle *)handle)->dev->present ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+static int sim_claim_interface(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = (struct sim_handle *)handle;
+    int rc = LIBUSB_ERROR_NO_DEVICE;
+    pthread_mutex_lock(&g_sim.lock);
+    if (h->dev->present && !h->claimed) {
+        h->claimed = 1;
+        g_sim.claims++;
+        rc = LIBUSB_SUCCESS;
+    } else if (h->claimed) {
+        rc = LIBUSB_ERROR_BUSY;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return rc;
+}
+
+static int sim_release_interface(libusb_device_handle *handle, int interface) {
+    struct sim_handle *h = (struct sim_handle *)handle;
+    int rc = LIBUSB_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&g_sim.lock);
+    if (h->claimed) {
+        h->claimed = 0;
+        g_sim.claims--;
+        rc = h->dev->present ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return rc;
+}
+
+static void sim_unlink_locked(struct sim_transfer *s) {
+    if (s->prev) s->prev->next = s->next;
+    else g_sim.head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else g_sim.tail = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void sim_append_locked(struct sim_transfer *s) {
+    s->prev = g_sim.tail;
+    if (g_sim.tail) g_sim.tail->next = s;
+    else g_sim.head = s;
+    g_sim.tail = s;
+}
+
+// Drops a transfer the driver already freed, once the bus is done with it
+static void sim_reclaim_locked(struct sim_transfer *s) {
+    sim_unlink_locked(s);
+    g_sim.listed--;
+    if (s->dev) sim_unref_locked(s->dev);
+    free(s);
+}
+
+static struct libusb_transfer *sim_alloc_transfer(int iso_packets) {
+    struct sim_transfer *s = calloc(1, sizeof(*s) + iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+    if (!s) return NULL;
+    s->tx.num_iso_packets = iso_packets;
+    pthread_mutex_lock(&g_sim.lock);
+    sim_append_locked(s);
+    g_sim.listed++;
+    g_sim.transfers++;
+    pthread_mutex_unlock(&g_sim.lock);
+    return &s->tx;
+}
+
+static int sim_submit_transfer(struct libusb_transfer *tx) {
+    struct sim_transfer *s = SIM_TRANSFER(tx);
+    struct sim_device *d = ((struct sim_handle *)tx->dev_handle)->dev;
+    int rc = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (s->state == SIM_FREED) {
+        g_sim.submit_freed++;
+        rc = LIBUSB_ERROR_NOT_FOUND;
+    } else if (s->state == SIM_QUEUED || s->state == SIM_CANCELLING) {
+        g_sim.submit_busy++;
+        rc = LIBUSB_ERROR_BUSY;
+    } else if (!d->present) {
+        rc = LIBUSB_ERROR_NO_DEVICE;
+    } else {
+        s->state = SIM_QUEUED;
+        s->dev = d;
+        d->refs++;
+        sim_unlink_locked(s);
+        sim_append_locked(s);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return rc;
+}
+
+static int sim_cancel_transfer(struct libusb_transfer *tx) {
+    struct sim_transfer *s = SIM_TRANSFER(tx);
+    int rc = LIBUSB_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&g_sim.lock);
+    if (s->state == SIM_QUEUED) {
+        s->state = SIM_CANCELLING;
+        rc = LIBUSB_SUCCESS;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return rc;
+}
+
+static void sim_free_transfer(struct libusb_transfer *tx) {
+    if (!tx) return;
+    struct sim_transfer *s = SIM_TRANSFER(tx);
+    pthread_mutex_lock(&g_sim.lock);
+    if (s->state == SIM_FREED) {
+        g_sim.double_free++;
+    } else {
+        g_sim.transfers--;
+        if (s->state == SIM_IDLE) {
+            sim_reclaim_locked(s);
+        } else {
+            // libusb does not touch a transfer once its callback was called,
+            // so only a queued one would be completed into freed memory
+            if (s->state != SIM_RUNNING) g_sim.freed_busy++;
+            s->state = SIM_FREED;
+        }
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+static int sim_uinput_create_from_device(const struct libevdev *evdev, int mode, struct libevdev_uinput **out) {
+    if (!g_sim.enabled) return libevdev_uinput_create_from_device(evdev, mode, out);
+    struct sim_uinput *u = calloc(1, sizeof(*u));
+    if (!u) return -ENOMEM;
+    u->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (u->fd < 0) {
+        int rc = -errno;
+        free(u);
+        return rc;
+    }
+    u->evdev = (struct libevdev *)evdev;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.uinputs++;
+    pthread_mutex_unlock(&g_sim.lock);
+    *out = (struct libevdev_uinput *)u;
+    return 0;
+}
+
+static void sim_uinput_destroy(struct libevdev_uinput *uidev) {
+    if (!g_sim.enabled) {
+        libevdev_uinput_destroy(uidev);
+        return;
+    }
+    struct sim_uinput *u = (struct sim_uinput *)uidev;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.uinputs--;
+    pthread_mutex_unlock(&g_sim.lock);
+    close(u->fd);
+    libevdev_free(u->evdev);
+    free(u);
+}
+
+static int sim_uinput_get_fd(const struct libevdev_uinput *uidev) {
+    if (!g_sim.enabled) return libevdev_uinput_get_fd(uidev);
+    return ((const struct sim_uinput *)uidev)->fd;
+}
+
+static const char *sim_uinput_get_devnode(struct libevdev_uinput *uidev) {
+    if (!g_sim.enabled) return libevdev_uinput_get_devnode(uidev);
+    return "/dev/null";
+}
+
+static int sim_uinput_write_event(const struct libevdev_uinput *uidev, unsigned int type,
+                                  unsigned int code, int value) {
+    if (!g_sim.enabled) return libevdev_uinput_write_event(uidev, type, code, value);
+    struct input_event ev = { .type = type, .code = code, .value = value };
+    return write(((const struct sim_uinput *)uidev)->fd, &ev, sizeof(ev)) < 0 ? -errno : 0;
+}
+
+#define libusb_ref_device                   sim_ref_device
+#define libusb_unref_device                 sim_unref_device
+#define libusb_get_device_list              sim_get_device_list
+#define libusb_free_device_list             sim_free_device_list
+#define libusb_get_device_descriptor        sim_get_device_descriptor
+#define libusb_get_device_address           sim_get_device_address
+#define libusb_get_bus_number               sim_get_bus_number
+#define libusb_get_port_numbers             sim_get_port_numbers
+#define libusb_get_device_speed             sim_get_device_speed
+#define libusb_get_active_config_descriptor sim_get_active_config_descriptor
+#define libusb_free_config_descriptor       sim_free_config_descriptor
+#define libusb_open                         sim_open
+#define libusb_close                        sim_close
+#define libusb_get_device                   sim_get_device
+#define libusb_get_string_descriptor_ascii  sim_get_string_descriptor_ascii
+#define libusb_kernel_driver_active         sim_kernel_driver_active
+#define libusb_detach_kernel_driver         sim_detach_kernel_driver
+#define libusb_attach_kernel_driver         sim_attach_kernel_driver
+#define libusb_claim_interface              sim_claim_interface
+#define libusb_release_interface            sim_release_interface
+#define libusb_alloc_transfer               sim_alloc_transfer
+#define libusb_submit_transfer              sim_submit_transfer
+#define libusb_cancel_transfer              sim_cancel_transfer
+#define libusb_free_transfer                sim_free_transfer
+#define libevdev_uinput_create_from_device  sim_uinput_create_from_device
+#define libevdev_uinput_destroy             sim_uinput_destroy
+#define libevdev_uinput_get_fd              sim_uinput_get_fd
+#define libevdev_uinput_get_devnode         sim_uinput_get_devnode
+#define libevdev_uinput_write_event         sim_uinput_write_event
+
+// The benchmark drives the driver's own static decode/emit functions, so it
+// is built from the same translation unit with main() left out
+#define HANVON_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include "hanvon-libusb.c"
+
+#define BENCH_STREAM_LEN 4096       // Packets per synthetic stream
+#define BENCH_ITERATIONS 100        // Default passes over each stream
+
+// A packet stream held in memory so file I/O is not measured
+struct bench_stream {
+    const char *name;
+    uint16_t product_id;
+    size_t count;
+    uint16_t *len;
+    size_t *offset;
+    unsigned char *bytes;
+    size_t slots;                   // Entries allocated in len/offset
+    size_t size, capacity;          // Bytes used/allocated in bytes
+};
+
+static int g_bench_devnull = 0;     // Never try uinput (-N)
+
+static int stream_append(struct bench_stream *s, const unsigned char *data, uint16_t len) {
+    if (s->count == s->slots) {
+        size_t n = s->slots ? s->slots * 2 : 64;
+        uint16_t *l = realloc(s->len, n * sizeof(*l));
+        if (l) s->len = l;
+        size_t *o = realloc(s->offset, n * sizeof(*o));
+        if (o) s->offset = o;
+        if (!l || !o) return -ENOMEM;
+        s->slots = n;
+    }
+    if (s->size + len > s->capacity) {
+        size_t n = s->capacity ? s->capacity * 2 : 4096;
+        while (n < s->size + len) n *= 2;
+        unsigned char *b = realloc(s->bytes, n);
+        if (!b) return -ENOMEM;
+        s->bytes = b;
+        s->capacity = n;
+    }
+    memcpy(s->bytes + s->size, data, len);
+    s->len[s->count] = len;
+    s->offset[s->count] = s->size;
+    s->size += len;
+    s->count++;
+    return 0;
+}
+
+static void stream_free(struct bench_stream *s) {
+    free(s->len);
+    free(s->offset);
+    free(s->bytes);
+}
+
+// Pen report in the ArtMaster layout: a stroke across the tablet with
+// varying pressure and tilt, hovering for a quarter of the time
+static void synth_am_pen(unsigned char *p, size_t i) {
+    unsigned int x = (i * 37) & 0xffff, y = (i * 23) & 0xffff;
+    unsigned int pressure = (i % 4 == 0) ? 0 : (i * 97) & 0xffc0;
+    p[0] = PEN_EVENT;
+    p[1] = 0x90 | ((i & 0x40) ? 0x02 : 0);
+    p[2] = x >> 8; p[3] = x & 0xff;
+    p[4] = y >> 8; p[5] = y & 0xff;
+    p[6] = pressure >> 8;
+    p[7] = (pressure & 0xc0) | (i & 0x3f);
+    p[8] = (i >> 3) & 0x7f;
+    p[9] = 0;
+}
+
+static void synth_am(struct bench_stream *s) {
+    unsigned char p[AM_PACKET_LEN];
+    for (size_t i = 0; i < BENCH_STREAM_LEN; i++) {
+        memset(p, 0, sizeof(p));
+        if (i % 64 == 63) {         // Occasional pad button / strip report
+            p[0] = BUTTON_EVENT_GP;
+            p[1] = 0x55;
+            p[2] = (i & 64) ? 0xa1 : (i & 0x3f);
+        } else {
+            synth_am_pen(p, i);
+        }
+        stream_append(s, p, sizeof(p));
+    }
+}
+
+static void synth_gp0906_buttons(struct bench_stream *s) {
+    unsigned char p[AM_PACKET_LEN];
+    for (size_t i = 0; i < BENCH_STREAM_LEN; i++) {
+        memset(p, 0, sizeof(p));
+        p[0] = BUTTON_EVENT_0906;
+        p[3] = (i >> 2) & 0x0f;
+        stream_append(s, p, sizeof(p));
+    }
+}
+
+static void synth_appiv(struct bench_stream *s) {
+    unsigned char p[AM_PACKET_LEN];
+    for (size_t i = 0; i < BENCH_STREAM_LEN; i++) {
+        unsigned int x = (i * 37) & 0xffff, y = (i * 23) & 0xffff;
+        memset(p, 0, sizeof(p));
+        switch (i % 8) {
+            case 0:                 // Pen buttons, little endian coordinates
+                p[0] = BUTTON_EVENT_GP;
+                p[1] = i & 0x0f;
+                p[2] = x & 0xff; p[3] = x >> 8;
+                p[4] = y & 0xff; p[5] = y >> 8;
+                break;
+            case 4:                 // Tablet buttons
+                p[0] = BUTTON_EVENT_0906;
+                p[3] = (i >> 3) & 0x7f;
+                break;
+            default:                // Pen report with pressure
+                p[0] = PEN_EVENT;
+                p[1] = 0x01;
+                p[2] = x >> 8; p[3] = x & 0xff;
+                p[4] = y >> 8; p[5] = y & 0xff;
+                p[6] = (i * 97) >> 8; p[7] = (i * 97) & 0xc0;
+                break;
+        }
+        stream_append(s, p, sizeof(p));
+    }
+}
+
+// Loads the packets of the first device found in a capture file (see -w)
+static int load_capture(struct bench_stream *s, const char *path) {
+    unsigned char header[CAPTURE_HEADER_LEN] = {0};
+    unsigned char record[CAPTURE_RECORD_LEN];
+    unsigned char data[CAPTURE_MAX_PACKET];
+    uint16_t version = 0;
+    size_t skipped = 0;
+
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Error opening capture file %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (fread(header, sizeof(header), 1, in) == 1) {
+        memcpy(&version, header + 6, sizeof(version));
+    }
+    if (memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+        le16toh(version) != CAPTURE_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d capture file\n", path, CAPTURE_VERSION);
+        fclose(in);
+        return -EINVAL;
+    }
+    s->name = path;
+    while (fread(record, sizeof(record), 1, in) == 1) {
+        uint16_t product_id, len;
+        memcpy(&product_id, record + 8, 2);
+        memcpy(&len, record + 12, 2);
+        product_id = le16toh(product_id);
+        len = le16toh(len);
+        if (len > sizeof(data) || fread(data, 1, len, in) != len) {
+            fprintf(stderr, "Error: truncated or corrupt record in %s\n", path);
+            break;
+        }
+        if (s->count == 0) s->product_id = product_id;
+        if (product_id != s->product_id) {
+            skipped++;
+            continue;
+        }
+        if (stream_append(s, data, len) < 0) break;
+    }
+    fclose(in);
+    if (skipped) {
+        fprintf(stderr, "%s: skipped %zu packets of other devices\n", path, skipped);
+    }
+    return s->count ? 0 : -ENODATA;
+}
+
+// Creates a device context that writes to uinput, or to /dev/null once
+// uinput turned out not to be available (or -N is given)
+static struct hanvon_device *bench_device(uint16_t product_id) {
+    struct hanvon_device *hdev = device_new(product_id, 0, 0);
+    if (!hdev) return NULL;
+    if (!g_bench_devnull && init_ctrl(&hdev->dec, 0, &hdev->evdev, &hdev->uidev) == 0) {
+        hdev->uinput_fd = libevdev_uinput_get_fd(hdev->uidev);
+        return hdev;
+    }
+    if (!g_bench_devnull) {
+        fprintf(stderr, "uinput not available, writing frames to /dev/null\n");
+        g_bench_devnull = 1;
+    }
+    hdev->uinput_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (hdev->uinput_fd < 0) {
+        ERROR("Error opening /dev/null: %s", strerror(errno));
+        device_free(hdev);
+        return NULL;
+    }
+    return hdev;
+}
+
+static void bench_device_free(struct hanvon_device *hdev) {
+    if (hdev->uidev) {
+        libevdev_uinput_destroy(hdev->uidev);
+    } else {
+        close(hdev->uinput_fd);
+    }
+    device_free(hdev);
+}
+
+static void report(const char *stream, const char *path, const char *sink,
+                   uint64_t packets, uint64_t ns) {
+    printf("%-24s %-16s %-10s %10llu %10.1f %12.0f\n", stream, path, sink,
+           (unsigned long long)packets, (double)ns / packets, packets * 1e9 / ns);
+}
+
+// Decoder only: no frame is built or written
+static void bench_decode(const struct bench_stream *s, unsigned iterations) {
+    struct hanvon_device *hdev = device_new(s->product_id, 0, 0);
+    if (!hdev) return;
+    unsigned long sink = 0;
+
+    uint64_t start = monotonic_ns();
+    for (unsigned it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < s->count; i++) {
+            hanvon_decode(&hdev->dec, s->bytes + s->offset[i], s->len[i]);
+            sink += hdev->dec.pen.x + hdev->dec.pen.pad;
+        }
+    }
+    uint64_t ns = monotonic_ns() - start;
+    __asm__ volatile("" : : "r"(sink));   // Keep the decoded state alive
+    report(s->name, "decode", "-", (uint64_t)iterations * s->count, ns);
+    device_free(hdev);
+}
+
+// Whole packet path as run by the transfer callback, for one emitter
+static void bench_emit(const struct bench_stream *s, unsigned iterations, const char *path,
+                       enum emit_mode mode, int delta) {
+    struct hanvon_device *hdev = bench_device(s->product_id);
+    if (!hdev) return;
+    g_emit_mode = mode;
+    g_delta_suppression = delta;
+    uint64_t t_packet = 0;
+
+    uint64_t start = monotonic_ns();
+    for (unsigned it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < s->count; i++) {
+            t_packet += 5000000;        // 200 Hz report rate
+            process_packet(hdev, s->bytes + s->offset[i], s->len[i], t_packet, 0);
+        }
+    }
+    uint64_t ns = monotonic_ns() - start;
+    report(s->name, path, hdev->uidev ? "uinput" : "/dev/null", (uint64_t)iterations * s->count, ns);
+    if (COUNTER(hdev->counters.uinput_errors)) {
+        fprintf(stderr, "%s: %llu write errors\n", s->name, COUNTER(hdev->counters.uinput_errors));
+    }
+    bench_device_free(hdev);
+}
+
+static void bench_stream(const struct bench_stream *s, unsigned iterations) {
+    bench_decode(s, iterations);
+    bench_emit(s, iterations, "per-event", EMIT_PER_EVENT, 0);
+    bench_emit(s, iterations, "batched", EMIT_BATCHED, 0);
+    bench_emit(s, iterations, "batched+delta", EMIT_BATCHED, 1);
+}
+
+#define SOAK_DEVICES    8           // Default simulated tablets
+#define SOAK_RATE_HZ    10000       // Default packets per second and tablet
+#define SOAK_CHURN_MS   50          // Default mean time between plug/unplug events
+#define SOAK_SCAN_MS    10          // Interval of the driver's scan with -P
+
+static struct {
+    int seconds;                    // -s, 0 = run the benchmarks instead
+    int devices;                    // -d
+    int rate_hz;                    // -k
+    int churn_ms;                   // -u, 0 = no hotplug churn
+    int threaded;                   // -t, callbacks and hotplug on the event thread
+    int polling;                    // -P, tablets are found by scan_devices instead of hotplug
+    unsigned seed;
+    uint8_t next_address;
+    uint64_t arrived, left;
+    uint64_t lagged;                // Ticks dropped because the packet path fell behind
+    struct latency_histogram total, second; // Callback duration of completed transfers
+    atomic_int done;                // The generator finished its teardown
+} g_soak = {
+    .devices = SOAK_DEVICES,
+    .rate_hz = SOAK_RATE_HZ,
+    .churn_ms = SOAK_CHURN_MS,
+    .seed = 1,
+};
+
+// Completes the transfers due in one tick: the oldest queued transfer of
+// every plugged tablet gets a packet, every cancelled transfer and every
+// transfer of an unplugged tablet fails. Callbacks run without the lock so
+// they can resubmit, like under libusb_handle_events.
+static void sim_tick(uint64_t tick) {
+    static struct sim_transfer **pick;
+    static size_t slots;
+    size_t n = 0;
+
+    pthread_mutex_lock(&g_sim.lock);
+    if (g_sim.listed > slots) {
+        size_t want = g_sim.listed * 2;
+        struct sim_transfer **p = realloc(pick, want * sizeof(*p));
+        if (p) {
+            pick = p;
+            slots = want;
+        }
+    }
+    for (struct sim_transfer *s = g_sim.head, *next; s && n < slots; s = next) {
+        next = s->next;
+        if (s->state == SIM_FREED) {
+            sim_reclaim_locked(s);
+            continue;
+        }
+        if (s->state == SIM_CANCELLING) {
+            s->tx.status = LIBUSB_TRANSFER_CANCELLED;
+            s->tx.actual_length = 0;
+            g_sim.cancelled++;
+        } else if (s->state != SIM_QUEUED) {
+            continue;
+        } else if (!s->dev->present) {
+            s->tx.status = LIBUSB_TRANSFER_NO_DEVICE;
+            s->tx.actual_length = 0;
+            g_sim.no_device++;
+        } else if (s->dev->tick != tick) {
+            struct sim_device *d = s->dev;
+            unsigned char *p = s->tx.buffer;
+            int len = s->tx.length < AM_PACKET_LEN ? s->tx.length : AM_PACKET_LEN;
+            d->tick = tick;
+            memset(p, 0, len);
+            if (d->sequence % 64 == 63) {   // Occasional pad button / strip report
+                p[0] = BUTTON_EVENT_GP;
+                p[1] = 0x55;
+                p[2] = d->sequence & 0x3f;
+            } else {
+                synth_am_pen(p, d->sequence);
+            }
+            d->sequence++;
+            s->tx.status = LIBUSB_TRANSFER_COMPLETED;
+            s->tx.actual_length = len;
+            g_sim.completed++;
+        } else {
+            continue;
+        }
+        s->state = SIM_RUNNING;
+        sim_unref_locked(s->dev);
+        s->dev = NULL;
+        pick[n++] = s;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+
+    for (size_t i = 0; i < n; i++) {
+        struct sim_transfer *s = pick[i];
+        int completed = s->tx.status == LIBUSB_TRANSFER_COMPLETED;
+        uint64_t start = monotonic_ns();
+        s->tx.callback(&s->tx);
+        if (completed) {
+            uint64_t ns = monotonic_ns() - start;
+            latency_record(&g_soak.total, ns);
+            latency_record(&g_soak.second, ns);
+        }
+        pthread_mutex_lock(&g_sim.lock);
+        if (s->state == SIM_RUNNING) s->state = SIM_IDLE;
+        else if (s->state == SIM_FREED) sim_reclaim_locked(s);
+        pthread_mutex_unlock(&g_sim.lock);
+    }
+}
+
+// Plugs a new tablet into an empty port, or pulls the one plugged in, and
+// reports it through the driver's hotplug callback (with -P the driver's
+// next scan finds out)
+static void soak_plug(int port) {
+    static const uint16_t products[] = {
+        PRODUCT_ID_AM0806, PRODUCT_ID_GP0504, PRODUCT_ID_GP0906, PRODUCT_ID_APPIV0906,
+    };
+    struct sim_device *d = calloc(1, sizeof(*d));
+    if (!d) return;
+    d->refs = 1;                    // Held by the bus until unplugged
+    d->present = 1;
+    d->product_id = products[port % (sizeof(products) / sizeof(products[0]))];
+    d->bus = 1 + port / 100;
+    d->port = 1 + port % 100;
+    d->address = g_soak.next_address = g_soak.next_address % 127 + 1;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.devices++;
+    g_sim.port[port] = d;
+    pthread_mutex_unlock(&g_sim.lock);
+    g_soak.arrived++;
+    if (!g_soak.polling) {
+        hotplug_callback(NULL, (libusb_device *)d, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, NULL);
+    }
+}
+
+static void soak_unplug(int port) {
+    struct sim_device *d = g_sim.port[port];
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.port[port] = NULL;
+    d->present = 0;
+    pthread_mutex_unlock(&g_sim.lock);
+    g_soak.left++;
+    if (!g_soak.polling) {
+        hotplug_callback(NULL, (libusb_device *)d, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, NULL);
+    }
+    sim_unref_device((libusb_device *)d);
+}
+
+// Resident set size in KiB
+static long soak_rss_kib(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Generator: plays the USB host controller and the libusb event loop. It
+// completes transfers at the target rate, churns hotplug and prints one
+// line per second, then unplugs everything.
+static void *soak_generator(void *arg) {
+    long *rss_start = arg;
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + (uint64_t)g_soak.seconds * 1000000000;
+    uint64_t next_report = start + 1000000000, next_churn = start, next_scan = start;
+    uint64_t ticks = 0, reported = 0;
+    int second = 0;
+
+    for (int i = 0; i < g_soak.devices; i++) soak_plug(i);
+    if (g_soak.churn_ms) next_churn += (uint64_t)g_soak.churn_ms * 1000000;
+    *rss_start = soak_rss_kib();
+
+    for (uint64_t now; (now = monotonic_ns()) < end;) {
+        uint64_t due = (now - start) * g_soak.rate_hz / 1000000000;
+        if (due > ticks + g_soak.rate_hz) { // Over a second behind, do not try to catch up
+            g_soak.lagged += due - ticks;
+            ticks = due;
+        }
+        while (ticks < due) sim_tick(++ticks);
+        if (!g_soak.threaded && g_soak.polling && now >= next_scan) {
+            scan_devices();
+            next_scan = now + (uint64_t)SOAK_SCAN_MS * 1000000;
+        }
+        if (!g_soak.threaded && g_closing) devices_reap();
+
+        if (g_soak.churn_ms && now >= next_churn) {
+            int port = rand_r(&g_soak.seed) % g_soak.devices;
+            if (g_sim.port[port]) soak_unplug(port);
+            else soak_plug(port);
+            // Uniform around the mean, so unplugs also land right after an attach
+            next_churn = now + (uint64_t)(rand_r(&g_soak.seed) % (2 * g_soak.churn_ms + 1)) * 1000000;
+        }
+
+        if (now >= next_report) {
+            struct latency_histogram *h = &g_soak.second;
+            uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+            pthread_mutex_lock(&g_sim.lock);
+            uint64_t completed = g_sim.completed;
+            long attached = g_sim.claims;
+            pthread_mutex_unlock(&g_sim.lock);
+            if (second == 0) *rss_start = soak_rss_kib(); // After the allocations of the first attach
+            printf("%4ds %4ld attached %10.0f packets/s  p50 %7.1f us  p99 %7.1f us  max %8.1f us  rss %ld KiB\n",
+                   ++second, attached, (completed - reported) * 1e9 / (now - next_report + 1000000000),
+                   latency_quantile(h, count, 0.50) / 1000.0, latency_quantile(h, count, 0.99) / 1000.0,
+                   atomic_load_explicit(&h->max_ns, memory_order_relaxed) / 1000.0, soak_rss_kib());
+            fflush(stdout);
+            memset(h, 0, sizeof(*h));
+            reported = completed;
+            next_report = now + 1000000000;
+        }
+
+        struct timespec ts;
+        uint64_t wake = start + (ticks + 1) * 1000000000 / g_soak.rate_hz;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    for (int i = 0; i < g_soak.devices; i++) {
+        if (g_sim.port[i]) soak_unplug(i);
+    }
+    atomic_store(&g_soak.done, 1);
+    return NULL;
+}
+
+// Soak test (-s): simulated tablets stream at well above hardware rates
+// while being plugged and pulled, through the driver's real hotplug, attach,
+// callback and teardown paths. Fails when objects are left over or a libusb
+// rule was broken.
+static int soak(void) {
+    long rss_start = 0, rss_end;
+    pthread_t generator;
+
+    g_sim.port = calloc(g_soak.devices, sizeof(*g_sim.port));
+    if (!g_sim.port) return EXIT_FAILURE;
+    g_sim.ports = g_soak.devices;
+    g_sim.enabled = 1;
+    g_running = 1;
+    g_latency_enabled = 1;
+    g_log_level = LOG_LEVEL_ERROR;  // Failed transfers of pulled tablets are expected
+    printf("soak: %d tablets at %d Hz for %d s, %s, hotplug %s%s\n", g_soak.devices, g_soak.rate_hz,
+           g_soak.seconds, g_soak.threaded ? "event thread" : "single thread",
+           g_soak.churn_ms ? "churning" : "off", g_soak.polling ? " (polled)" : "");
+
+    if (g_soak.threaded) {
+        // The generator is the event thread, attach and detach run here
+        g_event_thread_enabled = 1;
+        g_hotplug_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (g_hotplug_efd < 0) {
+            fprintf(stderr, "Error creating hotplug eventfd: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(&generator, NULL, soak_generator, &rss_start) != 0) {
+            fprintf(stderr, "Error starting the generator thread\n");
+            return EXIT_FAILURE;
+        }
+        while (!atomic_load(&g_soak.done)) {
+            struct pollfd pfd = { .fd = g_hotplug_efd, .events = POLLIN };
+            if (poll(&pfd, 1, g_soak.polling ? SOAK_SCAN_MS : 100) > 0) process_hotplug_queue();
+            if (g_soak.polling) scan_devices();
+            if (g_closing) devices_reap();
+        }
+        pthread_join(generator, NULL);
+        process_hotplug_queue();
+        close(g_hotplug_efd);
+        g_hotplug_efd = -1;
+    } else {
+        soak_generator(&rss_start);
+    }
+    rss_end = soak_rss_kib();
+
+    // Detach what the last scan still saw, deliver what is in flight, then
+    // nothing may be left
+    if (g_soak.polling) scan_devices();
+    sim_tick(UINT64_MAX);
+    devices_reap();
+    parked_expire(UINT64_MAX);
+
+    struct latency_histogram *h = &g_soak.total;
+    printf("%-16s %10s %10s %10s %10s %10s\n", "callback", "count", "mean us", "p50 us", "p99 us", "max us");
+    latency_print(stdout, "packet", h);
+    printf("packets %llu (%.0f/s), cancelled %llu, failed (no device) %llu, ticks lagged %llu\n",
+           g_sim.completed, (double)g_sim.completed / g_soak.seconds, g_sim.cancelled, g_sim.no_device,
+           (unsigned long long)g_soak.lagged);
+    printf("hotplug %llu arrived, %llu left\n", (unsigned long long)g_soak.arrived, (unsigned long long)g_soak.left);
+    printf("rss %ld KiB after attach, %ld KiB at the end (%+ld KiB)\n", rss_start, rss_end, rss_end - rss_start);
+    printf("left over: %ld devices, %ld handles, %ld claims, %ld transfers, %ld uinput nodes\n",
+           g_sim.devices, g_sim.handles, g_sim.claims, g_sim.transfers, g_sim.uinputs);
+    printf("libusb misuse: %llu freed before completion, %llu freed twice, %llu submitted after free, "
+           "%llu submitted twice\n", g_sim.freed_busy, g_sim.double_free, g_sim.submit_freed, g_sim.submit_busy);
+
+    int failed = g_sim.devices || g_sim.handles || g_sim.claims || g_sim.transfers || g_sim.uinputs ||
+                 g_sim.freed_busy || g_sim.double_free || g_sim.submit_freed || g_sim.submit_busy;
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    free(g_sim.port);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Reads a bounded positive integer option
+static int bench_int(const char *arg, int max, int *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || v < 1 || v > max) return -EINVAL;
+    *out = v;
+    return 0;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [capture ...]\n"
+            "Without capture files (from hvlusb -w) only the synthetic streams are run.\n"
+            "  -n N   passes over each stream (default %d)\n"
+            "  -N     write frames to /dev/null even if uinput is available\n"
+            "  -s S   soak test for S seconds on simulated tablets instead of the benchmarks\n"
+            "  -d N   soak: number of simulated tablets (default %d)\n"
+            "  -k HZ  soak: packets per second and tablet (default %d)\n"
+            "  -u MS  soak: mean time between plug/unplug events, 0 = none (default %d)\n"
+            "  -t     soak: run callbacks and hotplug on an event thread (as hvlusb -t)\n"
+            "  -P     soak: find the tablets by polling the bus (as hvlusb -P)\n"
+            "  -h     show this help\n",
+            prog, BENCH_ITERATIONS, SOAK_DEVICES, SOAK_RATE_HZ, SOAK_CHURN_MS);
+}
+
+int main(int argc, char **argv) {
+    unsigned iterations = BENCH_ITERATIONS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:Ns:d:k:u:tPh")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                if (iterations < 1) {
+                    fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                g_bench_devnull = 1;
+                break;
+            case 's':
+                if (bench_int(optarg, 86400, &g_soak.seconds) < 0) {
+                    fprintf(stderr, "Invalid soak duration '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                if (bench_int(optarg, 256, &g_soak.devices) < 0) {
+                    fprintf(stderr, "Invalid tablet count '%s' (1-256)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                if (bench_int(optarg, 1000000, &g_soak.rate_hz) < 0) {
+                    fprintf(stderr, "Invalid packet rate '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                if (strcmp(optarg, "0") == 0) g_soak.churn_ms = 0;
+                else if (bench_int(optarg, 60000, &g_soak.churn_ms) < 0) {
+                    fprintf(stderr, "Invalid churn interval '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                g_soak.threaded = 1;
+                break;
+            case 'P':
+                g_soak.polling = 1;
+                break;
+            case 'h':
+                bench_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                bench_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (g_soak.seconds) return soak();
+    g_log_level = LOG_LEVEL_WARN;   // Keep uinput creation messages out of the table
+
+    struct bench_stream synthetic[] = {
+        { .name = "synthetic-am",           .product_id = PRODUCT_ID_AM0806 },
+        { .name = "synthetic-gp0504",       .product_id = PRODUCT_ID_GP0504 },
+        { .name = "synthetic-0906-buttons", .product_id = PRODUCT_ID_GP0906 },
+        { .name = "synthetic-appiv",        .product_id = PRODUCT_ID_APPIV0906 },
+    };
+    synth_am(&synthetic[0]);
+    synth_am(&synthetic[1]);
+    synth_gp0906_buttons(&synthetic[2]);
+    synth_appiv(&synthetic[3]);
+
+    printf("%-24s %-16s %-10s %10s %10s %12s\n", "stream", "path", "sink", "packets", "ns/packet", "packets/s");
+    for (size_t i = 0; i < sizeof(synthetic) / sizeof(synthetic[0]); i++) {
+        bench_stream(&synthetic[i], iterations);
+        stream_free(&synthetic[i]);
+    }
+
+    for (int i = optind; i < argc; i++) {
+        struct bench_stream recorded = {0};
+        if (load_capture(&recorded, argv[i]) == 0) {
+            bench_stream(&recorded, iterations);
+        }
+        stream_free(&recorded);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/*
+* =====================================================================================
+*
+*       Filename:  hanvon-ipc.h
+*
+*    Description:  Rings between the USB front and the decoder worker (hvlusb -i)
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#ifndef HANVON_IPC_H
+#define HANVON_IPC_H
+
+// In isolated mode the privileged front process owns libusb and uinput and
+// a forked, unprivileged worker decodes. Both share one anonymous mapping
+// holding two single producer, single consumer rings of fixed size records:
+// raw transfers (and attach/detach notices) from the front to the worker,
+// finished event frames back. Records are written in place, so a packet
+// costs two copies and one eventfd wakeup per direction, no socket I/O.
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <linux/input.h>
+
+#include "libhanvon.h"
+
+#define HANVON_IPC_SLOTS        64      // Tablets the worker serves at the same time
+#define HANVON_IPC_PACKETS      256     // Power of two
+#define HANVON_IPC_FRAMES       256     // Power of two
+#define HANVON_IPC_MAX_PACKET   3072    // Largest interrupt transfer
+
+enum hanvon_ipc_kind {
+    HANVON_IPC_ATTACH,                  // A tablet got the slot, start a fresh decoder
+    HANVON_IPC_PACKET,                  // One completed transfer of the slot
+    HANVON_IPC_DETACH,                  // The tablet left, drop its decoder
+    HANVON_IPC_CONFIG,                  // Reloaded settings in data, retune every decoder (no slot)
+};
+
+// Front to worker
+struct hanvon_ipc_packet {
+    uint8_t kind;                       // enum hanvon_ipc_kind
+    uint8_t slot;
+    uint8_t bus, address;
+    uint16_t product_id;
+    uint16_t len;                       // Bytes of data used
+    uint32_t generation;                // Attach count of the slot, tells stale frames apart
+    int32_t interval_us;                // Endpoint polling interval (ATTACH)
+    int32_t packet_len;                 // Endpoint wMaxPacketSize (ATTACH)
+    int32_t max_x, max_y;               // Axis range of the front's input device (ATTACH)
+    uint64_t time_ns;                   // CLOCK_MONOTONIC arrival of the transfer
+    unsigned char data[HANVON_IPC_MAX_PACKET];
+};
+
+// Worker to front, one SYN_REPORT frame with its events already stamped
+struct hanvon_ipc_frame {
+    uint8_t slot;
+    uint8_t reserved;
+    uint16_t count;
+    uint32_t generation;
+    struct input_event ev[HANVON_FRAME_MAX_EVENTS];
+};
+
+// Free running indices, the record of index i is at i & (size - 1)
+struct hanvon_ipc_ring {
+    _Alignas(64) _Atomic uint32_t head; // Records produced
+    _Alignas(64) _Atomic uint32_t tail; // Records consumed
+};
+
+struct hanvon_ipc {
+    struct hanvon_ipc_ring packets;
+    struct hanvon_ipc_ring frames;
+    _Atomic uint32_t resync[HANVON_IPC_SLOTS]; // Set by the front after a failed write
+    struct hanvon_ipc_packet packet[HANVON_IPC_PACKETS];
+    struct hanvon_ipc_frame frame[HANVON_IPC_FRAMES];
+};
+
+// Producer side: index of the record to fill, or -1 when the ring is full
+static inline int64_t hanvon_ipc_reserve(struct hanvon_ipc_ring *ring, uint32_t size) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= size) return -1;
+    return head & (size - 1);
+}
+
+// Producer side: publishes the record returned by hanvon_ipc_reserve
+static inline void hanvon_ipc_commit(struct hanvon_ipc_ring *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Consumer side: index of the oldest record, or -1 when the ring is empty
+static inline int64_t hanvon_ipc_peek(struct hanvon_ipc_ring *ring, uint32_t size) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) return -1;
+    return tail & (size - 1);
+}
+
+// Consumer side: hands the record returned by hanvon_ipc_peek back
+static inline void hanvon_ipc_release(struct hanvon_ipc_ring *ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+#endif // HANVON_IPC_H
@@ -17,8 +17,39 @@
 * =====================================================================================
 */
 
+#define _GNU_SOURCE // For pthread_setaffinity_np and CPU_SET
+
+// Logging. Every message has a level; messages above g_log_level (-v/-q)
+// cost one predicted-not-taken branch. TRACE is compiled out entirely unless
+// HANVON_ENABLE_TRACE is defined. The *_RL variants are for the packet path:
+// each call site prints at most LOG_RL_BURST messages per second and reports
+// how many it suppressed, so a stuck error condition cannot flood the journal.
 // Use ##__VA_ARGS__ for portability with zero arguments
-#define DEBUG(msg,...) fprintf(stderr,"%s(%d): " msg "\n", __FILE__,__LINE__, ##__VA_ARGS__)
+#define LOG_RL_BURST 5
+#define LOG_ENABLED(level) __builtin_expect((level) <= g_log_level, 0)
+#define LOG_PRINT(msg,...) fprintf(stderr,"%s(%d): " msg "\n", __FILE__,__LINE__, ##__VA_ARGS__)
+#define LOG(level, msg,...) do { \
+        if (LOG_ENABLED(level)) LOG_PRINT(msg, ##__VA_ARGS__); \
+    } while (0)
+#define LOG_RL(level, msg,...) do { \
+        static struct log_ratelimit _rl; \
+        unsigned _suppressed; \
+        if (LOG_ENABLED(level) && log_ratelimit_pass(&_rl, &_suppressed)) { \
+            if (_suppressed) LOG_PRINT("(%u similar messages suppressed)", _suppressed); \
+            LOG_PRINT(msg, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define ERROR(msg,...)   LOG(LOG_LEVEL_ERROR, msg, ##__VA_ARGS__)
+#define WARN(msg,...)    LOG(LOG_LEVEL_WARN, msg, ##__VA_ARGS__)
+#define INFO(msg,...)    LOG(LOG_LEVEL_INFO, msg, ##__VA_ARGS__)
+#define DEBUG(msg,...)   LOG(LOG_LEVEL_DEBUG, msg, ##__VA_ARGS__)
+#define WARN_RL(msg,...) LOG_RL(LOG_LEVEL_WARN, msg, ##__VA_ARGS__)
+#ifdef HANVON_ENABLE_TRACE
+#define TRACE(msg,...)   LOG(LOG_LEVEL_TRACE, msg, ##__VA_ARGS__)
+#else
+#define TRACE(msg,...)   do { } while (0)
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,113 +57,288 @@
 #include <errno.h>  // For error codes like EINVAL
 #include <signal.h> // For signal handling
 #include <unistd.h> // For pause() or sleep() if needed
-#include <math.h>   // For abs
+#include <fcntl.h>  // For open() of /dev/null when replaying
 #include <endian.h> // For htobe16/be16toh (if needed, currently using manual shifts)
+#include <pthread.h> // For the dedicated USB event thread
+#include <sched.h>   // For SCHED_FIFO and CPU affinity
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h> // For NAME_MAX
+#include <sys/eventfd.h>
+#include <stdatomic.h> // For the lock-free latency histograms
+#include <time.h>      // For clock_gettime
+#include <sys/socket.h> // For the stats socket
+#include <sys/un.h>
+#include <sys/mman.h> // For the shared memory pen state ring
+#include <sys/epoll.h>  // For the main loop
+#include <sys/signalfd.h>
+#include <sys/timerfd.h> // For the idle poll timer
+#include <sys/prctl.h>  // For the worker of the isolated mode
+#include <sys/wait.h>
+#include <ctype.h>    // For parsing the configuration file
+#include <grp.h>
+#include <pwd.h>
 
 #include <libusb-1.0/libusb.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
-// Define standard button codes if not included by libevdev headers directly
-// These might vary slightly depending on your kernel headers version
-#ifndef BTN_0
-#define BTN_0 0x100
-#endif
-#ifndef BTN_1
-#define BTN_1 0x101
-#endif
-#ifndef BTN_2
-#define BTN_2 0x102
-#endif
-#ifndef BTN_3
-#define BTN_3 0x103
-#endif
-#ifndef BTN_4
-#define BTN_4 0x104
-#endif
-#ifndef BTN_5
-#define BTN_5 0x105
-#endif
-#ifndef BTN_6
-#define BTN_6 0x106
-#endif
-#ifndef BTN_7
-#define BTN_7 0x107
-#endif
-#ifndef BTN_MIDDLE
-#define BTN_MIDDLE 0x112
-#endif
+#include "libhanvon.h"
+#include "hanvon-shm.h"
+#include "hanvon-ipc.h"
+
+#define AM_TRANSFER_RING_DEPTH  4  // Minimum default number of interrupt transfers kept queued
+#define AM_TRANSFER_RING_MAX    32 // Upper bound for the -r option
+#define AM_TRANSFER_RING_COVER_US 4000 // Default ring holds this much polling time
+#define AM_ENDPOINT_DEFAULT     0x81 // Interrupt IN endpoint when the descriptor cannot be read
+#define AM_TRANSFER_MAX_LEN     3072 // Largest interrupt packet (high speed, 3 transactions)
+#define AM_TRANSFER_PACKETS_MAX 16   // Upper bound for the -b option
+#define LATENCY_BUCKETS         32 // log2(ns) histogram buckets, the last one is open ended
+#define GAP_THRESHOLD_NS        20000000 // Pen report interval counted as a gap (20 ms)
+#define DEVICE_CLOSING          (1 << 30) // In hdev->inflight once the teardown started
+#define TEARDOWN_TIMEOUT_MS     1000 // At exit, wait this long for cancelled transfers
+#define SCAN_FAST_MS            250  // Polling enumeration: interval after startup or a change
+#define SCAN_FAST_COUNT         8    // Scans at SCAN_FAST_MS before backing off
+#define SCAN_SLOW_MS            4000 // Interval once nothing changed for a while
+
+// Lock-free log2 histogram of durations. Bucket i counts samples in
+// [2^i, 2^(i+1)) ns. Only the event thread writes; readers may run anywhere.
+struct latency_histogram {
+    atomic_uint_fast64_t bucket[LATENCY_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+};
+
+// Per-device latency of the packet path, measured from transfer callback
+// entry to the end of decoding and to the end of the uinput write
+struct latency_stats {
+    struct latency_histogram decode;    // Callback entry -> decoded
+    struct latency_histogram emit;      // Decoded -> frame written
+    struct latency_histogram total;     // Callback entry -> frame written
+    struct latency_histogram interval;  // Arrival -> next arrival
+};
+
+// Message type slots of device_counters.packets
+enum packet_type {
+    PACKET_BUTTON_GP,
+    PACKET_PEN,
+    PACKET_BUTTON_0906,
+    PACKET_OTHER,
+    PACKET_TYPES,
+};
 
+// Per-device packet and error counters. Written by the event thread with
+// relaxed atomics, read by the stats output.
+struct device_counters {
+    atomic_uint_fast64_t packets[PACKET_TYPES]; // Reports by message type
+    atomic_uint_fast64_t short_packets;     // Too short for their message type
+    atomic_uint_fast64_t transfer_errors;   // Completed with an error status
+    atomic_uint_fast64_t resubmit_failures; // libusb_submit_transfer failed in the callback
+    atomic_uint_fast64_t uinput_errors;     // Frame write failed
+    atomic_uint_fast64_t gaps;              // Pen reports more than GAP_THRESHOLD_NS apart while in range
+    atomic_uint_fast64_t batched;           // Transfers that carried more than one report
+    atomic_uint_fast64_t coalesced;         // Hover reports merged into the next frame (-H)
+    atomic_uint_fast64_t dropped;           // Transfers or frames lost to a full worker ring (-i)
+    atomic_uint_fast64_t idle_entered;      // Times the idle policy kicked in (-I)
+    atomic_uint_fast64_t idle_skipped;      // Repeated transfers neither decoded nor emitted
+};
+
+// Identity of a tablet across replugs: the device address changes every time,
+// the port it is plugged into and its serial number do not
+struct device_key {
+    uint8_t bus;
+    uint8_t num_ports;
+    uint8_t ports[7];                   // Port path from the root hub (USB allows 7 tiers)
+    uint16_t product_id;
+    char serial[64];                    // iSerialNumber string, empty when the tablet has none
+};
+
+// Per-device context. One is allocated for every attached tablet and linked
+// into g_devices, so each device has its own transfers, uinput node and state.
+// Within the grace window (-g) after a disconnect it is parked in g_parked
+// with its uinput node still open, and reused when the same tablet returns.
+struct hanvon_device {
+    struct hanvon_device *next;
+    libusb_device_handle *handle;
+    struct libevdev *evdev;
+    struct libevdev_uinput *uidev;
+    int uinput_fd;                      // Frames are written here (uidev's fd, /dev/null with -N)
+    uint16_t product_id;
+    const struct hanvon_profile *profile; // Model description from libhanvon
+    // Ring of interrupt transfers, each with its own slot of buffer. All of them are
+    // queued on the endpoint so a URB is always in flight while a packet is being decoded.
+    struct libusb_transfer *tx[AM_TRANSFER_RING_MAX];
+    unsigned char *buffer;              // ring_depth slots of transfer_len bytes
+    unsigned char endpoint;             // Interrupt IN endpoint from the config descriptor
+    int packet_len;                     // Its wMaxPacketSize
+    int transfer_len;                   // Length of every transfer, g_transfer_packets packets
+    int interval_us;                    // Its polling interval, 0 when unknown
+    int ring_depth;                     // Number of ring slots in use
+    struct hanvon_decoder dec;          // Pen state and last values written to uidev
+    struct hanvon_tuning *tuning;       // What dec reads, built from g_config (main thread)
+    int max_x, max_y;                   // ABS_X/ABS_Y maximum of the input device, fixed at creation
+    uint8_t bus, address;               // USB location, for stats output
+    struct latency_stats latency;       // Filled when g_latency_enabled
+    struct device_counters counters;
+    uint64_t last_pen_ns;               // Time of the last in-range pen report (event thread)
+    atomic_uint_fast64_t last_packet_ns; // Arrival time of the last packet
+    uint64_t stats_ns;                  // Time of the previous stats output (main thread)
+    uint64_t stats_packets;             // Packet total at the previous stats output
+    struct device_key key;              // Matches a returning tablet to its parked context
+    uint64_t parked_until_ns;           // End of the grace window while parked (main thread)
+    // Idle policy (-I), owned by the transfer callback except idle_parked
+    int idle;                           // Repeated transfers are skipped
+    int idle_repeats;                   // Transfers in a row equal to idle_last
+    int idle_len;
+    unsigned char idle_last[AM_TRANSFER_MAX_LEN]; // Contents of the previous transfer
+    _Atomic uint32_t idle_parked;       // Ring slots held back until the next idle poll, bit per slot
+    // Teardown (device_detach/devices_reap)
+    atomic_int inflight;                // Transfers queued or in their callback, | DEVICE_CLOSING
+    int park;                           // Keep the input device for the grace window once closed
+    int ipc_slot;                       // Worker ring slot while attached (-i), -1 otherwise
+    uint32_t ipc_generation;            // Attach count of the slot when it was taken
+};
 
-#define VENDOR_ID_HANVON        0x0b57
-#define PRODUCT_ID_AM3M         0x8528
-#define PRODUCT_ID_AM0806       0x8502
-#define PRODUCT_ID_AM0605       0x8503
-#define PRODUCT_ID_AM1107       0x8505
-#define PRODUCT_ID_AM1209       0x8501
-#define PRODUCT_ID_RL0604       0x851f
-#define PRODUCT_ID_RL0504       0x851d
-#define PRODUCT_ID_GP0806       0x8039
-#define PRODUCT_ID_GP0806B      0x8511
-#define PRODUCT_ID_GP0605       0x8512
-#define PRODUCT_ID_GP0605A      0x803a
-#define PRODUCT_ID_GP0504       0x8037
-#define PRODUCT_ID_NXS1513      0x8030
-#define PRODUCT_ID_GP0906       0x8521
-#define PRODUCT_ID_APPIV0906    0x8532
-
-#define AM_PACKET_LEN           10
-#define AM_RESOLUTION           40 // Dots per mm? Check kernel driver or specs
-#define AM_WHEEL_THRESHOLD      4
-
-// Default max coordinates (check per device if necessary)
-#define AM_MAX_ABS_X            0x27DE
-#define AM_MAX_ABS_Y            0x1CFE
-#define AM_MAX_TILT_X           0x3F // Check if signed or unsigned
-#define AM_MAX_TILT_Y           0x7F // Check if signed or unsigned
-#define AM_MAX_PRESSURE         0x400 // 1024 levels
-
-// APPIV0906 specific max coordinates
-#define APPIV_MAX_ABS_X         0x5750
-#define APPIV_MAX_ABS_Y         0x3692 // Kernel driver uses this, not 0x5750
-
-// Message types from device
-#define BUTTON_EVENT_GP         0x01 // General purpose button/wheel event
-#define PEN_EVENT               0x02 // Pen movement/status event
-#define BUTTON_EVENT_0906       0x0C // Specific button event for GP0906/APPIV0906
-
-// Button mappings
-static int lbuttons[]={BTN_0,BTN_1,BTN_2,BTN_3};   /* reported on most AM/GP */
-static int rbuttons[]={BTN_4,BTN_5,BTN_6,BTN_7};   /* reported on AM1107/AM1209 */
-
-// Structure overlay for PEN_EVENT (Use with caution, verify offsets)
-// Note: Endianness of shorts depends on device protocol (often Big Endian)
-struct hanvon_pen_message {
-    unsigned char msgtype;      // Should be PEN_EVENT (0x02)
-    unsigned char status;       // Contains flags for proximity, touch, buttons
-    unsigned char x_hi;         // X coordinate high byte
-    unsigned char x_lo;         // X coordinate low byte
-    unsigned char y_hi;         // Y coordinate high byte
-    unsigned char y_lo;         // Y coordinate low byte
-    unsigned char pressure_hi;  // Pressure high byte (often only low byte used or shifted)
-    unsigned char pressure_lo;  // Pressure low byte
-    unsigned char tilt_x;       // Tilt X value
-    unsigned char tilt_y;       // Tilt Y value
+// GLOBAL state
+static struct hanvon_device *g_devices = NULL; // List of attached devices
+static struct hanvon_device *g_parked = NULL;  // Disconnected devices within their grace window
+static struct hanvon_device *g_closing = NULL; // Detached devices waiting for their cancelled transfers
+static int g_grace_ms = 0;          // Keep the uinput node this long after a disconnect (-g)
+static int g_transfer_packets = 1;  // Max-size packets per interrupt transfer (-b)
+static int g_coalesce_hover = 0;    // Merge hover reports of one transfer into one frame (-H)
+static int g_idle_samples = 0;      // Go idle after this many identical transfers (-I), 0 = never
+static int g_idle_poll_ms = 0;      // While idle, resubmit one transfer this often (-I), 0 = all at once
+static int g_idle_tfd = -1;         // Periodic idle poll, armed while any transfer is parked
+static atomic_int g_idle_armed = 0;
+static int g_scan_enabled = 0;      // Enumerate by polling instead of hotplug (-P, or no hotplug support)
+static int g_scan_tfd = -1;         // Next polling enumeration, one shot
+static int g_scan_interval_ms = SCAN_FAST_MS;
+static int g_scan_fast_left = SCAN_FAST_COUNT; // Scans left before the interval grows
+static atomic_int g_scan_reset = 0; // A transfer saw its tablet vanish, scan again soon
+static struct hanvon_ipc *g_ipc = NULL; // Rings shared by the front and the worker (-i)
+static int g_ipc_worker = 0;        // Set in the worker process
+static pid_t g_ipc_pid = -1;        // Worker process, seen from the front
+static int g_ipc_packet_efd = -1;   // Wakes the worker, blocking reads
+static int g_ipc_frame_efd = -1;    // Wakes the front's main loop
+static pthread_mutex_t g_ipc_lock = PTHREAD_MUTEX_INITIALIZER; // Packet ring producers (both threads)
+static struct hanvon_device *g_ipc_slots[HANVON_IPC_SLOTS]; // Context of every slot, in each process
+static uint32_t g_ipc_generations[HANVON_IPC_SLOTS]; // Front: attach count of every slot
+
+// Settings a reload of the configuration file (-k) can change. The options
+// give the defaults and the file overrides what it sets; every reload starts
+// again from the options, so a line removed from the file reverts to them.
+struct daemon_config {
+    int ring_depth;                     // Ring slots per device (-r), 0 = from the polling interval
+    int priority;                       // SCHED_FIFO priority of the event thread (-p), 0 = default scheduling
+    int filter_enabled;                 // Smooth X/Y with the profile's motion filter (-f)
+    int predict_us;                     // Prediction horizon override (-F), -1 = profile default
+    int mapping_enabled;                // Apply mapping to every tablet (-C, -A, -O)
+    struct hanvon_mapping_params mapping;
+    struct hanvon_pad_params pad;       // Pad keys, combos, tap/hold and chords
+};
+static struct daemon_config g_config = {
+    .predict_us = -1,
+    .mapping = { .curve = { 0.0f, 0.0f, 1.0f, 1.0f } },
 };
+static struct daemon_config g_config_options; // g_config as the options left it
+static const char *g_config_path = NULL; // Configuration file (-k)
 
-// GLOBAL state (RETAINS SINGLE DEVICE LIMITATION)
-// TODO: Refactor to handle multiple devices using a context struct list
-static libusb_device_handle *g_dev_handle = NULL;
-static struct libevdev_uinput *g_uidev = NULL;
-static struct libevdev *g_evdev = NULL;
-static struct libusb_transfer *g_tx = NULL;
-static unsigned char g_buffer[AM_PACKET_LEN];
+// How event frames are handed to uinput
+enum emit_mode {
+    EMIT_BATCHED,   // One write() per SYN_REPORT frame (default)
+    EMIT_PER_EVENT, // One libevdev_uinput_write_event() call per event
+};
+static enum emit_mode g_emit_mode = EMIT_BATCHED;
 static volatile sig_atomic_t g_running = 1; // Flag for main loop termination
-static int g_wheel_position = 0; // Global wheel position state
+static int g_delta_suppression = 1; // Skip events that repeat the last value
+static int g_latency_enabled = 0;   // Record per-device latency histograms (-l)
+static volatile sig_atomic_t g_dump_stats = 0; // Set by SIGUSR1 while replaying
+static const char *g_stats_path = NULL; // Stats socket path (-S)
+static int g_stats_fd = -1;         // Listening stats socket
+static FILE *g_capture = NULL;      // Raw packet capture file (-w)
+static int g_replay_realtime = 0;   // Replay at the recorded pace (-T)
+static int g_replay_discard = 0;    // Replay into /dev/null instead of uinput (-N)
+static const char *g_shm_name = NULL; // Shared memory pen state ring (-m)
+static struct hanvon_shm_ring *g_shm_ring = NULL;
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE,
+};
+
+static int g_log_level = LOG_LEVEL_INFO; // Raised by -v, lowered by -q
+
+// Per call site state of LOG_RL
+struct log_ratelimit {
+    time_t window;                      // Second the current burst started in
+    unsigned printed;                   // Messages printed in that second
+    unsigned suppressed;                // Messages dropped since the last print
+};
+
+static int log_ratelimit_pass(struct log_ratelimit *rl, unsigned *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    if (ts.tv_sec != rl->window) {
+        rl->window = ts.tv_sec;
+        rl->printed = 0;
+    }
+    if (rl->printed >= LOG_RL_BURST) {
+        rl->suppressed++;
+        return 0;
+    }
+    rl->printed++;
+    *suppressed = rl->suppressed;
+    rl->suppressed = 0;
+    return 1;
+}
+
+// Dedicated USB event thread (-t/-p/-c). When enabled, the event thread only
+// runs libusb event handling (transfer callbacks, decode and emit); hotplug
+// events are queued to the main thread, which does attach/detach work.
+static int g_event_thread_enabled = 0;
+static int g_event_thread_cpu = -1;     // CPU to pin the event thread to, -1 = any
+static pthread_t g_event_thread;
+static int g_event_thread_running = 0;  // Started and not yet stopped (main thread)
+static atomic_uint g_event_passes;      // Returns of the event thread from libusb
+static atomic_int g_event_exited;       // The event thread left its loop
+
+// Hotplug event queued from the event thread to the main thread
+struct hotplug_work {
+    struct hotplug_work *next;
+    libusb_device *dev;                 // Referenced until processed
+    libusb_hotplug_event event;
+};
+static pthread_mutex_t g_hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_work *g_hotplug_head = NULL;
+static struct hotplug_work *g_hotplug_tail = NULL;
+static int g_hotplug_efd = -1;          // Signalled when work is queued
+
+#define LOOP_MAX_EVENTS 16              // epoll events handled per wakeup
+static int g_epoll_fd = -1;             // Main loop: signals, sockets, hotplug queue, libusb fds
+static int g_signal_fd = -1;            // SIGINT/SIGTERM/SIGUSR1/SIGHUP, blocked for normal delivery
+
+// Client of the stats socket that stays connected for commands
+#define CONTROL_MAX_CLIENTS 8
+struct control_client {
+    int fd;                             // -1 when the entry is free
+    size_t len;                         // Bytes of an unfinished command line in buf
+    char buf[128];
+};
+static struct control_client g_control[CONTROL_MAX_CLIENTS];
 
 // Forward declarations
-int init_ctrl(struct libusb_device *dev, struct libevdev **evdev, struct libevdev_uinput **uidev);
+int init_ctrl(const struct hanvon_decoder *dec, uint16_t version,
+              struct libevdev **evdev, struct libevdev_uinput **uidev);
 void callback_default (struct libusb_transfer *tx);
+static void device_close(struct hanvon_device *hdev, int park);
+static int ipc_attach(struct hanvon_device *hdev);
+static void ipc_detach(struct hanvon_device *hdev);
+static void ipc_receive_frames(void);
+static void event_thread_sync(void);
 
 
 // Finds the first supported Hanvon device in the list
@@ -148,34 +354,16 @@ int find_device(libusb_device **list, unsigned int count) {
 
         int rc = libusb_get_device_descriptor(list[i], &desc);
         if (rc < 0) {
-            DEBUG("Failed to get device descriptor for device %u", i);
+            ERROR("Failed to get device descriptor for device %u", i);
             continue; // Skip devices we can't query
         }
 
         if (desc.idVendor == VENDOR_ID_HANVON) {
-            switch(desc.idProduct) {
-                // Add all known supported product IDs here
-                case PRODUCT_ID_AM3M:
-                case PRODUCT_ID_AM0806:
-                case PRODUCT_ID_AM0605:
-                case PRODUCT_ID_AM1107:
-                case PRODUCT_ID_AM1209:
-                case PRODUCT_ID_RL0604:
-                case PRODUCT_ID_RL0504:
-                case PRODUCT_ID_GP0806:
-                case PRODUCT_ID_GP0806B:
-                case PRODUCT_ID_GP0605:
-                case PRODUCT_ID_GP0605A:
-                case PRODUCT_ID_GP0504:
-                case PRODUCT_ID_NXS1513:
-                case PRODUCT_ID_GP0906:
-                case PRODUCT_ID_APPIV0906:
-                    DEBUG("Found supported Hanvon device %04x:%04x at index %u", desc.idVendor, desc.idProduct, i);
-                    return i; // Return index of the first found supported device
-                default:
-                    DEBUG("Found unsupported Hanvon device %04x:%04x", desc.idVendor, desc.idProduct);
-                    break; // Continue searching
+            if (hanvon_profile_lookup(desc.idProduct) != NULL) {
+                DEBUG("Found supported Hanvon device %04x:%04x at index %u", desc.idVendor, desc.idProduct, i);
+                return i; // Return index of the first found supported device
             }
+            DEBUG("Found unsupported Hanvon device %04x:%04x", desc.idVendor, desc.idProduct);
         }
     }
     return -1; // No supported device found
@@ -190,263 +378,732 @@ void display_packets(const unsigned char* buf, size_t len) {
     fprintf(stderr,"\n"); // Use newline instead of carriage return
 }
 
-// Helper function to report button events
-static inline void report_buttons( struct libevdev_uinput *ud,
-                                   int buttons[], // Array of BTN_ codes
-                                   size_t num_buttons, // Size of the buttons array
-                                   unsigned char data) // Byte containing button flags
-{
+// Writes n events to fd with as few write() calls as the kernel allows
+static int write_events(int fd, const struct input_event *ev, size_t n) {
+    const char *buf = (const char *)ev;
+    size_t len = n * sizeof(ev[0]);
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Sends the frame terminated by SYN_REPORT to the uinput device (or to fd
+// alone when there is no uinput device, see -N). An empty frame (everything
+// filtered out) is not written at all. EMIT_BATCHED issues one write() for
+// the whole frame; EMIT_PER_EVENT keeps the old one libevdev call per event
+// path. Returns 0 or a negative errno.
+static int frame_write(struct libevdev_uinput *ud, int fd, const struct input_event *ev, int count) {
     int err = 0;
-    // Check specific pattern for AM/GP buttons (data[2] or data[4])
-    if ((data & 0xf0) == 0xa0) {
-        // These seem to map to buttons 1, 2, 3 in the array (index 1, 2, 3)
-        // Ensure array bounds are checked
-        if (num_buttons > 1) {
-            err = libevdev_uinput_write_event(ud, EV_KEY, buttons[1], !!(data & 0x02)); // Use !! for bool
-            if(err) { DEBUG("err reporting button %d: %d", buttons[1], err); }
+
+    if (g_emit_mode == EMIT_PER_EVENT) {
+        for (int i = 0; i < count && !err; i++) {
+            if (ud) {
+                err = libevdev_uinput_write_event(ud, ev[i].type, ev[i].code, ev[i].value);
+            } else {
+                err = write_events(fd, &ev[i], 1);
+            }
         }
-        if (num_buttons > 2) {
-            err = libevdev_uinput_write_event(ud, EV_KEY, buttons[2], !!(data & 0x04));
-            if(err) { DEBUG("err reporting button %d: %d", buttons[2], err); }
+    } else {
+        err = write_events(fd, ev, count);
+    }
+    return err;
+}
+
+static int frame_flush(struct libevdev_uinput *ud, int fd, struct hanvon_frame *frame) {
+    if (hanvon_frame_end(frame) == 0) {
+        return 0;
+    }
+    int err = frame_write(ud, fd, frame->ev, frame->count);
+    hanvon_frame_written(frame, err == 0);
+    return err;
+}
+
+// Monotonic time in nanoseconds
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Adds one sample to the histogram. Single writer, so relaxed atomics are
+// enough and no lock or read-modify-write loop is needed except for max.
+static inline void latency_record(struct latency_histogram *h, uint64_t ns) {
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (b >= LATENCY_BUCKETS) b = LATENCY_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+}
+
+// Upper bound (in ns) of the bucket holding the given quantile
+// (never above the largest sample seen)
+static uint64_t latency_quantile(const struct latency_histogram *h, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(count * q), seen = 0;
+    uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+        if (seen > rank) return (2ull << b) < max ? (2ull << b) : max;
+    }
+    return max;
+}
+
+static void latency_print(FILE *out, const char *name, const struct latency_histogram *h) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    if (count == 0) {
+        fprintf(out, "    %-8s %10d\n", name, 0);
+        return;
+    }
+    fprintf(out, "    %-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long)count, sum / 1000.0 / count,
+            latency_quantile(h, count, 0.50) / 1000.0,
+            latency_quantile(h, count, 0.99) / 1000.0,
+            atomic_load_explicit(&h->max_ns, memory_order_relaxed) / 1000.0);
+}
+
+#define COUNTER(c) ((unsigned long long)atomic_load_explicit(&(c), memory_order_relaxed))
+
+// Writes the statistics of every attached device (SIGUSR1 and stats socket).
+// The packet rate is measured since the previous stats output.
+static void write_stats(FILE *out) {
+    uint64_t now = monotonic_ns();
+    int n = 0;
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) n++;
+    fprintf(out, "devices %d\n", n);
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) {
+        struct device_counters *c = &hdev->counters;
+        uint64_t total = 0;
+        for (int i = 0; i < PACKET_TYPES; i++) total += COUNTER(c->packets[i]);
+        double rate = now > hdev->stats_ns ?
+                (total - hdev->stats_packets) * 1e9 / (now - hdev->stats_ns) : 0.0;
+        hdev->stats_ns = now;
+        hdev->stats_packets = total;
+
+        fprintf(out, "device %03u:%03u %04x:%04x %s\n", hdev->bus, hdev->address,
+                VENDOR_ID_HANVON, hdev->product_id, hdev->profile->name);
+        fprintf(out, "    packets      button=%llu pen=%llu button0906=%llu other=%llu rate=%.1f/s\n",
+                COUNTER(c->packets[PACKET_BUTTON_GP]), COUNTER(c->packets[PACKET_PEN]),
+                COUNTER(c->packets[PACKET_BUTTON_0906]), COUNTER(c->packets[PACKET_OTHER]), rate);
+        fprintf(out, "    errors       short=%llu transfer=%llu resubmit=%llu uinput=%llu gaps=%llu dropped=%llu\n",
+                COUNTER(c->short_packets), COUNTER(c->transfer_errors), COUNTER(c->resubmit_failures),
+                COUNTER(c->uinput_errors), COUNTER(c->gaps), COUNTER(c->dropped));
+        fprintf(out, "    batching     transfers=%llu coalesced=%llu\n",
+                COUNTER(c->batched), COUNTER(c->coalesced));
+        fprintf(out, "    idle         entered=%llu skipped=%llu\n",
+                COUNTER(c->idle_entered), COUNTER(c->idle_skipped));
+        fprintf(out, "    arrival      last=%llu ns\n", COUNTER(hdev->last_packet_ns));
+        if (g_latency_enabled) {
+            fprintf(out, "    latency       count    mean_us     p50_us     p99_us     max_us\n");
+            latency_print(out, "decode", &hdev->latency.decode);
+            latency_print(out, "emit", &hdev->latency.emit);
+            latency_print(out, "total", &hdev->latency.total);
+            latency_print(out, "interval", &hdev->latency.interval);
         }
-        if (num_buttons > 3) {
-            err = libevdev_uinput_write_event(ud, EV_KEY, buttons[3], !!(data & 0x08));
-            if(err) { DEBUG("err reporting button %d: %d", buttons[3], err); }
+    }
+    fflush(out);
+}
+
+// Creates the listening stats socket at path. Every client that connects
+// gets the output of write_stats, then may send commands (control_serve).
+static int open_stats_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating stats socket: %s\n", strerror(errno));
+        return -errno;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path); // Remove a stale socket of a previous run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        int err = errno;
+        fprintf(stderr, "Error binding stats socket %s: %s\n", path, strerror(err));
+        close(fd);
+        return -err;
+    }
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) g_control[i].fd = -1;
+    INFO("Stats socket listening on %s", path);
+    return fd;
+}
+
+// Counts a packet by its message type
+static inline void count_packet(struct device_counters *c, unsigned char msgtype) {
+    int type;
+    switch (msgtype) {
+        case BUTTON_EVENT_GP:   type = PACKET_BUTTON_GP; break;
+        case PEN_EVENT:         type = PACKET_PEN; break;
+        case BUTTON_EVENT_0906: type = PACKET_BUTTON_0906; break;
+        default:                type = PACKET_OTHER; break;
+    }
+    atomic_fetch_add_explicit(&c->packets[type], 1, memory_order_relaxed);
+}
+
+#define COUNT(c) atomic_fetch_add_explicit(&(c), 1, memory_order_relaxed)
+
+// Raw packet capture (-w) and replay (-R). The file is a header followed by
+// one record per completed transfer, all fields little endian:
+//   header: "HVCAP" '\0' u16 version
+//   record: u64 monotonic ns, u16 product id, u8 bus, u8 address, u16 length, data
+#define CAPTURE_MAGIC "HVCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN 8
+#define CAPTURE_RECORD_LEN 14
+#define CAPTURE_MAX_PACKET AM_TRANSFER_MAX_LEN
+
+static int capture_open(const char *path) {
+    unsigned char header[CAPTURE_HEADER_LEN] = CAPTURE_MAGIC;
+    uint16_t version = htole16(CAPTURE_VERSION);
+
+    g_capture = fopen(path, "wb");
+    if (!g_capture) {
+        fprintf(stderr, "Error opening capture file %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    // Records are small, let stdio batch them into large writes
+    setvbuf(g_capture, NULL, _IOFBF, 1 << 16);
+    memcpy(header + 6, &version, sizeof(version));
+    if (fwrite(header, sizeof(header), 1, g_capture) != 1) {
+        fprintf(stderr, "Error writing capture file %s\n", path);
+        fclose(g_capture);
+        g_capture = NULL;
+        return -EIO;
+    }
+    INFO("Capturing raw packets to %s", path);
+    return 0;
+}
+
+// Appends one packet to the capture file (event thread)
+static void capture_packet(const struct hanvon_device *hdev, const unsigned char *data,
+                           int len, uint64_t ns) {
+    unsigned char record[CAPTURE_RECORD_LEN];
+    uint64_t ns_le = htole64(ns);
+    uint16_t pid_le = htole16(hdev->product_id);
+    uint16_t len_le = htole16(len);
+
+    memcpy(record, &ns_le, 8);
+    memcpy(record + 8, &pid_le, 2);
+    record[10] = hdev->bus;
+    record[11] = hdev->address;
+    memcpy(record + 12, &len_le, 2);
+    if (fwrite(record, sizeof(record), 1, g_capture) != 1 ||
+        fwrite(data, 1, len, g_capture) != (size_t)len) {
+        WARN_RL("Error writing capture file: %s", strerror(errno));
+    }
+}
+
+// Creates the shared memory pen state ring /name (-m), see hanvon-shm.h
+static int shm_ring_open(const char *name) {
+    char path[NAME_MAX];
+    if (snprintf(path, sizeof(path), "/%s", name) >= (int)sizeof(path) || strchr(name, '/')) {
+        fprintf(stderr, "Invalid shared memory name: %s\n", name);
+        return -EINVAL;
+    }
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating shared memory %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, sizeof(*g_shm_ring)) < 0) {
+        int err = -errno;
+        fprintf(stderr, "Error sizing shared memory %s: %s\n", path, strerror(errno));
+        close(fd);
+        shm_unlink(path);
+        return err;
+    }
+    void *map = mmap(NULL, sizeof(*g_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping shared memory %s: %s\n", path, strerror(errno));
+        shm_unlink(path);
+        return -ENOMEM;
+    }
+    g_shm_ring = map;
+    memset(g_shm_ring, 0, sizeof(*g_shm_ring));
+    g_shm_ring->slots = HANVON_SHM_SLOTS;
+    g_shm_ring->sample_size = sizeof(struct hanvon_shm_sample);
+    g_shm_ring->version = HANVON_SHM_VERSION;
+    // Readers check the magic last, once the rest of the header is valid
+    atomic_thread_fence(memory_order_release);
+    g_shm_ring->magic = HANVON_SHM_MAGIC;
+    INFO("Publishing pen state to shared memory %s", path);
+    return 0;
+}
+
+static void shm_ring_close(void) {
+    char path[NAME_MAX];
+    if (!g_shm_ring) return;
+    munmap(g_shm_ring, sizeof(*g_shm_ring));
+    g_shm_ring = NULL;
+    snprintf(path, sizeof(path), "/%s", g_shm_name);
+    shm_unlink(path);
+}
+
+// Publishes the decoded pen state of a device (event thread)
+static inline void shm_ring_publish(const struct hanvon_device *hdev, uint64_t t_packet) {
+    const struct hanvon_pen_state *pen = &hdev->dec.pen;
+    struct hanvon_shm_sample sample = {
+        .time_ns = t_packet,
+        .product_id = hdev->product_id,
+        .bus = hdev->bus,
+        .address = hdev->address,
+        .x = pen->x,
+        .y = pen->y,
+        .pressure = pen->pressure,
+        .tilt_x = pen->tilt_x,
+        .tilt_y = pen->tilt_y,
+        .tool = pen->tool,
+        .in_range = pen->in_range,
+        .touch = pen->touch,
+        .stylus = pen->stylus,
+        .stylus2 = pen->stylus2,
+        .pad = pen->pad,
+        .wheel = pen->wheel,
+    };
+    hanvon_shm_write(g_shm_ring, &sample);
+}
+
+// Queues a record for the worker (front, event or main thread). data is
+// copied when given; hdev is NULL for a record about no device in particular
+// (HANVON_IPC_CONFIG). The worker is woken for every record, an eventfd
+// write is far cheaper than the decode it saves the front. -ENOTCONN
+// without a worker.
+static int ipc_send(struct hanvon_device *hdev, enum hanvon_ipc_kind kind,
+                    const unsigned char *data, int len, uint64_t time_ns) {
+    if (!g_ipc) return -ENOTCONN;
+    pthread_mutex_lock(&g_ipc_lock);
+    int64_t i = hanvon_ipc_reserve(&g_ipc->packets, HANVON_IPC_PACKETS);
+    if (i < 0) {
+        pthread_mutex_unlock(&g_ipc_lock);
+        if (hdev) COUNT(hdev->counters.dropped);
+        WARN_RL("Decoder worker ring full, dropping a record");
+        return -ENOBUFS;
+    }
+    struct hanvon_ipc_packet *rec = &g_ipc->packet[i];
+    rec->kind = kind;
+    if (hdev) {
+        rec->slot = hdev->ipc_slot;
+        rec->bus = hdev->bus;
+        rec->address = hdev->address;
+        rec->product_id = hdev->product_id;
+        rec->generation = hdev->ipc_generation;
+        rec->interval_us = hdev->interval_us;
+        rec->packet_len = hdev->packet_len;
+        rec->max_x = hdev->max_x;
+        rec->max_y = hdev->max_y;
+    }
+    rec->time_ns = time_ns;
+    rec->len = len < HANVON_IPC_MAX_PACKET ? len : HANVON_IPC_MAX_PACKET;
+    if (data) memcpy(rec->data, data, rec->len);
+    hanvon_ipc_commit(&g_ipc->packets);
+    pthread_mutex_unlock(&g_ipc_lock);
+
+    uint64_t one = 1;
+    if (write(g_ipc_packet_efd, &one, sizeof(one)) < 0) {
+        WARN_RL("Error waking the decoder worker: %s", strerror(errno));
+    }
+    return 0;
+}
+
+// Hands a finished frame to the front for writing (worker). A frame the
+// front could not write makes it set resync, then the whole state is sent
+// again like after a failed write of our own.
+static int ipc_send_frame(struct hanvon_device *hdev, struct hanvon_frame *frame) {
+    if (hanvon_frame_end(frame) == 0) {
+        return 0;
+    }
+    int64_t i = hanvon_ipc_reserve(&g_ipc->frames, HANVON_IPC_FRAMES);
+    if (i < 0) {
+        // Counted as dropped rather than as a uinput error, nothing was written
+        COUNT(hdev->counters.dropped);
+        WARN_RL("Front ring full, dropping a frame");
+        hanvon_frame_written(frame, 0);
+        return 0;
+    }
+    struct hanvon_ipc_frame *rec = &g_ipc->frame[i];
+    rec->slot = hdev->ipc_slot;
+    rec->generation = hdev->ipc_generation;
+    rec->count = frame->count;
+    memcpy(rec->ev, frame->ev, frame->count * sizeof(frame->ev[0]));
+    hanvon_ipc_commit(&g_ipc->frames);
+
+    uint64_t one = 1;
+    if (write(g_ipc_frame_efd, &one, sizeof(one)) < 0) {
+        WARN_RL("Error waking the front: %s", strerror(errno));
+    }
+    hanvon_frame_written(frame, 1);
+    return 0;
+}
+
+// A hover report that only moved the pen can be left to the next frame:
+// the pen stays in range and off the surface and no key changed
+static inline int hover_only(const struct hanvon_pen_state *prev, const struct hanvon_pen_state *pen,
+                             unsigned char msgtype) {
+    return msgtype == PEN_EVENT && prev->in_range && pen->in_range && !prev->touch && !pen->touch &&
+           prev->tool == pen->tool && prev->stylus == pen->stylus && prev->stylus2 == pen->stylus2 &&
+           prev->pad == pen->pad && pen->wheel_hi_res == 0;
+}
+
+// Decodes one report and writes the resulting frame. more is set when another
+// report of the same transfer follows, then a hover-only report is merged
+// into the next frame with -H. t_packet is the arrival time (for gap
+// detection), t_entry the time processing started (for the latency
+// histograms, 0 unless g_latency_enabled).
+static void process_report(struct hanvon_device *hdev, const unsigned char *data, int len,
+                           uint64_t t_packet, uint64_t t_entry, int more) {
+    struct hanvon_frame frame;
+    int err = 0;
+    uint64_t t_decoded = 0;
+
+    hanvon_frame_begin(&frame, g_delta_suppression ? &hdev->dec.emitted : NULL);
+
+#ifdef HANVON_ENABLE_TRACE
+    if (LOG_ENABLED(LOG_LEVEL_TRACE)) display_packets(data, len);
+#endif
+
+    // Ensure we have enough data (at least 1 byte for msgtype)
+    if (len < 1) {
+        COUNT(hdev->counters.short_packets);
+        WARN_RL("Received empty or too short packet (%d bytes)", len);
+        return;
+    }
+    count_packet(&hdev->counters, data[0]);
+    if (__builtin_expect(g_latency_enabled, 0)) {
+        uint64_t last = atomic_load_explicit(&hdev->last_packet_ns, memory_order_relaxed);
+        if (last && t_packet > last) latency_record(&hdev->latency.interval, t_packet - last);
+    }
+    atomic_store_explicit(&hdev->last_packet_ns, t_packet, memory_order_relaxed);
+
+    // Decode with the family decoder chosen from the device profile at attach
+    // time, then emit whatever changed. A reload may swap the tuning at any
+    // moment, the whole report uses the one loaded here.
+    const struct hanvon_tuning *tuning = hanvon_decoder_tuning(&hdev->dec);
+    int was_in_range = hdev->dec.pen.in_range;
+    struct hanvon_pen_state prev = hdev->dec.pen;
+    err = hanvon_decode(&hdev->dec, data, len);
+    hanvon_wheel_apply(&hdev->dec, t_packet);
+    hanvon_pad_apply(&hdev->dec, tuning, t_packet);
+    if (err == -EBADMSG) {
+        COUNT(hdev->counters.short_packets);
+        WARN_RL("Message type 0x%02x packet too short (%d bytes)", data[0], len);
+    } else if (err == -ENOMSG) {
+        WARN_RL("Unknown message type received: 0x%02x", data[0]);
+    }
+    if (g_shm_ring && err == 0) {
+        shm_ring_publish(hdev, t_packet);
+    }
+    hanvon_filter_apply(&hdev->dec, tuning, t_packet);
+    if (more && g_coalesce_hover && err == 0 && hover_only(&prev, &hdev->dec.pen, data[0])) {
+        COUNT(hdev->counters.coalesced);
+        hdev->last_pen_ns = t_packet;
+        return;
+    }
+    hanvon_emit(&hdev->dec, tuning, &frame);
+    hanvon_frame_stamp(&frame, t_packet);
+
+    // The tablet streams pen reports while the pen is in range, a long pause
+    // between two of them means reports were lost or delayed
+    if (data[0] == PEN_EVENT && hdev->dec.pen.in_range) {
+        if (was_in_range && hdev->last_pen_ns && t_packet - hdev->last_pen_ns > GAP_THRESHOLD_NS) {
+            COUNT(hdev->counters.gaps);
         }
-    } else if (data <= 0x3f) {   /* slider/wheel area active */
-        // Calculate delta relative to the last known position
-        int delta = data - g_wheel_position;
+        hdev->last_pen_ns = t_packet;
+    } else if (!hdev->dec.pen.in_range) {
+        hdev->last_pen_ns = 0;
+    }
+    if (__builtin_expect(g_latency_enabled, 0)) t_decoded = monotonic_ns();
+
+    // Send the frame terminated by SYN_REPORT to signal end of event batch
+    if (__builtin_expect(g_ipc_worker, 0)) {
+        err = ipc_send_frame(hdev, &frame);
+    } else {
+        err = frame_flush(hdev->uidev, hdev->uinput_fd, &frame);
+    }
+    if (err != 0) {
+        COUNT(hdev->counters.uinput_errors);
+        WARN_RL("Error writing event frame: %d (%s)", err, strerror(-err));
+    }
+
+    if (__builtin_expect(g_latency_enabled, 0)) {
+        uint64_t t_emitted = monotonic_ns();
+        latency_record(&hdev->latency.decode, t_decoded - t_entry);
+        latency_record(&hdev->latency.emit, t_emitted - t_decoded);
+        latency_record(&hdev->latency.total, t_emitted - t_entry);
+    }
+}
+
+// Splits a transfer into its reports and processes them in order. Firmware
+// may pack several AM_PACKET_LEN reports into one packet, and a transfer of
+// several packets (-b) carries one report per packet. Every report gets its
+// own frame (see process_report for -H), stamped with its share of the time
+// the transfer spans, so MSC_TIMESTAMP and the filter see the real spacing.
+// Shared by the transfer callback and capture replay, so both run exactly
+// the same code.
+static void process_packet(struct hanvon_device *hdev, const unsigned char *data, int len,
+                           uint64_t t_packet, uint64_t t_entry) {
+    if (len < 2 * AM_PACKET_LEN) {
+        process_report(hdev, data, len, t_packet, t_entry, 0);
+        return;
+    }
 
-        // Handle wrap-around (e.g., if wheel goes from 0x3f to 0x00 or vice-versa)
-        // This simple logic might need adjustment based on actual wheel behavior
-        if (abs(delta) > (0x3f / 2)) { // Heuristic for wrap-around
-             if (delta > 0) delta -= 0x40; // Wrapped from low to high
-             else delta += 0x40; // Wrapped from high to low
+    int reports = len / AM_PACKET_LEN;
+    uint64_t spacing_ns = 0;
+    if (hdev->interval_us && hdev->packet_len) {
+        uint64_t polls = (len + hdev->packet_len - 1) / hdev->packet_len;
+        spacing_ns = polls * hdev->interval_us * 1000 / reports;
+    }
+    COUNT(hdev->counters.batched);
+    for (int i = 0; i < reports; i++) {
+        uint64_t t = t_packet - (uint64_t)(reports - 1 - i) * spacing_ns;
+        process_report(hdev, data + i * AM_PACKET_LEN, AM_PACKET_LEN, t, t_entry, i < reports - 1);
+    }
+    if (len % AM_PACKET_LEN) {
+        COUNT(hdev->counters.short_packets);
+        WARN_RL("Dropped %d trailing bytes of a %d byte transfer", len % AM_PACKET_LEN, len);
+    }
+}
+
+// hdev->inflight counts the ring transfers libusb owns: from submission
+// until their callback returned. A transfer whose callback does not queue
+// it again drops its count as the very last access to the device, because
+// once the count of a closing device reaches zero devices_reap frees it.
+static void transfer_done(struct hanvon_device *hdev) {
+    if (atomic_fetch_sub(&hdev->inflight, 1) == (DEVICE_CLOSING | 1) && g_hotplug_efd >= 0) {
+        // The event thread completed the teardown's last transfer, wake the main loop
+        uint64_t one = 1;
+        if (write(g_hotplug_efd, &one, sizeof(one)) < 0) {
+            ERROR("Error signalling hotplug eventfd: %s", strerror(errno));
         }
+    }
+}
+
+// Queues a ring transfer that libusb does not own. A closing device gets
+// none, and one that started closing during the submit is cancelled right
+// away, so its teardown never waits for a packet that might not come.
+static int transfer_submit(struct hanvon_device *hdev, struct libusb_transfer *tx) {
+    if (atomic_fetch_add(&hdev->inflight, 1) & DEVICE_CLOSING) {
+        transfer_done(hdev);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    int rc = libusb_submit_transfer(tx);
+    if (rc != LIBUSB_SUCCESS) {
+        transfer_done(hdev);
+    } else if (atomic_load(&hdev->inflight) & DEVICE_CLOSING) {
+        libusb_cancel_transfer(tx);
+    }
+    return rc;
+}
 
-        // Report only if movement exceeds threshold (prevents jitter)
-        // Note: Kernel driver reports if abs(delta) < threshold, which seems inverted.
-        // Reporting if delta is non-zero might be simpler unless thresholding is needed.
-        if (delta != 0) { // Report any change
-        // if (abs(delta) >= AM_WHEEL_THRESHOLD) { // Report if change meets threshold
-            err = libevdev_uinput_write_event(ud, EV_REL, REL_WHEEL, delta);
-            if(err) { DEBUG("err reporting wheel: %d", err); }
-            g_wheel_position = data; // Update position only after reporting
+// Idle policy (-I). A tablet streams the same report for as long as the pen
+// hovers without moving, and every one of them wakes the CPU. After
+// g_idle_samples identical transfers, or as soon as the pen left proximity,
+// the device is idle: transfers that repeat the previous one are dropped
+// before decoding, and with g_idle_poll_ms they are not resubmitted either.
+// Without a queued transfer the host controller stops polling the endpoint,
+// so the main loop's timer resubmits one parked transfer per poll interval
+// to look for a change. The first transfer that differs ends the idle state
+// and puts the whole ring back.
+static void idle_enter(struct hanvon_device *hdev) {
+    hdev->idle = 1;
+    COUNT(hdev->counters.idle_entered);
+}
+
+static void idle_leave(struct hanvon_device *hdev) {
+    hdev->idle = 0;
+    hdev->idle_repeats = 0;
+    uint32_t parked = atomic_exchange(&hdev->idle_parked, 0);
+    for (int i = 0; parked; i++, parked >>= 1) {
+        if (!(parked & 1)) continue;
+        int rc = transfer_submit(hdev, hdev->tx[i]);
+        if (rc != LIBUSB_SUCCESS) {
+            COUNT(hdev->counters.resubmit_failures);
+            WARN_RL("Error resubmitting parked transfer: %s", libusb_error_name(rc));
         }
     }
-    // Note: Button 0 (index 0) seems unhandled here, might be eraser/tool button handled elsewhere
 }
 
+// Starts the periodic idle poll timer every ms milliseconds, or stops it with 0
+static void idle_timer_set(int ms) {
+    struct itimerspec its = {
+        .it_interval = { ms / 1000, (ms % 1000) * 1000000L },
+        .it_value = { ms / 1000, (ms % 1000) * 1000000L },
+    };
+    if (timerfd_settime(g_idle_tfd, 0, &its, NULL) < 0) {
+        WARN_RL("Error setting the idle poll timer: %s", strerror(errno));
+    }
+}
+
+// Runs the next polling enumeration in ms milliseconds (any thread)
+static void scan_timer_set(int ms) {
+    struct itimerspec its = { .it_value = { ms / 1000, (ms % 1000) * 1000000L } };
+    if (timerfd_settime(g_scan_tfd, 0, &its, NULL) < 0) {
+        WARN_RL("Error setting the enumeration timer: %s", strerror(errno));
+    }
+}
+
+// Holds tx back until the next idle poll (transfer callback)
+static void idle_park(struct hanvon_device *hdev, struct libusb_transfer *tx) {
+    for (int i = 0; i < hdev->ring_depth; i++) {
+        if (hdev->tx[i] != tx) continue;
+        atomic_fetch_or(&hdev->idle_parked, 1u << i);
+        break;
+    }
+    // The main loop disarms the timer once nothing is parked; publishing the
+    // slot before looking at g_idle_armed means one of the two sees the other
+    if (!atomic_exchange(&g_idle_armed, 1)) idle_timer_set(g_idle_poll_ms);
+}
+
+// Returns 1 when the transfer only repeats the previous one of an idle
+// device and can be dropped (transfer callback)
+static int idle_check(struct hanvon_device *hdev, const unsigned char *data, int len) {
+    if (len == hdev->idle_len && memcmp(data, hdev->idle_last, len) == 0) {
+        if (hdev->idle) {
+            COUNT(hdev->counters.idle_skipped);
+            return 1;
+        }
+        if (++hdev->idle_repeats >= g_idle_samples) idle_enter(hdev);
+        return 0;
+    }
+    if (len > (int)sizeof(hdev->idle_last)) len = sizeof(hdev->idle_last);
+    memcpy(hdev->idle_last, data, len);
+    hdev->idle_len = len;
+    hdev->idle_repeats = 0;
+    if (hdev->idle) idle_leave(hdev);
+    return 0;
+}
 
 // Main callback function to handle incoming USB interrupt data
 void callback_default (struct libusb_transfer *tx) {
+    struct hanvon_device *hdev = tx->user_data;
+    int err;
+
     // Check transfer status first
     if (tx->status != LIBUSB_TRANSFER_COMPLETED) {
-        DEBUG("Transfer failed or cancelled: %s (%d)", libusb_error_name(tx->status), tx->status);
-        // Do not resubmit if cancelled or failed critically
-        // Resources (like tx itself) might be freed elsewhere based on status
+        if (tx->status != LIBUSB_TRANSFER_CANCELLED) {
+            COUNT(hdev->counters.transfer_errors);
+            WARN_RL("Transfer failed: %s (%d)", libusb_error_name(tx->status), tx->status);
+        }
+        // Without hotplug nobody else reports the disconnect, look right away
+        if (tx->status == LIBUSB_TRANSFER_NO_DEVICE && g_scan_tfd >= 0 && !atomic_exchange(&g_scan_reset, 1)) {
+            scan_timer_set(1);
+        }
+        // Do not resubmit if cancelled or failed critically, the ring is
+        // freed by the teardown once every transfer came back
+        transfer_done(hdev);
         return;
     }
 
-    unsigned char *data = tx->buffer;
-    struct libevdev_uinput *ud = tx->user_data;
-    int err = 0;
+    // libusb does not report when a transfer completed, callback entry is the
+    // earliest point the arrival can be observed. It also stamps the capture,
+    // the shared memory ring and MSC_TIMESTAMP, so consumers can reconstruct
+    // the stroke timing even if writing the frame is delayed.
+    uint64_t t_entry = monotonic_ns();
 
-    // Ensure user_data (uidev) is valid
-    if (!ud) {
-        DEBUG("Error: uinput device handle is NULL in callback.");
-        // Cannot report events, maybe try resubmitting? Risky.
-        goto resubmit; // Try resubmitting anyway, but log the error
+    if (__builtin_expect(g_capture != NULL, 0)) {
+        capture_packet(hdev, tx->buffer, tx->actual_length, t_entry);
     }
 
-    // Optional: Display raw packet data for debugging
-    // display_packets(data, tx->actual_length);
-
-    // Ensure we have enough data (at least 1 byte for msgtype)
-    if (tx->actual_length < 1) {
-        DEBUG("Received empty or too short packet (%d bytes)", tx->actual_length);
+    if (g_idle_samples && idle_check(hdev, tx->buffer, tx->actual_length)) {
+        atomic_store_explicit(&hdev->last_packet_ns, t_entry, memory_order_relaxed);
+        if (g_idle_poll_ms && g_running) {
+            idle_park(hdev, tx);
+            transfer_done(hdev);
+            return;
+        }
         goto resubmit;
     }
 
-    // Process based on message type (first byte)
-    switch(data[0]) {
-        case BUTTON_EVENT_GP: // General buttons/wheel (AM/GP series)
-            // Check length for safety
-            if (tx->actual_length < 5) {
-                 DEBUG("BUTTON_EVENT_GP packet too short (%d bytes)", tx->actual_length);
-                 break;
-            }
-            // Left side buttons/wheel use data[2]
-            if(data[1] == 0x55) {
-                report_buttons(ud, lbuttons, sizeof(lbuttons)/sizeof(lbuttons[0]), data[2]);
-            }
-            // Right side buttons/wheel use data[4] (AM1107, AM1209)
-            if(data[3] == 0xAA) {
-                report_buttons(ud, rbuttons, sizeof(rbuttons)/sizeof(rbuttons[0]), data[4]);
-            }
-            break;
-
-        case PEN_EVENT: // Pen movement/status
-            // Check length for safety
-            if (tx->actual_length < AM_PACKET_LEN) { // Expect full packet length
-                 DEBUG("PEN_EVENT packet too short (%d bytes)", tx->actual_length);
-                 break;
-            }
-            // data[1] contains status flags:
-            // 0x80: Pen near sensor (in proximity)
-            // 0x10: Pen lifted but was near (sometimes combined with 0x80?)
-            // 0x01: Pen touching surface (BTN_LEFT)
-            // 0x02: Pen side button pressed (BTN_RIGHT)
-            // 0x04: Pen side button 2 pressed (BTN_MIDDLE, if exists)
-            // 0x20: Eraser end active (BTN_TOOL_RUBBER) - Check if device supports this
-
-            // Report tool type (Pen or Eraser)
-            // Assuming data[1] & 0x20 indicates eraser, otherwise pen
-            // Note: Kernel driver uses lbuttons[0] (BTN_0) for eraser? Verify this.
-            // Let's report BTN_TOOL_PEN vs BTN_TOOL_RUBBER based on 0x20 flag
-            int tool_type = (data[1] & 0x20) ? BTN_TOOL_RUBBER : BTN_TOOL_PEN;
-            err = libevdev_uinput_write_event(ud, EV_KEY, tool_type, !!(data[1] & (0x80 | 0x10 | 0x01))); // Report tool active if near or touching
-            if(err) { DEBUG("err reporting tool type: %d", err); }
-
-            // Report proximity/movement only if pen is near or touching
-            if (data[1] & (0x80 | 0x10 | 0x01)) {
-                // Coordinates are typically Big Endian (check device specifics)
-                uint16_t x_raw = ((uint16_t)data[2] << 8) | data[3];
-                uint16_t y_raw = ((uint16_t)data[4] << 8) | data[5];
-
-                // TODO: Handle potential Little Endian for APPIV0906 if needed
-                // struct libusb_device_descriptor desc; // Need device context here
-                // libusb_get_device_descriptor(libusb_get_device(tx->dev_handle), &desc);
-                // if (desc.idProduct == PRODUCT_ID_APPIV0906) {
-                //     x_raw = ((uint16_t)data[3] << 8) | data[2]; // LE
-                //     y_raw = ((uint16_t)data[5] << 8) | data[4]; // LE
-                // }
-
-                err = libevdev_uinput_write_event(ud, EV_ABS, ABS_X, x_raw);
-                if(err) { DEBUG("err reporting ABS_X: %d", err); }
-                err = libevdev_uinput_write_event(ud, EV_ABS, ABS_Y, y_raw);
-                if(err) { DEBUG("err reporting ABS_Y: %d", err); }
-
-                // Pressure (often uses lower 10 bits of a 16-bit field, check device)
-                // Kernel driver uses get_unaligned_be16(&data[6]) >> 6
-                // This implies data[6] is high byte, data[7] is low byte, using top 10 bits.
-                uint16_t pressure_raw = ((uint16_t)data[6] << 8) | data[7];
-                // Scale pressure if needed, kernel driver doesn't scale here but sets max to 0x400 (1024)
-                // The >> 6 effectively scales it to 0-1023.
-                err = libevdev_uinput_write_event(ud, EV_ABS, ABS_PRESSURE, pressure_raw >> 6);
-                if(err) { DEBUG("err reporting ABS_PRESSURE: %d", err); }
-
-                // Tilt (check range and sign)
-                // Kernel driver uses data[7] & 0x3f for Tilt X, data[8] for Tilt Y
-                // This suggests Tilt X might be 6-bit, Tilt Y 8-bit.
-                // Assuming they are unsigned for now. Max values set in init_ctrl.
-                err = libevdev_uinput_write_event(ud, EV_ABS, ABS_TILT_X, data[8]); // Kernel uses data[7] & 0x3f? Check byte order/meaning
-                if(err) { DEBUG("err reporting ABS_TILT_X: %d", err); }
-                err = libevdev_uinput_write_event(ud, EV_ABS, ABS_TILT_Y, data[9]); // Kernel uses data[8]? Check byte order/meaning
-                if(err) { DEBUG("err reporting ABS_TILT_Y: %d", err); }
-            }
-
-            // Report pen touch (BTN_LEFT) based on 0x01 flag
-            err = libevdev_uinput_write_event(ud, EV_KEY, BTN_TOUCH, !!(data[1] & 0x01)); // Use BTN_TOUCH for surface contact
-            if(err) { DEBUG("err reporting BTN_TOUCH: %d", err); }
-
-            // Report pen side buttons (BTN_RIGHT, BTN_MIDDLE) based on 0x02, 0x04 flags
-            err = libevdev_uinput_write_event(ud, EV_KEY, BTN_STYLUS, !!(data[1] & 0x02)); // Use BTN_STYLUS for first side button
-            if(err) { DEBUG("err reporting BTN_STYLUS: %d", err); }
-            // Check for a second side button flag if applicable (e.g., 0x04)
-            // err = libevdev_uinput_write_event(ud, EV_KEY, BTN_STYLUS2, !!(data[1] & 0x04));
-            // if(err) { DEBUG("err reporting BTN_STYLUS2: %d", err); }
-
-            break;
-
-        case BUTTON_EVENT_0906: // Specific buttons for GP0906/APPIV0906
-             // Check length for safety
-            if (tx->actual_length < 4) { // Need at least 4 bytes based on kernel driver
-                 DEBUG("BUTTON_EVENT_0906 packet too short (%d bytes)", tx->actual_length);
-                 break;
-            }
-            // Kernel driver uses data[3] for button flags
-            // Map these flags to appropriate BTN_ codes (using lbuttons for consistency?)
-            err = libevdev_uinput_write_event(ud, EV_KEY, lbuttons[0], !!(data[3] & 0x01)); if(err) { DEBUG("err: %d",err); }
-            err = libevdev_uinput_write_event(ud, EV_KEY, lbuttons[1], !!(data[3] & 0x02)); if(err) { DEBUG("err: %d",err); }
-            err = libevdev_uinput_write_event(ud, EV_KEY, lbuttons[2], !!(data[3] & 0x04)); if(err) { DEBUG("err: %d",err); }
-            err = libevdev_uinput_write_event(ud, EV_KEY, lbuttons[3], !!(data[3] & 0x08)); if(err) { DEBUG("err: %d",err); }
-            // APPIV0906 might have more buttons (up to BTN_7 in kernel driver)
-            // Check if data[3] contains more flags or if they are in other bytes
-            // Example if flags continue in data[3]:
-            // err = libevdev_uinput_write_event(ud, EV_KEY, rbuttons[0], !!(data[3] & 0x10)); if(err) { DEBUG("err: %d",err); } // BTN_4
-            // err = libevdev_uinput_write_event(ud, EV_KEY, rbuttons[1], !!(data[3] & 0x20)); if(err) { DEBUG("err: %d",err); } // BTN_5
-            // err = libevdev_uinput_write_event(ud, EV_KEY, rbuttons[2], !!(data[3] & 0x40)); if(err) { DEBUG("err: %d",err); } // BTN_6
-            // err = libevdev_uinput_write_event(ud, EV_KEY, rbuttons[3], !!(data[3] & 0x80)); if(err) { DEBUG("err: %d",err); } // BTN_7
-            break;
+    // In isolated mode the worker decodes, its frames are written by the main loop
+    if (g_ipc) {
+        atomic_store_explicit(&hdev->last_packet_ns, t_entry, memory_order_relaxed);
+        ipc_send(hdev, HANVON_IPC_PACKET, tx->buffer, tx->actual_length, t_entry);
+        goto resubmit;
+    }
 
-        default:
-            DEBUG("Unknown message type received: 0x%02x", data[0]);
-            // Optional: display_packets(data, tx->actual_length);
-            break;
+    // Ensure the uinput device is valid
+    if (!hdev->uidev) {
+        WARN_RL("Error: uinput device handle is NULL in callback.");
+        // Cannot report events, maybe try resubmitting? Risky.
+        goto resubmit; // Try resubmitting anyway, but log the error
     }
 
-    // Send SYN_REPORT to signal end of event batch
-    err = libevdev_uinput_write_event(ud, EV_SYN, SYN_REPORT, 0);
-    if (err != 0) {
-        DEBUG("Error writing EV_SYN: %d (%s)", err, strerror(-err));
+    process_packet(hdev, tx->buffer, tx->actual_length, t_entry, t_entry);
+    // Nothing to report until the pen comes back (the worker knows the pen
+    // state in isolated mode, so there only repeats count)
+    if (g_idle_samples && !hdev->idle && !hdev->dec.pen.in_range && !hdev->dec.pen.pad) {
+        idle_enter(hdev);
     }
 
 resubmit:
-    // Resubmit the transfer for the next interrupt packet
-    // Only if the program is still supposed to be running
-    if (g_running && g_dev_handle != NULL) { // Check handle too
+    // Resubmit the transfer for the next interrupt packet, it keeps the
+    // count of this callback. Not when shutting down or closing the device.
+    if (g_running && !(atomic_load(&hdev->inflight) & DEVICE_CLOSING)) {
         err = libusb_submit_transfer(tx);
-        if (err != 0) {
-            DEBUG("Error resubmitting transfer: %s (%d)", libusb_error_name(err), err);
-            // If resubmit fails, the device might stop reporting.
-            // Consider closing the device handle or attempting recovery.
-            // For now, just log the error. The loop in main will continue.
+        if (err == 0) {
+            // The teardown may have tried to cancel it while this callback ran
+            if (atomic_load(&hdev->inflight) & DEVICE_CLOSING) libusb_cancel_transfer(tx);
+            return;
         }
+        COUNT(hdev->counters.resubmit_failures);
+        WARN_RL("Error resubmitting transfer: %s (%d)", libusb_error_name(err), err);
+        // If resubmit fails, the device might stop reporting.
+        // Consider closing the device handle or attempting recovery.
+        // For now, just log the error. The loop in main will continue.
     } else {
-         DEBUG("Not resubmitting transfer (running=%d, handle=%p)", g_running, (void*)g_dev_handle);
-         // If not resubmitting, the transfer object might need freeing,
-         // but libusb often handles this internally or it's done during cleanup.
+         DEBUG("Not resubmitting transfer (running=%d, handle=%p)", g_running, (void*)hdev->handle);
     }
+    transfer_done(hdev);
 }
 
-// Initializes the libevdev device based on USB device descriptor
-int init_ctrl(struct libusb_device *dev,
+// Initializes the libevdev device based on the device profile and the
+// decoder's axis mapping; version is the bcdDevice of the tablet (0 when
+// replaying a capture)
+int init_ctrl(const struct hanvon_decoder *dec,
+            uint16_t version,
             struct libevdev **evdev_out,
             struct libevdev_uinput **uidev_out) {
 
     struct input_absinfo abs; // Use stack allocation for absinfo
     memset(&abs, 0, sizeof(abs)); // Important: Initialize the struct
 
-    printf("Initializing evdev controls...\n");
-    g_wheel_position = 0; // Reset global wheel position
+    DEBUG("Initializing evdev controls...");
 
-    if (dev == NULL) {
-        DEBUG("init_ctrl called with NULL device");
+    if (dec == NULL || dec->profile == NULL) {
+        DEBUG("init_ctrl called with NULL profile");
         return -EINVAL; // Invalid argument
     }
+    const struct hanvon_profile *profile = dec->profile;
+    int max_x, max_y;
+    hanvon_output_range(dec, &max_x, &max_y);
 
     int rc = 0; // Use standard Linux error codes (negative)
-    struct libusb_device_descriptor desc;
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc < 0) {
-        DEBUG("Failed to get device descriptor: %s", libusb_error_name(rc));
-        return -EIO; // Input/output error
-    }
 
     *evdev_out = libevdev_new();
     if (!*evdev_out) {
-        DEBUG("Failed to create evdev device: %s", strerror(errno));
+        ERROR("Failed to create evdev device: %s", strerror(errno));
         return -ENOMEM; // Out of memory
     }
     struct libevdev *evdev = *evdev_out; // Use local variable for convenience
 
     // --- Set common device properties ---
-    libevdev_set_name(evdev, "Hanvon Tablet (Userspace)"); // Generic name first
-    libevdev_set_id_vendor(evdev, desc.idVendor);
-    libevdev_set_id_product(evdev, desc.idProduct);
+    libevdev_set_name(evdev, profile->name);
+    libevdev_set_id_vendor(evdev, VENDOR_ID_HANVON);
+    libevdev_set_id_product(evdev, profile->product_id);
     libevdev_set_id_bustype(evdev, BUS_USB);
-    libevdev_set_id_version(evdev, desc.bcdDevice);
+    libevdev_set_id_version(evdev, version);
     libevdev_enable_property(evdev, INPUT_PROP_POINTER); // Indicate it's a pointer device
     // INPUT_PROP_DIRECT for absolute screen mapping, INPUT_PROP_POINTING_STICK if relative
     // Choose based on typical tablet usage (absolute)
@@ -468,39 +1125,39 @@ int init_ctrl(struct libusb_device *dev,
     // Absolute axes: X, Y, Pressure, Tilt X, Tilt Y
     // Configure X axis
     abs.minimum = 0;
-    abs.maximum = (desc.idProduct == PRODUCT_ID_APPIV0906) ? APPIV_MAX_ABS_X : AM_MAX_ABS_X;
+    abs.maximum = max_x;
     abs.resolution = AM_RESOLUTION; // Dots per mm (needs verification)
     abs.fuzz = 4; // Adjust if needed based on jitter
     abs.flat = 0; // Adjust if needed
     // abs.value = 0; // Initial value not needed here
     rc = libevdev_enable_event_code(evdev, EV_ABS, ABS_X, &abs);
-    if (rc < 0) { DEBUG("Failed to enable ABS_X: %s", strerror(-rc)); goto error_free_evdev; }
+    if (rc < 0) { ERROR("Failed to enable ABS_X: %s", strerror(-rc)); goto error_free_evdev; }
 
     // Configure Y axis
-    abs.maximum = (desc.idProduct == PRODUCT_ID_APPIV0906) ? APPIV_MAX_ABS_Y : AM_MAX_ABS_Y;
+    abs.maximum = max_y;
     // Keep other abs settings same as X (resolution, fuzz, flat)
     rc = libevdev_enable_event_code(evdev, EV_ABS, ABS_Y, &abs);
-    if (rc < 0) { DEBUG("Failed to enable ABS_Y: %s", strerror(-rc)); goto error_free_evdev; }
+    if (rc < 0) { ERROR("Failed to enable ABS_Y: %s", strerror(-rc)); goto error_free_evdev; }
 
-    // Configure Pressure axis
-    abs.maximum = AM_MAX_PRESSURE;
+    // Configure Pressure axis, 0..2^pressure_bits-1 like the kernel driver
+    abs.maximum = (1 << profile->pressure_bits) - 1;
     abs.resolution = 0; // Resolution typically 0 for pressure/tilt
     abs.fuzz = 0;
     abs.flat = 0;
     rc = libevdev_enable_event_code(evdev, EV_ABS, ABS_PRESSURE, &abs);
-    if (rc < 0) { DEBUG("Failed to enable ABS_PRESSURE: %s", strerror(-rc)); goto error_free_evdev; }
+    if (rc < 0) { ERROR("Failed to enable ABS_PRESSURE: %s", strerror(-rc)); goto error_free_evdev; }
 
     // Configure Tilt X axis
-    abs.maximum = AM_MAX_TILT_X; // Check if signed range needed (-64 to 63?)
+    abs.maximum = profile->max_tilt_x; // Check if signed range needed (-64 to 63?)
     // abs.minimum = -64; // Example if signed
     rc = libevdev_enable_event_code(evdev, EV_ABS, ABS_TILT_X, &abs);
-    if (rc < 0) { DEBUG("Failed to enable ABS_TILT_X: %s", strerror(-rc)); goto error_free_evdev; }
+    if (rc < 0) { ERROR("Failed to enable ABS_TILT_X: %s", strerror(-rc)); goto error_free_evdev; }
 
     // Configure Tilt Y axis
-    abs.maximum = AM_MAX_TILT_Y; // Check if signed range needed (-64 to 63?)
+    abs.maximum = profile->max_tilt_y; // Check if signed range needed (-64 to 63?)
     // abs.minimum = -64; // Example if signed
     rc = libevdev_enable_event_code(evdev, EV_ABS, ABS_TILT_Y, &abs);
-    if (rc < 0) { DEBUG("Failed to enable ABS_TILT_Y: %s", strerror(-rc)); goto error_free_evdev; }
+    if (rc < 0) { ERROR("Failed to enable ABS_TILT_Y: %s", strerror(-rc)); goto error_free_evdev; }
 
     // --- Enable relative events (Wheel) ---
     // Only enable if device likely has it (e.g., AM1107, AM1209)
@@ -508,104 +1165,42 @@ int init_ctrl(struct libusb_device *dev,
     libevdev_enable_event_type(evdev, EV_REL);
     rc = libevdev_enable_event_code(evdev, EV_REL, REL_WHEEL, NULL);
     if (rc < 0) {
-        DEBUG("Failed to enable REL_WHEEL: %s (Ignoring, might not be critical)", strerror(-rc));
+        WARN("Failed to enable REL_WHEEL: %s (Ignoring, might not be critical)", strerror(-rc));
         // Don't fail init, just log the warning
     }
+    // Accelerated strip motion in 1/120 detents, for smooth scrolling clients
+    rc = libevdev_enable_event_code(evdev, EV_REL, REL_WHEEL_HI_RES, NULL);
+    if (rc < 0) {
+        WARN("Failed to enable REL_WHEEL_HI_RES: %s (Ignoring, might not be critical)", strerror(-rc));
+    }
 
-    // --- Enable device-specific buttons ---
-    switch(desc.idProduct) {
-        // Models with 4 left buttons (BTN_0 to BTN_3)
-        case PRODUCT_ID_AM3M:
-        case PRODUCT_ID_AM0806:
-        case PRODUCT_ID_AM0605:
-        case PRODUCT_ID_GP0806:
-        case PRODUCT_ID_GP0806B:
-        case PRODUCT_ID_GP0605:
-        case PRODUCT_ID_GP0605A:
-        case PRODUCT_ID_GP0504:
-        case PRODUCT_ID_NXS1513:
-        case PRODUCT_ID_GP0906: // Also uses lbuttons mapping
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_0, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_1, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_2, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_3, NULL);
-            break;
-
-        // Models with 8 buttons (4 left: BTN_0-3, 4 right: BTN_4-7)
-        case PRODUCT_ID_AM1107:
-        case PRODUCT_ID_AM1209:
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_0, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_1, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_2, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_3, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_4, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_5, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_6, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_7, NULL);
-            break;
-
-        // APPIV0906 specific buttons (based on kernel driver)
-        case PRODUCT_ID_APPIV0906:
-            // Pen buttons already enabled (BTN_STYLUS, BTN_STYLUS2 if needed)
-            // Kernel driver maps 0x04 to BTN_MIDDLE, 0x08 to BTN_0? Verify.
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_MIDDLE, NULL); // Third pen button?
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_0, NULL);      // Fourth pen button?
-
-            // Tablet buttons (map to BTN_1 through BTN_7 based on kernel driver)
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_1, NULL); // Flag 0x01
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_2, NULL); // Flag 0x02
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_3, NULL); // Flag 0x04
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_4, NULL); // Flag 0x08
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_5, NULL); // Flag 0x10
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_6, NULL); // Flag 0x20
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_7, NULL); // Flag 0x40
-            break;
-
-        // Rollick models - check button layout if different
-        case PRODUCT_ID_RL0604:
-        case PRODUCT_ID_RL0504:
-            // Assuming 4 buttons like GP series for now
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_0, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_1, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_2, NULL);
-            libevdev_enable_event_code(evdev, EV_KEY, BTN_3, NULL);
-            break;
+    // --- Arrival time of each frame ---
+    libevdev_enable_event_type(evdev, EV_MSC);
+    libevdev_enable_event_code(evdev, EV_MSC, MSC_TIMESTAMP, NULL);
 
-        default:
-            // No specific extra buttons known for this device
-            break;
-   }
-
-    // --- Set specific device name ---
-    switch(desc.idProduct) {
-        // Cases are in ID order for readability
-        case PRODUCT_ID_NXS1513:    libevdev_set_name(evdev, "Hanvon Nilox NXS1513"); break;
-        case PRODUCT_ID_GP0504:     libevdev_set_name(evdev, "Hanvon Graphicpal 0504"); break;
-        case PRODUCT_ID_GP0806:     libevdev_set_name(evdev, "Hanvon Graphicpal 0806"); break;
-        case PRODUCT_ID_GP0605A:    libevdev_set_name(evdev, "Hanvon Graphicpal 0605A"); break;
-        case PRODUCT_ID_AM1209:     libevdev_set_name(evdev, "Hanvon ArtMaster AM1209"); break;
-        case PRODUCT_ID_AM0806:     libevdev_set_name(evdev, "Hanvon ArtMaster AM0806"); break;
-        case PRODUCT_ID_AM0605:     libevdev_set_name(evdev, "Hanvon ArtMaster AM0605"); break;
-        case PRODUCT_ID_AM1107:     libevdev_set_name(evdev, "Hanvon Art Master AM1107"); break; // Space intentional?
-        case PRODUCT_ID_GP0806B:    libevdev_set_name(evdev, "Hanvon Graphicpal 0806B"); break;
-        case PRODUCT_ID_GP0605:     libevdev_set_name(evdev, "Hanvon Graphicpal 0605"); break;
-        case PRODUCT_ID_RL0504:     libevdev_set_name(evdev, "Hanvon Rollick 0504"); break;
-        case PRODUCT_ID_RL0604:     libevdev_set_name(evdev, "Hanvon Rollick 0604"); break;
-        case PRODUCT_ID_GP0906:     libevdev_set_name(evdev, "Hanvon Graphicpal 0906"); break;
-        case PRODUCT_ID_AM3M:       libevdev_set_name(evdev, "Hanvon Art Master III"); break; // Space intentional?
-        case PRODUCT_ID_APPIV0906:  libevdev_set_name(evdev, "Hanvon Art Painter Pro APPIV0906"); break;
-        default: libevdev_set_name(evdev, "Hanvon Tablet (Unknown Model)"); break; // Fallback name
+    // --- Enable device-specific buttons ---
+    // The model's codes stay enabled next to remapped ones, so a reload
+    // can switch a button back without recreating the device
+    const struct hanvon_tuning *tuning = hanvon_decoder_tuning(dec);
+    for (size_t i = 0; i < profile->num_buttons; i++) {
+        libevdev_enable_event_code(evdev, EV_KEY, profile->buttons[i], NULL);
+        if (tuning && tuning->buttons[i] != profile->buttons[i]) {
+            libevdev_enable_event_code(evdev, EV_KEY, tuning->buttons[i], NULL);
+        }
+    }
+    for (int i = 0; tuning && i < tuning->pad.num_keys; i++) {
+        libevdev_enable_event_code(evdev, EV_KEY, tuning->pad.keys[i], NULL);
     }
 
     // --- Create the uinput device ---
     rc = libevdev_uinput_create_from_device(evdev, LIBEVDEV_UINPUT_OPEN_MANAGED, uidev_out);
     if (rc < 0) {
-        DEBUG("Failed to create uinput device: %s (%d)", strerror(-rc), rc);
+        ERROR("Failed to create uinput device: %s (%d)", strerror(-rc), rc);
         goto error_free_evdev;
     }
 
-    printf("Initialized controls for %04x:%04x, uinput node: %s\n",
-           desc.idVendor, desc.idProduct, libevdev_uinput_get_devnode(*uidev_out));
+    INFO("Initialized controls for %04x:%04x, uinput node: %s",
+           VENDOR_ID_HANVON, profile->product_id, libevdev_uinput_get_devnode(*uidev_out));
 
     // Success
     // No need to free abs, it's on the stack
@@ -617,214 +1212,1818 @@ error_free_evdev:
     return rc; // Return the negative error code
 }
 
-// Signal handler for graceful shutdown
+// Signal handlers of the replay; the daemon reads its signals from the
+// main loop's signalfd instead (handle_signals)
+void sigusr1_handler(int signum) {
+    g_dump_stats = 1;
+}
+
 void sigterm_handler(int signum) {
-    DEBUG("Received signal %d, initiating shutdown...", signum);
+    INFO("Received signal %d, initiating shutdown...", signum);
     g_running = 0; // Signal the main loop to exit
 }
 
-// Hotplug callback function
-// NOTE: This callback and the global state management **DO NOT** correctly
-//       handle multiple connected Hanvon devices. It assumes only one.
-//       Refactoring is needed for multi-device support.
-int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
-                     libusb_hotplug_event event, void *user_data) {
-
-    struct libusb_device_descriptor desc;
-    int rc;
-
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc < 0) {
-        DEBUG("Hotplug: Failed to get descriptor for event %d", event);
-        return 0; // Ignore event if descriptor fails
+// Cancels every queued transfer of the device's ring. Each callback still
+// runs later with status CANCELLED; transfers in their callback right now
+// or idle parked are not queued and return NOT_FOUND.
+static void cancel_transfer_ring(struct hanvon_device *hdev) {
+    for (int i = 0; i < AM_TRANSFER_RING_MAX; i++) {
+        if (!hdev->tx[i]) continue;
+        int rc = libusb_cancel_transfer(hdev->tx[i]);
+        if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NOT_FOUND && rc != LIBUSB_ERROR_NO_DEVICE) {
+            ERROR("Error cancelling transfer %d: %s", i, libusb_error_name(rc));
+        }
     }
+}
 
-    DEBUG("Hotplug event: %s for device %04x:%04x",
-           event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "ARRIVED" : "LEFT",
-           desc.idVendor, desc.idProduct);
+// Frees every transfer of the device's ring; none may be owned by libusb
+// (hdev->inflight is zero)
+static void free_transfer_ring(struct hanvon_device *hdev) {
+    atomic_store(&hdev->idle_parked, 0);
+    for (int i = 0; i < AM_TRANSFER_RING_MAX; i++) {
+        libusb_free_transfer(hdev->tx[i]);
+        hdev->tx[i] = NULL;
+    }
+}
 
-    if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
-        // --- SINGLE DEVICE CHECK ---
-        if (g_dev_handle != NULL) {
-             DEBUG("INFO: Another Hanvon device is already active. Ignoring new device %04x:%04x.", desc.idVendor, desc.idProduct);
-             return 0; // Ignore if already handling one
+// Allocates hdev->ring_depth interrupt transfers of hdev->packet_len bytes,
+// each over its own slot of hdev->buffer, and queues all of them on the
+// endpoint. Every completed transfer is resubmitted by callback_default, so
+// the ring stays full while running. Returns LIBUSB_SUCCESS, or a libusb
+// error; transfers queued before the failure must be torn down with the
+// device then.
+static int submit_transfer_ring(struct hanvon_device *hdev) {
+    // A reconnected tablet may come back with other endpoint parameters
+    free(hdev->buffer);
+    hdev->buffer = calloc(hdev->ring_depth, hdev->transfer_len);
+    if (!hdev->buffer) {
+        ERROR("Error allocating %d transfer buffers", hdev->ring_depth);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    hdev->idle = hdev->idle_repeats = hdev->idle_len = 0;
+    atomic_store(&hdev->inflight, 0);   // A parked context was closed before
+
+    for (int i = 0; i < hdev->ring_depth; i++) {
+        hdev->tx[i] = libusb_alloc_transfer(0);
+        if (!hdev->tx[i]) {
+            ERROR("Error allocating transfer %d", i);
+            return LIBUSB_ERROR_NO_MEM;
         }
-        // --- END SINGLE DEVICE CHECK ---
 
-        // Check if the device is one we specifically support via find_device logic
-        // (find_device checks product ID list)
-        libusb_device *devs_list[] = {dev};
-        if (find_device(devs_list, 1) < 0) {
-            // find_device already printed a message if vendor matched but product didn't
-            // No need to print again unless vendor didn't match (which hotplug filter should prevent)
-            return 0; // Not a supported product ID
-        }
+        // Fill the interrupt transfer request
+        libusb_fill_interrupt_transfer(
+                hdev->tx[i],
+                hdev->handle,
+                hdev->endpoint,
+                hdev->buffer + (size_t)i * hdev->transfer_len, // Slot owned by this transfer
+                hdev->transfer_len, // Whole packets, a report never spans transfers
+                callback_default,   // The callback function
+                hdev,               // Pass the device context as user_data to callback
+                0                   // Timeout 0 = no timeout (recommended for interrupt)
+        );
 
-        DEBUG("Supported device %04x:%04x arrived. Attempting to open...", desc.idVendor, desc.idProduct);
-        rc = libusb_open(dev, &g_dev_handle);
+        int rc = transfer_submit(hdev, hdev->tx[i]);
         if (rc != LIBUSB_SUCCESS) {
-            DEBUG("Error opening device %04x:%04x: %s", desc.idVendor, desc.idProduct, libusb_error_name(rc));
-            g_dev_handle = NULL; // Ensure handle is NULL on failure
-            return 0; // Non-fatal, just couldn't open this one
+            ERROR("Error submitting transfer %d: %s", i, libusb_error_name(rc));
+            return rc;
         }
+    }
+    return LIBUSB_SUCCESS;
+}
 
-        // Detach kernel driver if active on interface 0
-        rc = libusb_kernel_driver_active(g_dev_handle, 0);
-        if (rc == 1) {
-            DEBUG("Kernel driver active on interface 0. Detaching...");
-            rc = libusb_detach_kernel_driver(g_dev_handle, 0);
-            if (rc != LIBUSB_SUCCESS) {
-                DEBUG("Error detaching kernel driver: %s. Closing device.", libusb_error_name(rc));
-                libusb_close(g_dev_handle);
-                g_dev_handle = NULL;
-                return 0;
-            }
-        } else if (rc < 0 && rc != LIBUSB_ERROR_NOT_SUPPORTED) {
-             DEBUG("Error checking kernel driver status: %s. Closing device.", libusb_error_name(rc));
-             libusb_close(g_dev_handle);
-             g_dev_handle = NULL;
-             return 0;
+// Returns the context of an attached device, or NULL if it is not ours
+static struct hanvon_device *device_lookup(libusb_device *dev) {
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) {
+        if (libusb_get_device(hdev->handle) == dev) {
+            return hdev;
         }
+    }
+    return NULL;
+}
 
+// Frees a context and the tunings it owns; its USB and uinput sides must
+// be closed already
+static void device_free(struct hanvon_device *hdev) {
+    free(hdev->buffer);
+    free(hdev->tuning);
+    free(hdev);
+}
 
-        // Claim interface 0 (usually the one with the interrupt endpoint)
-        // Check lsusb -v output for bInterfaceNumber if unsure
-        rc = libusb_claim_interface(g_dev_handle, 0);
-        if (rc != LIBUSB_SUCCESS) {
-             DEBUG("Error claiming interface 0: %s", libusb_error_name(rc));
-             // Attempt to re-attach kernel driver before closing
-             libusb_attach_kernel_driver(g_dev_handle, 0);
-             libusb_close(g_dev_handle);
-             g_dev_handle = NULL;
-             return 0;
+// Builds the tuning of a device from g_config and swaps it into its decoder.
+// The decoder may be busy with a packet on the event thread, so the tuning
+// it replaces is only freed once that thread has returned from libusb. The
+// input device cannot be resized, so a new orientation that would swap its
+// axes keeps the current one instead.
+static int device_tune(struct hanvon_device *hdev) {
+    const struct hanvon_profile *profile = hdev->profile;
+    struct hanvon_mapping_params mapping = g_config.mapping;
+    int mapping_enabled = g_config.mapping_enabled;
+
+    if (hdev->max_x) {
+        int quarter = mapping_enabled &&
+                      (mapping.rotation == HANVON_ROTATE_CW || mapping.rotation == HANVON_ROTATE_CCW);
+        if ((quarter ? profile->max_y : profile->max_x) != hdev->max_x ||
+            (quarter ? profile->max_x : profile->max_y) != hdev->max_y) {
+            WARN("Orientation of %s only turns by a quarter after a reconnect, keeping the current one",
+                 profile->name);
+            mapping.rotation = hdev->tuning && hdev->tuning->map.enabled ?
+                               hdev->tuning->map.rotation : HANVON_ROTATE_NONE;
+            mapping_enabled = 1;
         }
-        DEBUG("Interface 0 claimed successfully.");
+    }
 
-        // Initialize evdev/uinput controls
-        rc = init_ctrl(dev, &g_evdev, &g_uidev);
-        if (rc < 0) {
-            DEBUG("Error: Could not initialize controls for the device (%d).", rc);
-            // Clean up interface claim and handle
-            libusb_release_interface(g_dev_handle, 0);
-            libusb_attach_kernel_driver(g_dev_handle, 0); // Reattach kernel driver
-            libusb_close(g_dev_handle);
-            g_dev_handle = NULL;
-            // evdev might be partially created, uidev should be NULL if create failed
-            if (g_evdev) {
-                libevdev_free(g_evdev);
-                g_evdev = NULL;
+    struct hanvon_tuning *tuning = malloc(sizeof(*tuning));
+    if (!tuning) {
+        ERROR("Error allocating tuning for %04x:%04x", VENDOR_ID_HANVON, hdev->product_id);
+        return -ENOMEM;
+    }
+    struct hanvon_filter_params filter = *profile->filter;
+    if (g_config.predict_us >= 0) filter.predict_us = g_config.predict_us;
+    const struct hanvon_filter_params *fp = g_config.filter_enabled ? &filter : NULL;
+    int rc = hanvon_tuning_init(tuning, profile, mapping_enabled ? &mapping : NULL, fp, &g_config.pad);
+    if (rc == -EINVAL) {
+        // The active area is given in counts, it may not fit every model
+        WARN("Axis mapping does not fit %s, using the whole tablet", profile->name);
+        memset(mapping.area, 0, sizeof(mapping.area));
+        rc = hanvon_tuning_init(tuning, profile, &mapping, fp, &g_config.pad);
+        if (rc == -EINVAL) rc = hanvon_tuning_init(tuning, profile, NULL, fp, &g_config.pad);
+    }
+    if (rc < 0) {
+        free(tuning);
+        return rc;
+    }
+    if (hdev->evdev) {
+        for (size_t i = 0; !tuning->pad.enabled && i < profile->num_buttons; i++) {
+            if (!libevdev_has_event_code(hdev->evdev, EV_KEY, tuning->buttons[i])) {
+                WARN("Button %zu of %s: key %d is only available after a reconnect",
+                     i, profile->name, tuning->buttons[i]);
             }
-            g_uidev = NULL; // Ensure uidev is NULL
-            return 0; // Non-fatal
         }
-
-        // Allocate the interrupt transfer
-        g_tx = libusb_alloc_transfer(0);
-        if (!g_tx) {
-             DEBUG("Error allocating transfer");
-             // Cleanup uinput/evdev, interface, handle
-             libevdev_uinput_destroy(g_uidev); // Managed uinput also frees evdev
-             g_uidev = NULL; g_evdev = NULL;
-             libusb_release_interface(g_dev_handle, 0);
-             libusb_attach_kernel_driver(g_dev_handle, 0);
-             libusb_close(g_dev_handle);
-             g_dev_handle = NULL;
-             return 0;
+        for (int i = 0; i < tuning->pad.num_keys; i++) {
+            if (!libevdev_has_event_code(hdev->evdev, EV_KEY, tuning->pad.keys[i])) {
+                WARN("Pad of %s: key %d is only available after a reconnect", profile->name, tuning->pad.keys[i]);
+            }
         }
+    }
 
-        // Find the interrupt IN endpoint address (usually 0x81)
-        // TODO: Dynamically find the endpoint instead of hardcoding
-        const int ENDPOINT_ADDR = 0x81; // bEndpointAddress from lsusb -v for Interface 0
+    struct hanvon_tuning *old = hdev->tuning;
+    hdev->tuning = tuning;
+    hanvon_decoder_set_tuning(&hdev->dec, tuning);
+    if (old) {
+        // No callback reads old after the sync, but stale copies of its
+        // address may remain (and the next tuning may get it back), so a
+        // pointer is no identity: the pad engine compares generations
+        event_thread_sync();
+        free(old);
+    }
+    return 0;
+}
 
-        // Fill the interrupt transfer request
-        libusb_fill_interrupt_transfer(
-                g_tx,
-                g_dev_handle,
-                ENDPOINT_ADDR,
-                g_buffer,           // Use global buffer
-                AM_PACKET_LEN,      // Max packet length
-                callback_default,   // The callback function
-                g_uidev,            // Pass uidev as user_data to callback
-                0                   // Timeout 0 = no timeout (recommended for interrupt)
-        );
+// Allocates a device context for the given model, not yet linked or opened.
+// Shared by device_attach and capture replay.
+static struct hanvon_device *device_new(uint16_t product_id, uint8_t bus, uint8_t address) {
+    const struct hanvon_profile *profile = hanvon_profile_lookup(product_id);
+    if (!profile) {
+        WARN("No profile for device %04x:%04x", VENDOR_ID_HANVON, product_id);
+        return NULL;
+    }
+    struct hanvon_device *hdev = calloc(1, sizeof(*hdev));
+    if (!hdev) {
+        ERROR("Error allocating device context for %04x:%04x", VENDOR_ID_HANVON, product_id);
+        return NULL;
+    }
+    hdev->product_id = product_id;
+    hdev->bus = bus;
+    hdev->address = address;
+    hdev->stats_ns = monotonic_ns();
+    hdev->profile = profile;
+    hanvon_decoder_init(&hdev->dec, profile);
+    if (device_tune(hdev) < 0) {
+        free(hdev);
+        return NULL;
+    }
+    hanvon_output_range(&hdev->dec, &hdev->max_x, &hdev->max_y);
+    hdev->uinput_fd = -1;
+    hdev->ipc_slot = -1;
+    return hdev;
+}
+
+// Finds the interrupt IN endpoint of interface 0 in the active configuration
+// and sizes the transfers from its wMaxPacketSize and the ring from its
+// bInterval: faster polling needs more transfers queued to ride out the same
+// callback delay. Falls back to the original driver's 0x81 and 10 bytes when
+// the descriptor cannot be read.
+static void device_probe_endpoint(struct hanvon_device *hdev, libusb_device *dev) {
+    struct libusb_config_descriptor *config;
+    const struct libusb_endpoint_descriptor *found = NULL;
+
+    hdev->endpoint = AM_ENDPOINT_DEFAULT;
+    hdev->packet_len = AM_PACKET_LEN;
+    hdev->interval_us = 0;
+
+    int rc = libusb_get_active_config_descriptor(dev, &config);
+    if (rc == LIBUSB_SUCCESS) {
+        if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+            const struct libusb_interface_descriptor *alt = &config->interface[0].altsetting[0];
+            for (int i = 0; i < alt->bNumEndpoints && !found; i++) {
+                const struct libusb_endpoint_descriptor *ep = &alt->endpoint[i];
+                if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) &&
+                    (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+                    found = ep;
+                }
+            }
+        }
+        if (found) {
+            int speed = libusb_get_device_speed(dev);
+            // Bits 11-12 of wMaxPacketSize are extra transactions per microframe
+            int len = (found->wMaxPacketSize & 0x7ff) * (1 + ((found->wMaxPacketSize >> 11) & 3));
+            hdev->endpoint = found->bEndpointAddress;
+            if (len > 0) hdev->packet_len = len < AM_TRANSFER_MAX_LEN ? len : AM_TRANSFER_MAX_LEN;
+            if (speed >= LIBUSB_SPEED_HIGH && found->bInterval >= 1 && found->bInterval <= 16) {
+                hdev->interval_us = 125 << (found->bInterval - 1); // 2^(bInterval-1) microframes
+            } else if (found->bInterval > 0) {
+                hdev->interval_us = found->bInterval * 1000;       // Frames of 1 ms
+            }
+        }
+        libusb_free_config_descriptor(config);
+    }
+    if (!found) {
+        WARN("No interrupt IN endpoint found (%s), using 0x%02x with %d byte packets",
+             rc == LIBUSB_SUCCESS ? "not in descriptor" : libusb_error_name(rc),
+             hdev->endpoint, hdev->packet_len);
+    }
+
+    // Only a short packet completes a transfer early, so multiples of
+    // wMaxPacketSize let a busy tablet fill a transfer with several reports
+    hdev->transfer_len = hdev->packet_len * g_transfer_packets;
+    if (hdev->transfer_len > AM_TRANSFER_MAX_LEN) hdev->transfer_len = AM_TRANSFER_MAX_LEN;
+
+    if (g_config.ring_depth > 0) {
+        hdev->ring_depth = g_config.ring_depth;
+    } else {
+        int depth = hdev->interval_us ? (AM_TRANSFER_RING_COVER_US + hdev->interval_us - 1) / hdev->interval_us : 0;
+        hdev->ring_depth = depth < AM_TRANSFER_RING_DEPTH ? AM_TRANSFER_RING_DEPTH :
+                           depth > AM_TRANSFER_RING_MAX ? AM_TRANSFER_RING_MAX : depth;
+    }
+}
+
+// Reads the identity of an opened device
+static void device_key_read(struct device_key *key, libusb_device *dev, libusb_device_handle *handle,
+                            const struct libusb_device_descriptor *desc) {
+    memset(key, 0, sizeof(*key));
+    key->bus = libusb_get_bus_number(dev);
+    int n = libusb_get_port_numbers(dev, key->ports, sizeof(key->ports));
+    key->num_ports = n > 0 ? n : 0;
+    key->product_id = desc->idProduct;
+    if (desc->iSerialNumber &&
+        libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, (unsigned char *)key->serial,
+                                           sizeof(key->serial)) < 0) {
+        key->serial[0] = '\0';
+    }
+}
 
-        // Submit the first transfer
-        rc = libusb_submit_transfer(g_tx);
+// Unlinks and returns the parked context of the tablet with this identity
+static struct hanvon_device *parked_take(const struct device_key *key) {
+    for (struct hanvon_device **pp = &g_parked; *pp; pp = &(*pp)->next) {
+        struct hanvon_device *hdev = *pp;
+        if (memcmp(&hdev->key, key, sizeof(*key)) == 0) {
+            *pp = hdev->next;
+            hdev->next = NULL;
+            return hdev;
+        }
+    }
+    return NULL;
+}
+
+// Opens and claims a newly arrived device, creates its uinput node (or takes
+// over the one of its parked context), queues its transfer ring and links
+// its context into g_devices.
+// Returns 0 or a negative error; nothing is left allocated on failure.
+static int device_attach(libusb_device *dev, const struct libusb_device_descriptor *desc) {
+    libusb_device_handle *handle;
+    struct device_key key;
+    int rc;
+
+    DEBUG("Supported device %04x:%04x arrived. Attempting to open...", desc->idVendor, desc->idProduct);
+    rc = libusb_open(dev, &handle);
+    if (rc != LIBUSB_SUCCESS) {
+        ERROR("Error opening device %04x:%04x: %s", desc->idVendor, desc->idProduct, libusb_error_name(rc));
+        return -EIO; // Non-fatal, just couldn't open this one
+    }
+
+    device_key_read(&key, dev, handle, desc);
+    struct hanvon_device *hdev = parked_take(&key);
+    int reused = hdev != NULL;
+    if (reused) {
+        hdev->bus = key.bus;
+        hdev->address = libusb_get_device_address(dev);
+    } else {
+        hdev = device_new(desc->idProduct, key.bus, libusb_get_device_address(dev));
+        if (!hdev) {
+            libusb_close(handle);
+            return -ENODEV;
+        }
+        hdev->key = key;
+    }
+    hdev->handle = handle;
+
+    // Detach kernel driver if active on interface 0
+    rc = libusb_kernel_driver_active(hdev->handle, 0);
+    if (rc == 1) {
+        DEBUG("Kernel driver active on interface 0. Detaching...");
+        rc = libusb_detach_kernel_driver(hdev->handle, 0);
         if (rc != LIBUSB_SUCCESS) {
-            DEBUG("Error submitting initial transfer: %s", libusb_error_name(rc));
-            // Cleanup everything allocated so far
-            libusb_free_transfer(g_tx); g_tx = NULL;
-            libevdev_uinput_destroy(g_uidev); g_uidev = NULL; g_evdev = NULL;
-            libusb_release_interface(g_dev_handle, 0);
-            libusb_attach_kernel_driver(g_dev_handle, 0);
-            libusb_close(g_dev_handle); g_dev_handle = NULL;
+            ERROR("Error detaching kernel driver: %s. Closing device.", libusb_error_name(rc));
+            goto error_close;
+        }
+    } else if (rc < 0 && rc != LIBUSB_ERROR_NOT_SUPPORTED) {
+        ERROR("Error checking kernel driver status: %s. Closing device.", libusb_error_name(rc));
+        goto error_close;
+    }
+
+    // Claim interface 0 (usually the one with the interrupt endpoint)
+    // Check lsusb -v output for bInterfaceNumber if unsure
+    rc = libusb_claim_interface(hdev->handle, 0);
+    if (rc != LIBUSB_SUCCESS) {
+        ERROR("Error claiming interface 0: %s", libusb_error_name(rc));
+        goto error_reattach;
+    }
+    DEBUG("Interface 0 claimed successfully.");
+
+    // Initialize evdev/uinput controls, a parked context still has them
+    if (!reused) {
+        rc = init_ctrl(&hdev->dec, desc->bcdDevice, &hdev->evdev, &hdev->uidev);
+        if (rc < 0) {
+            ERROR("Error: Could not initialize controls for the device (%d).", rc);
+            goto error_release;
+        }
+        hdev->uinput_fd = libevdev_uinput_get_fd(hdev->uidev);
+    }
+
+    device_probe_endpoint(hdev, dev);
+    if (g_ipc && ipc_attach(hdev) < 0) {
+        goto error_release;
+    }
+
+    // Link the context before any transfer can complete
+    hdev->next = g_devices;
+    g_devices = hdev;
+
+    // Allocate and queue the whole transfer ring
+    rc = submit_transfer_ring(hdev);
+    if (rc != LIBUSB_SUCCESS) {
+        // Part of the ring may be queued already, so this takes the
+        // teardown's way out instead of freeing everything here
+        ERROR("Error submitting transfer ring: %s", libusb_error_name(rc));
+        g_devices = hdev->next;
+        device_close(hdev, 0);
+        return -EIO;
+    }
+
+    INFO("Endpoint 0x%02x: %d byte packets every %d us, %d byte transfers",
+         hdev->endpoint, hdev->packet_len, hdev->interval_us, hdev->transfer_len);
+    if (reused) {
+        INFO("Device %04x:%04x reconnected, reusing its input device.", desc->idVendor, desc->idProduct);
+    } else {
+        INFO("Device %04x:%04x initialized and %d transfers submitted.", desc->idVendor, desc->idProduct, hdev->ring_depth);
+    }
+    return 0;
+
+error_release:
+    libusb_release_interface(hdev->handle, 0);
+error_reattach:
+    libusb_attach_kernel_driver(hdev->handle, 0); // Reattach kernel driver
+error_close:
+    libusb_close(hdev->handle);
+    if (hdev->uidev) libevdev_uinput_destroy(hdev->uidev); // Managed uinput also frees evdev
+    device_free(hdev);
+    return -EIO;
+}
+
+// Hands the USB side of a device back: frees its transfers, releases the
+// interface to the kernel and closes the handle. No transfer may be in
+// flight any more.
+static void device_close_usb(struct hanvon_device *hdev) {
+    int rc;
+
+    // 1. Free the transfer ring, every transfer came back
+    free_transfer_ring(hdev);
+
+    // 2. Release the interface
+    DEBUG("Releasing interface 0...");
+    rc = libusb_release_interface(hdev->handle, 0);
+    if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NO_DEVICE) {
+        ERROR("Error releasing interface: %s", libusb_error_name(rc));
+    }
+
+    // 3. Re-attach kernel driver (best effort)
+    DEBUG("Attempting to re-attach kernel driver...");
+    rc = libusb_attach_kernel_driver(hdev->handle, 0);
+    if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NO_DEVICE && rc != LIBUSB_ERROR_NOT_SUPPORTED && rc != LIBUSB_ERROR_BUSY) {
+        ERROR("Error re-attaching kernel driver: %s", libusb_error_name(rc));
+    }
+
+    // 4. Close the device handle
+    DEBUG("Closing device handle...");
+    libusb_close(hdev->handle);
+    hdev->handle = NULL;
+}
+
+// Destroys the uinput node (this also frees the associated evdev device)
+// and frees the context
+static void device_destroy(struct hanvon_device *hdev) {
+    if (hdev->uidev) {
+        DEBUG("Destroying uinput device...");
+        libevdev_uinput_destroy(hdev->uidev);
+        hdev->uidev = NULL;
+        hdev->evdev = NULL; // evdev is freed by uinput destroy
+    }
+    INFO("Device %04x:%04x cleanup complete.", VENDOR_ID_HANVON, hdev->product_id);
+    device_free(hdev);
+}
+
+// Keeps a disconnected device's uinput node for the grace window. The pen
+// is lifted and every button released first, so nothing stays pressed
+// while the tablet is away.
+static void device_park(struct hanvon_device *hdev) {
+    struct hanvon_pen_state *pen = &hdev->dec.pen;
+    struct hanvon_frame frame;
+
+    pen->in_range = pen->touch = pen->stylus = pen->stylus2 = 0;
+    pen->pad = 0;
+    pen->wheel = pen->wheel_hi_res = 0;
+    hanvon_pad_release(&hdev->dec);
+    hanvon_frame_begin(&frame, g_delta_suppression ? &hdev->dec.emitted : NULL);
+    hanvon_emit(&hdev->dec, hanvon_decoder_tuning(&hdev->dec), &frame);
+    hanvon_frame_stamp(&frame, monotonic_ns());
+    if (frame_flush(hdev->uidev, hdev->uinput_fd, &frame) != 0) {
+        COUNT(hdev->counters.uinput_errors);
+    }
+
+    hdev->parked_until_ns = monotonic_ns() + (uint64_t)g_grace_ms * 1000000;
+    hdev->next = g_parked;
+    g_parked = hdev;
+    INFO("Device %04x:%04x disconnected, keeping its input device for %d ms.",
+         VENDOR_ID_HANVON, hdev->product_id, g_grace_ms);
+}
+
+// Destroys the parked devices whose grace window ended before now
+static void parked_expire(uint64_t now) {
+    for (struct hanvon_device **pp = &g_parked; *pp;) {
+        struct hanvon_device *hdev = *pp;
+        if (hdev->parked_until_ns > now) {
+            pp = &hdev->next;
+            continue;
+        }
+        *pp = hdev->next;
+        DEBUG("Grace window of device %04x:%04x ended.", VENDOR_ID_HANVON, hdev->product_id);
+        device_destroy(hdev);
+    }
+}
+
+// A device is torn down in two steps, so no transfer is ever freed while
+// libusb still owns it and nothing blocks: device_close flags the context
+// closing, cancels its ring and moves it to g_closing. Once the callback of
+// the last cancelled transfer returned, devices_reap (main loop) closes the
+// USB side, releases the worker slot and parks the uinput node for the
+// grace window (park) or destroys it with the context. A tablet plugged
+// back in meanwhile attaches with a context of its own.
+static void device_close(struct hanvon_device *hdev, int park) {
+    hdev->park = park;
+    hdev->next = g_closing;
+    g_closing = hdev;
+    // From here callbacks stop resubmitting, see transfer_submit
+    atomic_fetch_or(&hdev->inflight, DEVICE_CLOSING);
+    DEBUG("Cancelling transfer ring...");
+    cancel_transfer_ring(hdev);
+}
+
+// Completes the teardown of every closing device whose transfers all came
+// back (main thread)
+static void devices_reap(void) {
+    for (struct hanvon_device **pp = &g_closing; *pp;) {
+        struct hanvon_device *hdev = *pp;
+        if (atomic_load(&hdev->inflight) != DEVICE_CLOSING) {
+            pp = &hdev->next;
+            continue;
+        }
+        *pp = hdev->next;
+        device_close_usb(hdev);
+        if (g_ipc) ipc_detach(hdev);
+        if (hdev->park) {
+            device_park(hdev);
         } else {
-            DEBUG("Device %04x:%04x initialized and first transfer submitted.", desc.idVendor, desc.idProduct);
+            device_destroy(hdev);
+        }
+    }
+}
+
+// Starts the teardown of a device that left (or of every device at exit)
+static void device_detach(struct hanvon_device *hdev) {
+    // Unlink the context
+    for (struct hanvon_device **pp = &g_devices; *pp; pp = &(*pp)->next) {
+        if (*pp == hdev) {
+            *pp = hdev->next;
+            break;
+        }
+    }
+    device_close(hdev, g_grace_ms > 0 && g_running);
+}
+
+// Handles one hotplug event: attaches a newly arrived supported device or
+// detaches a device that left. Runs on the thread that owns g_devices.
+static void process_hotplug_event(struct libusb_device *dev, libusb_hotplug_event event) {
+
+    struct libusb_device_descriptor desc;
+    int rc;
+
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc < 0) {
+        DEBUG("Hotplug: Failed to get descriptor for event %d", event);
+        return; // Ignore event if descriptor fails
+    }
+
+    DEBUG("Hotplug event: %s for device %04x:%04x",
+           event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "ARRIVED" : "LEFT",
+           desc.idVendor, desc.idProduct);
+
+    if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+        if (device_lookup(dev) != NULL) {
+             INFO("Device %04x:%04x is already attached.", desc.idVendor, desc.idProduct);
+             return;
+        }
+
+        // Check if the device is one we specifically support via find_device logic
+        // (find_device checks product ID list)
+        libusb_device *devs_list[] = {dev};
+        if (find_device(devs_list, 1) < 0) {
+            // find_device already printed a message if vendor matched but product didn't
+            // No need to print again unless vendor didn't match (which hotplug filter should prevent)
+            return; // Not a supported product ID
         }
 
+        device_attach(dev, &desc); // Failures are logged and non-fatal
+
     } else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
-        // --- SINGLE DEVICE CHECK ---
-        // Check if the device leaving is the one we are currently handling.
-        // This requires comparing the libusb_device* pointers.
-        if (g_dev_handle != NULL && libusb_get_device(g_dev_handle) == dev) {
+        struct hanvon_device *hdev = device_lookup(dev);
+        if (hdev != NULL) {
             DEBUG("Handling departure of active device %04x:%04x.", desc.idVendor, desc.idProduct);
+            device_detach(hdev);
+        } else {
+             DEBUG ("INFO: Device %04x:%04x left, but it wasn't an attached device.", desc.idVendor, desc.idProduct);
+        }
 
-            // 1. Cancel any pending transfers associated with this device handle
-            if (g_tx) {
-                DEBUG("Cancelling active transfer...");
-                rc = libusb_cancel_transfer(g_tx);
-                if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NOT_FOUND) {
-                    DEBUG("Error cancelling transfer: %s", libusb_error_name(rc));
-                }
-                // The transfer callback will eventually run with status CANCELLED.
-                // We still need to free the transfer structure itself.
-                libusb_free_transfer(g_tx);
-                g_tx = NULL;
+    } else {
+        DEBUG ("Unhandled hotplug event: %d", event);
+    }
+}
+
+// Runs the hotplug events queued by hotplug_callback (main thread)
+static void process_hotplug_queue(void) {
+    uint64_t count;
+    if (read(g_hotplug_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        ERROR("Error reading hotplug eventfd: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&g_hotplug_lock);
+    struct hotplug_work *work = g_hotplug_head;
+    g_hotplug_head = g_hotplug_tail = NULL;
+    pthread_mutex_unlock(&g_hotplug_lock);
+
+    while (work) {
+        struct hotplug_work *next = work->next;
+        process_hotplug_event(work->dev, work->event);
+        libusb_unref_device(work->dev);
+        free(work);
+        work = next;
+    }
+}
+
+// Hotplug callback function
+// Every supported tablet gets its own context in g_devices, so any number of
+// Hanvon devices can be served at the same time. With the dedicated event
+// thread the event is only queued, so the pen path never waits for attach or
+// detach work.
+int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
+                     libusb_hotplug_event event, void *user_data) {
+    if (!g_event_thread_enabled) {
+        process_hotplug_event(dev, event);
+        return 0; // Return 0 to continue receiving hotplug events
+    }
+
+    struct hotplug_work *work = malloc(sizeof(*work));
+    if (!work) {
+        ERROR("Error queueing hotplug event %d: out of memory", event);
+        return 0;
+    }
+    work->next = NULL;
+    work->dev = libusb_ref_device(dev);
+    work->event = event;
+
+    pthread_mutex_lock(&g_hotplug_lock);
+    if (g_hotplug_tail) g_hotplug_tail->next = work;
+    else g_hotplug_head = work;
+    g_hotplug_tail = work;
+    pthread_mutex_unlock(&g_hotplug_lock);
+
+    uint64_t one = 1;
+    if (write(g_hotplug_efd, &one, sizeof(one)) < 0) {
+        ERROR("Error signalling hotplug eventfd: %s", strerror(errno));
+    }
+    return 0; // Return 0 to continue receiving hotplug events
+}
+
+// Polling enumeration (-P, or when libusb has no hotplug support): compares
+// the bus with g_devices and feeds every difference through the hotplug
+// path. Returns the number of tablets that were attached or detached.
+// Main thread.
+static int scan_devices(void) {
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(NULL, &list);
+    if (count < 0) {
+        WARN_RL("Error enumerating USB devices: %s", libusb_error_name((int)count));
+        return 0;
+    }
+
+    // Departures first, so a tablet replugged between two scans gets a new context
+    int changes = 0;
+    for (struct hanvon_device *hdev = g_devices, *next; hdev; hdev = next) {
+        next = hdev->next;
+        libusb_device *dev = libusb_get_device(hdev->handle);
+        ssize_t i = 0;
+        while (i < count && list[i] != dev) i++;
+        if (i == count) {
+            process_hotplug_event(dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+            changes++;
+        }
+    }
+    for (ssize_t i = 0; i < count; i++) {
+        int found = find_device(list + i, count - i);
+        if (found < 0) break;
+        i += found;
+        if (device_lookup(list[i])) continue;
+        process_hotplug_event(list[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+        // A tablet that cannot be opened is retried, but keeps no fast schedule
+        if (device_lookup(list[i])) changes++;
+    }
+    libusb_free_device_list(list, 1);
+    return changes;
+}
+
+// Enumeration timer: scans, then schedules the next scan. After startup, a
+// change or a vanished tablet the bus is scanned every SCAN_FAST_MS, so a
+// tablet is picked up quickly, and the interval then doubles up to
+// SCAN_SLOW_MS while the bus stays the same.
+static void scan_poll(void) {
+    uint64_t expirations;
+    if (read(g_scan_tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        ERROR("Error reading enumeration timer: %s", strerror(errno));
+    }
+
+    int vanished = atomic_exchange(&g_scan_reset, 0);
+    if (scan_devices() > 0 || vanished) {
+        g_scan_fast_left = SCAN_FAST_COUNT;
+        g_scan_interval_ms = SCAN_FAST_MS;
+    }
+    if (g_scan_fast_left > 0) {
+        g_scan_fast_left--;
+    } else if (g_scan_interval_ms < SCAN_SLOW_MS) {
+        g_scan_interval_ms = g_scan_interval_ms * 2 < SCAN_SLOW_MS ? g_scan_interval_ms * 2 : SCAN_SLOW_MS;
+        DEBUG("No USB changes, next enumeration in %d ms.", g_scan_interval_ms);
+    }
+    // A tablet that vanished during the scan set the flag, but its kick was overwritten
+    scan_timer_set(atomic_load(&g_scan_reset) ? 1 : g_scan_interval_ms);
+}
+
+// Dedicated USB event thread: transfer callbacks (decode and emit) run here
+static void *event_thread_main(void *arg) {
+    while (g_running) {
+        // stop_event_thread interrupts the wait, the timeout is only a fallback
+        struct timeval tv = {1, 0}; // 1 second timeout
+        int rc = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error during libusb event handling: %s\n", libusb_error_name(rc));
+        }
+        atomic_fetch_add(&g_event_passes, 1);
+    }
+    atomic_store(&g_event_exited, 1);
+    return NULL;
+}
+
+// Starts the event thread with the requested scheduling policy and CPU.
+// A real-time priority that cannot be granted (e.g. missing CAP_SYS_NICE)
+// falls back to default scheduling with a warning.
+static int start_event_thread(pthread_t *thread) {
+    pthread_attr_t attr;
+    int rc;
+
+    pthread_attr_init(&attr);
+    if (g_config.priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = g_config.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    rc = pthread_create(thread, &attr, event_thread_main, NULL);
+    if (rc == EPERM && g_config.priority > 0) {
+        fprintf(stderr, "Warning: no permission for SCHED_FIFO priority %d, using default scheduling\n",
+                g_config.priority);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        rc = pthread_create(thread, &attr, event_thread_main, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        fprintf(stderr, "Error creating event thread: %s\n", strerror(rc));
+        return -rc;
+    }
+
+    if (g_event_thread_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(g_event_thread_cpu, &cpus);
+        rc = pthread_setaffinity_np(*thread, sizeof(cpus), &cpus);
+        if (rc != 0) {
+            fprintf(stderr, "Warning: could not pin event thread to CPU %d: %s\n",
+                    g_event_thread_cpu, strerror(rc));
+        }
+    }
+    g_event_thread_running = 1;
+    INFO("Event thread started (priority %d, cpu %d).", g_config.priority, g_event_thread_cpu);
+    return 0;
+}
+
+// Gives the running event thread the priority of g_config (after a reload)
+static void event_thread_set_priority(void) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = g_config.priority;
+    int rc = pthread_setschedparam(g_event_thread, g_config.priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (rc != 0) {
+        WARN("Could not set event thread priority %d: %s", g_config.priority, strerror(rc));
+    } else {
+        INFO("Event thread priority set to %d.", g_config.priority);
+    }
+}
+
+// Stops the event thread and waits for it
+static void stop_event_thread(pthread_t thread) {
+    g_running = 0;
+    libusb_interrupt_event_handler(NULL);
+    pthread_join(thread, NULL);
+    g_event_thread_running = 0;
+    DEBUG("Event thread stopped.");
+}
+
+// Waits until the callbacks the event thread is running have returned, so
+// what they may have loaded before (a tuning swapped out) can be freed.
+// Without the event thread they run on this thread and nothing is in use.
+static void event_thread_sync(void) {
+    if (!g_event_thread_running) return;
+    unsigned int passes = atomic_load(&g_event_passes);
+    libusb_interrupt_event_handler(NULL);
+    while (atomic_load(&g_event_passes) == passes && !atomic_load(&g_event_exited)) {
+        usleep(100);
+    }
+}
+
+// Adds fd to the main loop; it is told apart by its number when it fires
+static int loop_add(int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ERROR("Error adding fd %d to the main loop: %s", fd, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+static void loop_pollfd_added(int fd, short events, void *user_data) {
+    loop_add(fd, (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0));
+}
+
+static void loop_pollfd_removed(int fd, void *user_data) {
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+        WARN("Error removing fd %d from the main loop: %s", fd, strerror(errno));
+    }
+}
+
+// Creates the main loop. Without the event thread libusb's own fds are
+// watched too (and followed through the pollfd notifiers), so USB events,
+// hotplug, signals and stats requests all wake the same epoll_wait.
+// SIGINT/SIGTERM/SIGUSR1/SIGHUP must already be blocked in every thread.
+static int loop_open(const sigset_t *signals) {
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epoll_fd < 0) {
+        fprintf(stderr, "Error creating main loop: %s\n", strerror(errno));
+        return -errno;
+    }
+    g_signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (g_signal_fd < 0) {
+        fprintf(stderr, "Error creating signalfd: %s\n", strerror(errno));
+        close(g_epoll_fd);
+        return -errno;
+    }
+
+    int rc = loop_add(g_signal_fd, EPOLLIN);
+    if (rc == 0 && g_stats_fd >= 0) rc = loop_add(g_stats_fd, EPOLLIN);
+    if (rc == 0 && g_hotplug_efd >= 0) rc = loop_add(g_hotplug_efd, EPOLLIN);
+    if (rc == 0 && g_ipc_frame_efd >= 0) rc = loop_add(g_ipc_frame_efd, EPOLLIN);
+    if (rc == 0 && g_idle_tfd >= 0) rc = loop_add(g_idle_tfd, EPOLLIN);
+    if (rc == 0 && g_scan_tfd >= 0) rc = loop_add(g_scan_tfd, EPOLLIN);
+    if (rc == 0 && !g_event_thread_enabled) {
+        const struct libusb_pollfd **fds = libusb_get_pollfds(NULL);
+        if (!fds) {
+            fprintf(stderr, "Error: libusb cannot export its file descriptors\n");
+            rc = -ENOTSUP;
+        }
+        for (size_t i = 0; rc == 0 && fds[i]; i++) {
+            rc = loop_add(fds[i]->fd, (fds[i]->events & POLLIN ? EPOLLIN : 0) |
+                                      (fds[i]->events & POLLOUT ? EPOLLOUT : 0));
+        }
+        libusb_free_pollfds(fds);
+        if (rc == 0) libusb_set_pollfd_notifiers(NULL, loop_pollfd_added, loop_pollfd_removed, NULL);
+    }
+    if (rc < 0) {
+        close(g_signal_fd);
+        close(g_epoll_fd);
+    }
+    return rc;
+}
+
+static void loop_close(void) {
+    if (!g_event_thread_enabled) libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+    close(g_signal_fd);
+    close(g_epoll_fd);
+}
+
+// Milliseconds until libusb's next internal timeout or the end of the
+// first grace window, -1 when there is neither
+static int loop_timeout_ms(void) {
+    uint64_t due_ns = UINT64_MAX;
+    struct timeval tv;
+    if (!g_event_thread_enabled && libusb_get_next_timeout(NULL, &tv) == 1) {
+        due_ns = (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+    }
+    if (g_parked) {
+        uint64_t now = monotonic_ns();
+        for (const struct hanvon_device *hdev = g_parked; hdev; hdev = hdev->next) {
+            uint64_t left = hdev->parked_until_ns > now ? hdev->parked_until_ns - now : 0;
+            if (left < due_ns) due_ns = left;
+        }
+    }
+    if (due_ns == UINT64_MAX) return -1;
+    return due_ns > (uint64_t)INT_MAX * 1000000 ? INT_MAX : (int)((due_ns + 999999) / 1000000);
+}
+
+// Parsers shared by the options and the configuration file, 0 or -EINVAL
+static int parse_int(const char *s, int min, int max, int *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno || end == s || *end || v < min || v > max) return -EINVAL;
+    *out = (int)v;
+    return 0;
+}
+
+static int parse_curve(const char *s, struct hanvon_mapping_params *mapping) {
+    int c[4];
+    if (sscanf(s, "%d,%d,%d,%d", &c[0], &c[1], &c[2], &c[3]) != 4) return -EINVAL;
+    for (int i = 0; i < 4; i++) {
+        if (c[i] < 0 || c[i] > 100) return -EINVAL;
+    }
+    for (int i = 0; i < 4; i++) mapping->curve[i] = c[i] / 100.0f;
+    return 0;
+}
+
+static int parse_area(const char *s, struct hanvon_mapping_params *mapping) {
+    int a[4];
+    if (sscanf(s, "%d,%d,%d,%d", &a[0], &a[1], &a[2], &a[3]) != 4 ||
+        a[0] < 0 || a[1] < 0 || a[2] <= a[0] || a[3] <= a[1]) {
+        return -EINVAL;
+    }
+    memcpy(mapping->area, a, sizeof(a));
+    return 0;
+}
+
+static int parse_orientation(const char *s, enum hanvon_rotation *rotation) {
+    if (strcmp(s, "none") == 0) {
+        *rotation = HANVON_ROTATE_NONE;
+    } else if (strcmp(s, "cw") == 0) {
+        *rotation = HANVON_ROTATE_CW;
+    } else if (strcmp(s, "ccw") == 0) {
+        *rotation = HANVON_ROTATE_CCW;
+    } else if (strcmp(s, "half") == 0) {
+        *rotation = HANVON_ROTATE_HALF;
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+    return s;
+}
+
+// Parses a pad combo such as KEY_LEFTCTRL+KEY_Z (key names or codes, at most
+// HANVON_PAD_COMBO_KEYS); a lone 0 is the empty combo
+static int parse_combo(const char *s, struct hanvon_pad_combo *combo) {
+    char buf[128];
+    int n = 0;
+
+    memset(combo, 0, sizeof(*combo));
+    if (strcmp(s, "0") == 0) return 0;
+    if (strlen(s) >= sizeof(buf)) return -EINVAL;
+    strcpy(buf, s);
+    for (char *save = NULL, *tok = strtok_r(buf, "+", &save); tok; tok = strtok_r(NULL, "+", &save)) {
+        tok = trim(tok);
+        int code = libevdev_event_code_from_name(EV_KEY, tok);
+        if (code < 0 && parse_int(tok, 1, KEY_MAX, &code) < 0) return -EINVAL;
+        if (n == HANVON_PAD_COMBO_KEYS) return -EINVAL;
+        combo->key[n++] = code;
+    }
+    return n ? 0 : -EINVAL;
+}
+
+// Sets the combo of the chord of the buttons in s ("0+1"), replacing an
+// earlier line for the same buttons
+static int config_set_chord(struct hanvon_pad_params *pad, const char *s, const char *value) {
+    uint32_t buttons = 0;
+    int count = 0;
+
+    for (const char *p = s; ; p++) {
+        char *end;
+        errno = 0;
+        unsigned long b = strtoul(p, &end, 10);
+        if (errno || end == p || b >= HANVON_MAX_BUTTONS || (buttons & (1u << b))) return -EINVAL;
+        buttons |= 1u << b;
+        count++;
+        if (*end == '\0') break;
+        if (*end != '+') return -EINVAL;
+        p = end;
+    }
+    if (count < 2) return -EINVAL;
+
+    int i = 0;
+    while (i < pad->num_chords && pad->chord[i].buttons != buttons) i++;
+    if (i == HANVON_PAD_CHORDS) return -EINVAL;
+    if (parse_combo(value, &pad->chord[i].combo) < 0 || !pad->chord[i].combo.key[0]) return -EINVAL;
+    pad->chord[i].buttons = buttons;
+    if (i == pad->num_chords) pad->num_chords++;
+    return 0;
+}
+
+// Applies one "key = value" line of the configuration file
+static int config_set(struct daemon_config *config, const char *key, const char *value) {
+    unsigned button;
+    int n = 0;
+
+    if (strcmp(key, "curve") == 0) {
+        config->mapping_enabled = 1;
+        return parse_curve(value, &config->mapping);
+    } else if (strcmp(key, "area") == 0) {
+        config->mapping_enabled = 1;
+        return parse_area(value, &config->mapping);
+    } else if (strcmp(key, "orientation") == 0) {
+        config->mapping_enabled = 1;
+        return parse_orientation(value, &config->mapping.rotation);
+    } else if (strcmp(key, "filter") == 0) {
+        if (strcmp(value, "on") == 0) config->filter_enabled = 1;
+        else if (strcmp(value, "off") == 0) config->filter_enabled = 0;
+        else return -EINVAL;
+        return 0;
+    } else if (strcmp(key, "predict_us") == 0) {
+        return parse_int(value, 0, 50000, &config->predict_us);
+    } else if (strcmp(key, "ring_depth") == 0) {
+        return parse_int(value, 0, AM_TRANSFER_RING_MAX, &config->ring_depth);
+    } else if (strcmp(key, "priority") == 0) {
+        return parse_int(value, 0, sched_get_priority_max(SCHED_FIFO), &config->priority);
+    } else if (strcmp(key, "hold_ms") == 0) {
+        return parse_int(value, 50, 5000, &config->pad.hold_ms);
+    } else if (sscanf(key, "button%u%n", &button, &n) == 1 && button < HANVON_MAX_BUTTONS) {
+        // Key names such as KEY_F1 or BTN_0, or codes, joined by '+'; 0 is the model's
+        if (key[n] == '\0') return parse_combo(value, &config->pad.press[button]);
+        if (strcmp(key + n, ".hold") == 0) return parse_combo(value, &config->pad.hold[button]);
+    } else if (strncmp(key, "chord", 5) == 0) {
+        return config_set_chord(&config->pad, key + 5, value);
+    }
+    return -EINVAL;
+}
+
+// Reads the configuration file at path over *config. Lines are
+// "key = value", '#' starts a comment. *config is only changed when the
+// whole file is valid; a bad line is logged and fails with -EINVAL.
+static int config_load(const char *path, struct daemon_config *config) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        int err = errno;
+        ERROR("Error opening configuration file %s: %s", path, strerror(err));
+        return -err;
+    }
+
+    struct daemon_config next = *config;
+    char line[256];
+    int lineno = 0, rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), in)) {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *key = trim(line);
+        if (*key == '\0') continue;
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            ERROR("%s:%d: expected key = value", path, lineno);
+            rc = -EINVAL;
+            break;
+        }
+        *eq = '\0';
+        char *value = trim(eq + 1);
+        key = trim(key);
+        rc = config_set(&next, key, value);
+        if (rc < 0) ERROR("%s:%d: invalid setting '%s = %s'", path, lineno, key, value);
+    }
+    fclose(in);
+
+    // Every model's input device must be able to send all pad keys
+    size_t count;
+    const struct hanvon_profile *profiles = hanvon_profiles(&count);
+    for (size_t i = 0; rc == 0 && i < count; i++) {
+        if (hanvon_pad_count_keys(&next.pad, &profiles[i]) < 0) {
+            ERROR("%s: the pad actions of %s send more than %d different keys", path, profiles[i].name,
+                  HANVON_PAD_KEYS_MAX);
+            rc = -EINVAL;
+        }
+    }
+    if (rc == 0) *config = next;
+    return rc;
+}
+
+// Reads the configuration file again and applies it without touching the
+// USB or uinput side of any device: every decoder (the worker's too) gets a
+// new tuning and the event thread its new priority. A new ring depth only
+// applies to tablets that attach later. A bad file changes nothing.
+static int config_reload(void) {
+    if (!g_config_path) {
+        WARN("No configuration file (-k), nothing to reload");
+        return -ENOENT;
+    }
+    struct daemon_config config = g_config_options;
+    int rc = config_load(g_config_path, &config);
+    if (rc < 0) {
+        WARN("Keeping the running configuration");
+        return rc;
+    }
+
+    int priority = g_config.priority;
+    g_config = config;
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) device_tune(hdev);
+    for (struct hanvon_device *hdev = g_parked; hdev; hdev = hdev->next) device_tune(hdev);
+    if (g_ipc) ipc_send(NULL, HANVON_IPC_CONFIG, (const unsigned char *)&g_config, sizeof(g_config), 0);
+    if (g_event_thread_enabled && g_config.priority != priority) event_thread_set_priority();
+    INFO("Configuration reloaded from %s", g_config_path);
+    return 0;
+}
+
+// Writes the statistics to a client of the stats socket
+static void control_stats(int fd) {
+    int copy = dup(fd);
+    FILE *out = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (!out) {
+        if (copy >= 0) close(copy);
+        return;
+    }
+    write_stats(out);
+    fclose(out);
+}
+
+static void control_command(int fd, const char *command) {
+    if (strcmp(command, "stats") == 0) {
+        control_stats(fd);
+    } else if (strcmp(command, "reload") == 0) {
+        int rc = config_reload();
+        if (rc < 0) dprintf(fd, "error: %s\n", strerror(-rc));
+        else dprintf(fd, "ok\n");
+    } else if (*command) {
+        dprintf(fd, "error: unknown command '%s'\n", command);
+    }
+}
+
+static void control_close(struct control_client *client) {
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+}
+
+// Answers every pending connection on the stats socket with the statistics
+// and keeps the client for commands; beyond CONTROL_MAX_CLIENTS, or when it
+// cannot be watched, it is disconnected after the statistics like before.
+static void control_accept(void) {
+    int fd;
+    while ((fd = accept4(g_stats_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        control_stats(fd);
+        struct control_client *client = NULL;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && !client; i++) {
+            if (g_control[i].fd < 0) client = &g_control[i];
+        }
+        if (!client || loop_add(fd, EPOLLIN) < 0) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->len = 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        WARN_RL("Error accepting stats connection: %s", strerror(errno));
+    }
+}
+
+static struct control_client *control_lookup(int fd) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (g_control[i].fd == fd) return &g_control[i];
+    }
+    return NULL;
+}
+
+// Runs the commands a client sent, one per line. An unfinished last line
+// still runs when the client closes its side.
+static void control_serve(struct control_client *client) {
+    ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n > 0) client->len += n;
+    client->buf[client->len] = '\0';
+
+    char *line = client->buf;
+    char *newline;
+    while ((newline = strchr(line, '\n'))) {
+        *newline = '\0';
+        control_command(client->fd, trim(line));
+        line = newline + 1;
+    }
+    client->len -= line - client->buf;
+    memmove(client->buf, line, client->len + 1);
+
+    if (n <= 0) {
+        control_command(client->fd, trim(client->buf));
+        control_close(client);
+    } else if (client->len == sizeof(client->buf) - 1) {
+        WARN_RL("Stats socket command too long, disconnecting the client");
+        control_close(client);
+    }
+}
+
+static void handle_signals(void) {
+    struct signalfd_siginfo si;
+    while (read(g_signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) {
+            write_stats(stderr);
+            if (g_ipc_pid > 0) kill(g_ipc_pid, SIGUSR1); // The worker has the decode side
+        } else if (si.ssi_signo == SIGHUP) {
+            config_reload();
+        } else if (si.ssi_signo == SIGCHLD) {
+            if (g_ipc_pid > 0 && waitpid(g_ipc_pid, NULL, WNOHANG) == g_ipc_pid) {
+                ERROR("Decoder worker exited, shutting down");
+                g_ipc_pid = -1;
+                g_running = 0;
+            }
+        } else {
+            INFO("Received signal %u, initiating shutdown...", si.ssi_signo);
+            g_running = 0;
+        }
+    }
+}
+
+// Idle poll timer: resubmits one parked transfer of every idle device, and
+// stops the timer once no device has any parked
+static void idle_poll(void) {
+    uint64_t expirations;
+    if (read(g_idle_tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        ERROR("Error reading idle poll timer: %s", strerror(errno));
+    }
+
+    int parked = 0;
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) {
+        uint32_t mask = atomic_load(&hdev->idle_parked);
+        while (mask) {
+            uint32_t bit = mask & -mask;
+            mask = atomic_fetch_and(&hdev->idle_parked, ~bit);
+            if (!(mask & bit)) continue; // Taken back by the callback meanwhile
+            int rc = transfer_submit(hdev, hdev->tx[__builtin_ctz(bit)]);
+            if (rc != LIBUSB_SUCCESS) {
+                COUNT(hdev->counters.resubmit_failures);
+                WARN_RL("Error submitting idle poll transfer: %s", libusb_error_name(rc));
             }
+            break;
+        }
+        parked |= atomic_load(&hdev->idle_parked) != 0;
+    }
+    if (parked) return;
+
+    atomic_store(&g_idle_armed, 0);
+    idle_timer_set(0);
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) {
+        // Parked after the scan, keep polling
+        if (atomic_load(&hdev->idle_parked) && !atomic_exchange(&g_idle_armed, 1)) {
+            idle_timer_set(g_idle_poll_ms);
+            break;
+        }
+    }
+}
 
-            // 2. Destroy the uinput device (this also frees the associated evdev device)
-            if (g_uidev) {
-                DEBUG("Destroying uinput device...");
-                libevdev_uinput_destroy(g_uidev);
-                g_uidev = NULL;
-                g_evdev = NULL; // evdev is freed by uinput destroy
+// Sleeps until there is work: without the event thread transfer callbacks
+// and hotplug events run from here, with it only the queued hotplug work.
+// Polling enumeration always runs here.
+static void loop_run(void) {
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    while (g_running) {
+        int n = epoll_wait(g_epoll_fd, events, LOOP_MAX_EVENTS, loop_timeout_ms());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ERROR("Error waiting in the main loop: %s", strerror(errno));
+            break;
+        }
+        int usb = n == 0; // A libusb timeout expired
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            struct control_client *client;
+            if (fd == g_signal_fd) handle_signals();
+            else if (fd == g_stats_fd) control_accept();
+            else if (fd == g_hotplug_efd) process_hotplug_queue();
+            else if (fd == g_ipc_frame_efd) ipc_receive_frames();
+            else if (fd == g_idle_tfd) idle_poll();
+            else if (fd == g_scan_tfd) scan_poll();
+            else if ((client = control_lookup(fd))) control_serve(client);
+            else usb = 1;
+        }
+        if (usb && !g_event_thread_enabled) {
+            struct timeval zero = {0, 0};
+            int rc = libusb_handle_events_timeout_completed(NULL, &zero, NULL);
+            if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+                ERROR("Error during libusb event handling: %s", libusb_error_name(rc));
             }
+        }
+        if (g_closing) devices_reap();
+        if (g_parked) parked_expire(monotonic_ns());
+    }
+}
+
+
+// Gives the device a worker ring slot and tells the worker to start a
+// decoder for it (front, main thread)
+static int ipc_attach(struct hanvon_device *hdev) {
+    for (int slot = 0; slot < HANVON_IPC_SLOTS; slot++) {
+        if (g_ipc_slots[slot]) continue;
+        hdev->ipc_slot = slot;
+        hdev->ipc_generation = ++g_ipc_generations[slot];
+        if (ipc_send(hdev, HANVON_IPC_ATTACH, NULL, 0, 0) < 0) {
+            hdev->ipc_slot = -1;
+            return -ENOBUFS;
+        }
+        g_ipc_slots[slot] = hdev;
+        return 0;
+    }
+    ERROR("No free decoder worker slot for device %04x:%04x", VENDOR_ID_HANVON, hdev->product_id);
+    return -ENOSPC;
+}
+
+// Frees the slot; frames of the old generation still queued are dropped
+// (front, main thread)
+static void ipc_detach(struct hanvon_device *hdev) {
+    if (hdev->ipc_slot < 0) return;
+    ipc_send(hdev, HANVON_IPC_DETACH, NULL, 0, 0);
+    g_ipc_slots[hdev->ipc_slot] = NULL;
+    hdev->ipc_slot = -1;
+}
+
+// Writes the frames the worker produced to their uinput devices (front,
+// main loop)
+static void ipc_receive_frames(void) {
+    uint64_t count;
+    if (read(g_ipc_frame_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        ERROR("Error reading worker eventfd: %s", strerror(errno));
+    }
 
-            // 3. Release the interface
-            DEBUG("Releasing interface 0...");
-            rc = libusb_release_interface(g_dev_handle, 0);
-             if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NO_DEVICE) {
-                 DEBUG("Error releasing interface: %s", libusb_error_name(rc));
-             }
-
-            // 4. Re-attach kernel driver (best effort)
-            DEBUG("Attempting to re-attach kernel driver...");
-            rc = libusb_attach_kernel_driver(g_dev_handle, 0);
-            if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_NO_DEVICE && rc != LIBUSB_ERROR_NOT_SUPPORTED && rc != LIBUSB_ERROR_BUSY) {
-                 DEBUG("Error re-attaching kernel driver: %s", libusb_error_name(rc));
+    int64_t i;
+    while ((i = hanvon_ipc_peek(&g_ipc->frames, HANVON_IPC_FRAMES)) >= 0) {
+        const struct hanvon_ipc_frame *rec = &g_ipc->frame[i];
+        struct hanvon_device *hdev = rec->slot < HANVON_IPC_SLOTS ? g_ipc_slots[rec->slot] : NULL;
+        if (hdev && hdev->ipc_generation == rec->generation && rec->count <= HANVON_FRAME_MAX_EVENTS) {
+            int err = frame_write(hdev->uidev, hdev->uinput_fd, rec->ev, rec->count);
+            if (err != 0) {
+                COUNT(hdev->counters.uinput_errors);
+                WARN_RL("Error writing event frame: %d (%s)", err, strerror(-err));
+                atomic_store_explicit(&g_ipc->resync[rec->slot], 1, memory_order_relaxed);
             }
+        }
+        hanvon_ipc_release(&g_ipc->frames);
+    }
+}
 
-            // 5. Close the device handle
-            DEBUG("Closing device handle...");
-            libusb_close(g_dev_handle);
-            g_dev_handle = NULL;
+// Runs one record of the front in the worker
+static void ipc_worker_record(const struct hanvon_ipc_packet *rec) {
+    if (rec->kind == HANVON_IPC_CONFIG) {
+        // Single threaded, the tunings are never in use while this runs
+        if (rec->len != sizeof(g_config)) return;
+        memcpy(&g_config, rec->data, sizeof(g_config));
+        for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) device_tune(hdev);
+        return;
+    }
+    if (rec->slot >= HANVON_IPC_SLOTS) return;
+    struct hanvon_device *hdev = g_ipc_slots[rec->slot];
+
+    // A new generation replaces whatever the slot held before
+    if (hdev && (rec->kind != HANVON_IPC_PACKET || hdev->ipc_generation != rec->generation)) {
+        for (struct hanvon_device **pp = &g_devices; *pp; pp = &(*pp)->next) {
+            if (*pp == hdev) {
+                *pp = hdev->next;
+                break;
+            }
+        }
+        g_ipc_slots[rec->slot] = NULL;
+        device_free(hdev);
+        hdev = NULL;
+    }
 
-            DEBUG("Device %04x:%04x cleanup complete.", desc.idVendor, desc.idProduct);
+    if (rec->kind == HANVON_IPC_ATTACH) {
+        hdev = device_new(rec->product_id, rec->bus, rec->address);
+        if (!hdev) return;
+        hdev->ipc_slot = rec->slot;
+        hdev->ipc_generation = rec->generation;
+        hdev->interval_us = rec->interval_us;
+        hdev->packet_len = rec->packet_len;
+        if (hdev->max_x != rec->max_x || hdev->max_y != rec->max_y) {
+            // A parked input device from before a reload decides the axes
+            hdev->max_x = rec->max_x;
+            hdev->max_y = rec->max_y;
+            device_tune(hdev);
+        }
+        hdev->next = g_devices;
+        g_devices = hdev;
+        g_ipc_slots[rec->slot] = hdev;
+        atomic_store_explicit(&g_ipc->resync[rec->slot], 0, memory_order_relaxed);
+        DEBUG("Worker: decoder for %04x:%04x in slot %u", VENDOR_ID_HANVON, rec->product_id, rec->slot);
+    } else if (rec->kind == HANVON_IPC_PACKET && hdev) {
+        if (atomic_exchange_explicit(&g_ipc->resync[rec->slot], 0, memory_order_relaxed)) {
+            hdev->dec.emitted.valid = 0;
+        }
+        process_packet(hdev, rec->data, rec->len, rec->time_ns, rec->time_ns);
+    }
+}
 
-        } else {
-             DEBUG ("INFO: Device %04x:%04x left, but it wasn't the active device or no device was active.", desc.idVendor, desc.idProduct);
+// Worker process: gives up root, then decodes until the front goes away.
+// SIGUSR1 prints its statistics (decode counters and latency) to stderr.
+static int ipc_worker_main(uid_t uid, gid_t gid) {
+    g_ipc_worker = 1;
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (geteuid() == 0) {
+        if (setgroups(0, NULL) < 0 || setgid(gid) < 0 || setuid(uid) < 0) {
+            ERROR("Worker: cannot drop privileges: %s", strerror(errno));
+            return EXIT_FAILURE;
         }
-        // --- END SINGLE DEVICE CHECK ---
+    } else if (geteuid() != uid) {
+        WARN("Worker: not started as root, keeping uid %u", (unsigned)geteuid());
+    }
+    prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
 
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigterm_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = sigusr1_handler;
+    sigaction(SIGUSR1, &action, NULL);
+    INFO("Decoder worker running as uid %u", (unsigned)geteuid());
+
+    while (g_running) {
+        int64_t i;
+        while ((i = hanvon_ipc_peek(&g_ipc->packets, HANVON_IPC_PACKETS)) >= 0) {
+            ipc_worker_record(&g_ipc->packet[i]);
+            hanvon_ipc_release(&g_ipc->packets);
+        }
+        if (g_dump_stats) {
+            g_dump_stats = 0;
+            write_stats(stderr);
+        }
+        uint64_t count;
+        if (read(g_ipc_packet_efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            ERROR("Worker: error reading eventfd: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Maps the rings and forks the decoder worker, which runs as user (-i).
+// Must run before libusb_init and before any thread is started.
+static int ipc_start(const char *user, const sigset_t *signals) {
+    struct passwd *pw = getpwnam(user);
+    if (!pw) {
+        fprintf(stderr, "Unknown user '%s' for the decoder worker\n", user);
+        return -ENOENT;
+    }
+    g_ipc = mmap(NULL, sizeof(*g_ipc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_ipc == MAP_FAILED) {
+        g_ipc = NULL;
+        fprintf(stderr, "Error mapping the worker rings: %s\n", strerror(errno));
+        return -ENOMEM;
+    }
+    g_ipc_packet_efd = eventfd(0, EFD_CLOEXEC);
+    g_ipc_frame_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_ipc_packet_efd < 0 || g_ipc_frame_efd < 0) {
+        fprintf(stderr, "Error creating worker eventfds: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    g_ipc_pid = fork();
+    if (g_ipc_pid < 0) {
+        fprintf(stderr, "Error starting the decoder worker: %s\n", strerror(errno));
+        return -errno;
+    }
+    if (g_ipc_pid == 0) {
+        pthread_sigmask(SIG_UNBLOCK, signals, NULL);
+        int rc = ipc_worker_main(pw->pw_uid, pw->pw_gid);
+        fflush(stderr);
+        _exit(rc);
+    }
+    INFO("Decoder worker %d started as %s", (int)g_ipc_pid, user);
+    return 0;
+}
+
+// Stops and reaps the worker (front). A worker whose front died without
+// getting here is stopped by PR_SET_PDEATHSIG instead.
+static void ipc_stop(void) {
+    if (g_ipc_pid > 0) {
+        kill(g_ipc_pid, SIGTERM);
+        waitpid(g_ipc_pid, NULL, 0);
+        g_ipc_pid = -1;
+    }
+    if (g_ipc) munmap(g_ipc, sizeof(*g_ipc));
+    g_ipc = NULL;
+    if (g_ipc_packet_efd >= 0) close(g_ipc_packet_efd);
+    if (g_ipc_frame_efd >= 0) close(g_ipc_frame_efd);
+}
+
+// Finds or creates the replay context of a recorded device
+static struct hanvon_device *replay_device(uint16_t product_id, uint8_t bus, uint8_t address) {
+    for (struct hanvon_device *hdev = g_devices; hdev; hdev = hdev->next) {
+        if (hdev->product_id == product_id && hdev->bus == bus && hdev->address == address) {
+            return hdev;
+        }
+    }
+
+    struct hanvon_device *hdev = device_new(product_id, bus, address);
+    if (!hdev) {
+        return NULL;
+    }
+    if (g_replay_discard) {
+        hdev->uinput_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (hdev->uinput_fd < 0) {
+            ERROR("Error opening /dev/null: %s", strerror(errno));
+            device_free(hdev);
+            return NULL;
+        }
     } else {
-        DEBUG ("Unhandled hotplug event: %d", event);
+        if (init_ctrl(&hdev->dec, 0, &hdev->evdev, &hdev->uidev) < 0) {
+            device_free(hdev);
+            return NULL;
+        }
+        hdev->uinput_fd = libevdev_uinput_get_fd(hdev->uidev);
     }
-    return 0; // Return 0 to continue receiving hotplug events
+    hdev->next = g_devices;
+    g_devices = hdev;
+    return hdev;
 }
 
+// Feeds a capture file through the decoder and emitter (-R), as fast as
+// possible or at the recorded pace (-T), then prints the statistics
+static int replay_capture(const char *path) {
+    unsigned char header[CAPTURE_HEADER_LEN] = {0};
+    unsigned char record[CAPTURE_RECORD_LEN];
+    unsigned char data[CAPTURE_MAX_PACKET];
+    uint16_t version = 0;
+    uint64_t first_ns = 0, start_ns, packets = 0;
+    int rc = 0;
+
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Error opening capture file %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (fread(header, sizeof(header), 1, in) == 1) {
+        memcpy(&version, header + 6, sizeof(version));
+    }
+    if (memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+        le16toh(version) != CAPTURE_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d capture file\n", path, CAPTURE_VERSION);
+        fclose(in);
+        return -EINVAL;
+    }
 
-int main() {
+    start_ns = monotonic_ns();
+    while (g_running && fread(record, sizeof(record), 1, in) == 1) {
+        uint64_t ns;
+        uint16_t product_id, len;
+        memcpy(&ns, record, 8);
+        memcpy(&product_id, record + 8, 2);
+        memcpy(&len, record + 12, 2);
+        ns = le64toh(ns);
+        product_id = le16toh(product_id);
+        len = le16toh(len);
+        if (len > sizeof(data) || fread(data, 1, len, in) != len) {
+            fprintf(stderr, "Error: truncated or corrupt record %llu in %s\n",
+                    (unsigned long long)packets, path);
+            rc = -EINVAL;
+            break;
+        }
+
+        struct hanvon_device *hdev = replay_device(product_id, record[10], record[11]);
+        if (!hdev) {
+            rc = -ENODEV;
+            break;
+        }
+        if (packets == 0) first_ns = ns;
+        if (g_replay_realtime) {
+            uint64_t due = start_ns + (ns - first_ns);
+            struct timespec ts = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && g_running);
+        }
+        process_packet(hdev, data, len, ns, g_latency_enabled ? monotonic_ns() : 0);
+        packets++;
+        if (g_dump_stats) {
+            g_dump_stats = 0;
+            write_stats(stderr);
+        }
+    }
+    fclose(in);
+
+    uint64_t elapsed = monotonic_ns() - start_ns;
+    fprintf(stderr, "Replayed %llu packets in %.3f ms (%.0f packets/s)\n",
+            (unsigned long long)packets, elapsed / 1e6,
+            elapsed ? packets * 1e9 / elapsed : 0.0);
+    write_stats(stderr);
+
+    while (g_devices) {
+        struct hanvon_device *hdev = g_devices;
+        g_devices = hdev->next;
+        if (hdev->uidev) {
+            libevdev_uinput_destroy(hdev->uidev);
+        } else if (hdev->uinput_fd >= 0) {
+            close(hdev->uinput_fd);
+        }
+        device_free(hdev);
+    }
+    return rc;
+}
+
+#ifndef HANVON_NO_MAIN
+// Prints command line help
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -r N   number of queued interrupt transfers per device (1-%d, default: %d ms\n"
+            "         of polling, at least %d)\n"
+            "  -e M   event emission mode: batch (one write per frame, default) or event\n"
+            "  -D     disable delta suppression (re-emit unchanged axes and keys)\n"
+            "  -t     handle USB events on a dedicated thread\n"
+            "  -p N   SCHED_FIFO priority of the event thread (1-99, implies -t)\n"
+            "  -c N   pin the event thread to CPU N (implies -t)\n"
+            "  -l     record per-device latency histograms (dumped on SIGUSR1)\n"
+            "  -S P   serve statistics on the unix socket P\n"
+            "  -g MS  keep the input device MS milliseconds after a disconnect\n"
+            "  -b N   make every interrupt transfer N max-size packets long (1-%d, default 1)\n"
+            "  -H     merge the hover reports of one transfer into a single frame\n"
+            "  -I N[,MS] go idle after N identical reports or when the pen leaves, and\n"
+            "         then poll the tablet only every MS milliseconds\n"
+            "  -i U   decode in a separate worker process running as user U\n"
+            "  -P     find tablets by polling the bus instead of hotplug events (the\n"
+            "         default when libusb has no hotplug support)\n"
+            "  -f     smooth pen motion with the model's One-Euro filter\n"
+            "  -F US  predict the pen position US microseconds ahead (implies -f)\n"
+            "  -C C   pressure curve x1,y1,x2,y2 (0-100, default 0,0,100,100)\n"
+            "  -A A   map the active area x0,y0,x1,y1 (tablet counts) to the full range\n"
+            "  -O R   tablet orientation: none, cw, ccw or half\n"
+            "  -k F   read settings from the file F, again on SIGHUP or 'reload' (-S)\n"
+            "  -m N   publish pen states to the shared memory ring /dev/shm/N\n"
+            "  -w F   capture raw packets to the file F\n"
+            "  -R F   replay the capture file F instead of reading USB devices\n"
+            "  -T     replay at the recorded pace (default: as fast as possible)\n"
+            "  -N     replay without uinput, frames are written to /dev/null\n"
+            "  -v     more verbose logging (repeat for debug and trace output)\n"
+            "  -q     quieter logging (repeat to log errors only)\n"
+            "  -h     show this help\n",
+            prog, AM_TRANSFER_RING_MAX, AM_TRANSFER_RING_COVER_US / 1000, AM_TRANSFER_RING_DEPTH,
+            AM_TRANSFER_PACKETS_MAX);
+}
+
+int main(int argc, char **argv) {
     int rc;
+    int opt;
+    const char *capture_path = NULL;
+    const char *replay_path = NULL;
+    const char *isolate_user = NULL;
+
+    while ((opt = getopt(argc, argv, "r:e:Dtp:c:lS:g:b:HI:i:PfF:C:A:O:k:m:w:R:TNvqh")) != -1) {
+        switch (opt) {
+            case 'r':
+                g_config.ring_depth = atoi(optarg);
+                if (g_config.ring_depth < 1 || g_config.ring_depth > AM_TRANSFER_RING_MAX) {
+                    fprintf(stderr, "Invalid ring depth '%s' (expected 1-%d)\n", optarg, AM_TRANSFER_RING_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "batch") == 0) {
+                    g_emit_mode = EMIT_BATCHED;
+                } else if (strcmp(optarg, "event") == 0) {
+                    g_emit_mode = EMIT_PER_EVENT;
+                } else {
+                    fprintf(stderr, "Invalid emission mode '%s' (expected batch or event)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+                g_delta_suppression = 0;
+                break;
+            case 't':
+                g_event_thread_enabled = 1;
+                break;
+            case 'p':
+                g_config.priority = atoi(optarg);
+                if (g_config.priority < sched_get_priority_min(SCHED_FIFO) ||
+                    g_config.priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Invalid event thread priority '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_event_thread_enabled = 1;
+                break;
+            case 'c':
+                g_event_thread_cpu = atoi(optarg);
+                if (g_event_thread_cpu < 0 || g_event_thread_cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_event_thread_enabled = 1;
+                break;
+            case 'l':
+                g_latency_enabled = 1;
+                break;
+            case 'S':
+                g_stats_path = optarg;
+                break;
+            case 'b':
+                g_transfer_packets = atoi(optarg);
+                if (g_transfer_packets < 1 || g_transfer_packets > AM_TRANSFER_PACKETS_MAX) {
+                    fprintf(stderr, "Invalid packets per transfer '%s' (expected 1-%d)\n", optarg,
+                            AM_TRANSFER_PACKETS_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                g_coalesce_hover = 1;
+                break;
+            case 'I': {
+                int n = sscanf(optarg, "%d,%d", &g_idle_samples, &g_idle_poll_ms);
+                if (n < 1 || g_idle_samples < 1 || g_idle_samples > 100000 ||
+                    g_idle_poll_ms < 0 || g_idle_poll_ms > 1000) {
+                    fprintf(stderr, "Invalid idle policy '%s' (expected N[,MS] with N 1-100000, MS 0-1000)\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'i':
+                isolate_user = optarg;
+                break;
+            case 'P':
+                g_scan_enabled = 1;
+                break;
+            case 'g':
+                g_grace_ms = atoi(optarg);
+                if (g_grace_ms < 0 || g_grace_ms > 3600000) {
+                    fprintf(stderr, "Invalid grace window '%s' (expected 0-3600000 ms)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                capture_path = optarg;
+                break;
+            case 'R':
+                replay_path = optarg;
+                break;
+            case 'T':
+                g_replay_realtime = 1;
+                break;
+            case 'N':
+                g_replay_discard = 1;
+                break;
+            case 'f':
+                g_config.filter_enabled = 1;
+                break;
+            case 'F':
+                if (parse_int(optarg, 0, 50000, &g_config.predict_us) < 0) {
+                    fprintf(stderr, "Invalid prediction horizon '%s' (expected 0-50000 us)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_config.filter_enabled = 1;
+                break;
+            case 'C':
+                if (parse_curve(optarg, &g_config.mapping) < 0) {
+                    fprintf(stderr, "Invalid pressure curve '%s' (expected x1,y1,x2,y2 in 0-100)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_config.mapping_enabled = 1;
+                break;
+            case 'A':
+                if (parse_area(optarg, &g_config.mapping) < 0) {
+                    fprintf(stderr, "Invalid active area '%s' (expected x0,y0,x1,y1)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_config.mapping_enabled = 1;
+                break;
+            case 'O':
+                if (parse_orientation(optarg, &g_config.mapping.rotation) < 0) {
+                    fprintf(stderr, "Invalid orientation '%s' (expected none, cw, ccw or half)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                g_config.mapping_enabled = 1;
+                break;
+            case 'k':
+                g_config_path = optarg;
+                break;
+            case 'm':
+                g_shm_name = optarg;
+                break;
+            case 'v':
+                if (g_log_level < LOG_LEVEL_TRACE) g_log_level++;
+                break;
+            case 'q':
+                if (g_log_level > LOG_LEVEL_ERROR) g_log_level--;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // The file overrides the options, a reload starts again from them
+    g_config_options = g_config;
+    if (g_config_path && config_load(g_config_path, &g_config) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Replay does not touch USB at all
+    if (replay_path) {
+        // Setup signal handlers for graceful shutdown (SIGINT, SIGTERM)
+        // and the statistics dump (SIGUSR1)
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = sigterm_handler;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        action.sa_handler = sigusr1_handler;
+        sigaction(SIGUSR1, &action, NULL);
+        DEBUG("Signal handlers registered.");
+
+        if (g_shm_name && shm_ring_open(g_shm_name) < 0) {
+            return EXIT_FAILURE;
+        }
+        rc = replay_capture(replay_path);
+        shm_ring_close();
+        return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // SIGINT/SIGTERM/SIGUSR1/SIGHUP (and SIGCHLD of the worker) are read
+    // from the main loop's signalfd, so they are blocked before any thread
+    // or the worker is started and inherit the mask. A stats client that
+    // hangs up early must not kill the daemon with SIGPIPE.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    if (isolate_user) sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The worker inherits the shared memory ring, it publishes the pen states
+    if (isolate_user) {
+        if (g_shm_name && shm_ring_open(g_shm_name) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (ipc_start(isolate_user, &signals) < 0) {
+            shm_ring_close();
+            return EXIT_FAILURE;
+        }
+    }
 
     // Initialize libusb
     rc = libusb_init(NULL);
@@ -834,91 +3033,173 @@ int main() {
     }
     DEBUG("libusb initialized.");
 
-    // Setup signal handler for graceful shutdown (SIGINT, SIGTERM)
-    struct sigaction action;
-    memset(&action, 0, sizeof(action));
-    action.sa_handler = sigterm_handler;
-    sigaction(SIGINT, &action, NULL);
-    sigaction(SIGTERM, &action, NULL);
-    DEBUG("Signal handlers registered.");
-
-    // Check for hotplug capability
-    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
-        fprintf(stderr, "Error: libusb hotplug not supported on this system.\n");
-        // Optional: Implement manual device scanning loop here if hotplug isn't available
+    if (capture_path && capture_open(capture_path) < 0) {
         libusb_exit(NULL);
         return EXIT_FAILURE;
     }
-    DEBUG("libusb hotplug capability detected.");
-
-    // Register hotplug callback
-    libusb_hotplug_callback_handle callback_handle;
-    rc = libusb_hotplug_register_callback(
-        NULL, // Context (NULL for default)
-        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
-        LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
-        LIBUSB_HOTPLUG_ENUMERATE, // Enumerate existing devices on startup
-        VENDOR_ID_HANVON,         // Filter by Vendor ID
-        LIBUSB_HOTPLUG_MATCH_ANY, // Match any Product ID (find_device will filter further)
-        LIBUSB_HOTPLUG_MATCH_ANY, // Match any Device Class
-        hotplug_callback,         // The callback function
-        NULL,                     // User data (could pass device list pointer here for multi-device)
-        &callback_handle          // Handle for deregistration
-    );
-    if (rc != LIBUSB_SUCCESS) {
-        fprintf(stderr, "Error registering hotplug callback: %s\n", libusb_error_name(rc));
+
+    if (g_stats_path) {
+        g_stats_fd = open_stats_socket(g_stats_path);
+        if (g_stats_fd < 0) {
+            libusb_exit(NULL);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Containers and some embedded hosts have no hotplug, the bus is polled there
+    if (!g_scan_enabled && !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        INFO("libusb hotplug not supported on this system, polling for devices instead.");
+        g_scan_enabled = 1;
+    }
+    if (g_scan_enabled) {
+        g_scan_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_scan_tfd < 0) {
+            fprintf(stderr, "Error creating enumeration timer: %s\n", strerror(errno));
+            libusb_exit(NULL);
+            return EXIT_FAILURE;
+        }
+    } else {
+        DEBUG("libusb hotplug capability detected.");
+    }
+
+    // Start the event thread before registering the hotplug callback, so the
+    // devices enumerated at registration are queued like later arrivals.
+    if (g_event_thread_enabled) {
+        g_hotplug_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (g_hotplug_efd < 0) {
+            fprintf(stderr, "Error creating hotplug eventfd: %s\n", strerror(errno));
+            libusb_exit(NULL);
+            return EXIT_FAILURE;
+        }
+        rc = start_event_thread(&g_event_thread);
+        if (rc < 0) {
+            close(g_hotplug_efd);
+            libusb_exit(NULL);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (g_idle_samples && g_idle_poll_ms) {
+        g_idle_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_idle_tfd < 0) {
+            fprintf(stderr, "Warning: no idle poll timer (%s), idle tablets keep full polling\n",
+                    strerror(errno));
+            g_idle_poll_ms = 0;
+        }
+    }
+
+    // The ring must exist before the first transfer can complete, and the
+    // loop must follow libusb's fds before enumeration opens the tablets
+    if ((g_shm_name && !g_shm_ring && shm_ring_open(g_shm_name) < 0) || loop_open(&signals) < 0) {
+        shm_ring_close();
+        if (g_event_thread_enabled) {
+            stop_event_thread(g_event_thread);
+            close(g_hotplug_efd);
+        }
         libusb_exit(NULL);
         return EXIT_FAILURE;
     }
-    DEBUG("Hotplug callback registered. Waiting for events...");
 
-    // Event handling loop
-    while (g_running) {
-        // Use blocking wait with timeout for events
-        // Timeout allows checking g_running flag periodically
-        struct timeval tv = {1, 0}; // 1 second timeout
-        rc = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
-        if (rc < 0) {
-            if (rc == LIBUSB_ERROR_INTERRUPTED) {
-                // Interrupted by signal (likely SIGINT/SIGTERM), loop condition will handle exit
-                DEBUG("libusb event handling interrupted.");
-                continue;
+    // Register hotplug callback, or run the first scan as soon as the loop starts
+    libusb_hotplug_callback_handle callback_handle = 0;
+    if (g_scan_enabled) {
+        scan_timer_set(1);
+        DEBUG("Polling for devices...");
+    } else {
+        rc = libusb_hotplug_register_callback(
+            NULL, // Context (NULL for default)
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, // Enumerate existing devices on startup
+            VENDOR_ID_HANVON,         // Filter by Vendor ID
+            LIBUSB_HOTPLUG_MATCH_ANY, // Match any Product ID (find_device will filter further)
+            LIBUSB_HOTPLUG_MATCH_ANY, // Match any Device Class
+            hotplug_callback,         // The callback function
+            NULL,                     // User data (devices are tracked in g_devices)
+            &callback_handle          // Handle for deregistration
+        );
+        if (rc != LIBUSB_SUCCESS) {
+            fprintf(stderr, "Error registering hotplug callback: %s\n", libusb_error_name(rc));
+            loop_close();
+            shm_ring_close();
+            if (g_event_thread_enabled) {
+                stop_event_thread(g_event_thread);
+                close(g_hotplug_efd);
             }
-            // Other errors
-            fprintf(stderr, "Error during libusb event handling: %s\n", libusb_error_name(rc));
-            // Decide if this is fatal or recoverable
-            // If fatal, maybe set g_running = 0;
+            libusb_exit(NULL);
+            return EXIT_FAILURE;
         }
-        // Loop continues if g_running is still 1
+        DEBUG("Hotplug callback registered. Waiting for events...");
     }
 
+    loop_run();
+
     DEBUG("Exiting event loop.");
 
     // --- Cleanup before exiting ---
 
     // Deregister hotplug callback
-    libusb_hotplug_deregister_callback(NULL, callback_handle);
-    DEBUG("Hotplug callback deregistered.");
-
-    // Final cleanup for the active device if the loop was terminated
-    // while a device was still active (similar logic as DEVICE_LEFT event)
-    if (g_dev_handle != NULL) {
-         DEBUG("Cleaning up active device before exit...");
-         if (g_tx) {
-             libusb_cancel_transfer(g_tx);
-             // Note: Might need a short wait or event handle loop here
-             // to ensure cancellation completes before freeing.
-             // However, libusb_exit should handle pending cancellations.
-             libusb_free_transfer(g_tx); g_tx = NULL;
-         }
-         if (g_uidev) {
-             libevdev_uinput_destroy(g_uidev); g_uidev = NULL; g_evdev = NULL;
-         }
-         // Interface release and kernel driver attach are best-effort on exit
-         libusb_release_interface(g_dev_handle, 0);
-         libusb_attach_kernel_driver(g_dev_handle, 0);
-         libusb_close(g_dev_handle); g_dev_handle = NULL;
-         DEBUG("Active device cleanup complete.");
+    if (!g_scan_enabled) {
+        libusb_hotplug_deregister_callback(NULL, callback_handle);
+        DEBUG("Hotplug callback deregistered.");
+    }
+
+    if (g_event_thread_enabled) {
+        stop_event_thread(g_event_thread);
+        // Drop hotplug work that was queued but never processed
+        pthread_mutex_lock(&g_hotplug_lock);
+        while (g_hotplug_head) {
+            struct hotplug_work *work = g_hotplug_head;
+            g_hotplug_head = work->next;
+            libusb_unref_device(work->dev);
+            free(work);
+        }
+        g_hotplug_tail = NULL;
+        pthread_mutex_unlock(&g_hotplug_lock);
+        close(g_hotplug_efd);
+        g_hotplug_efd = -1;
+    }
+
+    // Final cleanup for the devices still attached when the loop was terminated
+    // (same logic as the DEVICE_LEFT event). The event thread is gone, so
+    // the cancelled callbacks are collected here.
+    while (g_devices != NULL) {
+        DEBUG("Cleaning up device %04x:%04x before exit...", VENDOR_ID_HANVON, g_devices->product_id);
+        device_detach(g_devices);
+    }
+    uint64_t deadline = monotonic_ns() + (uint64_t)TEARDOWN_TIMEOUT_MS * 1000000;
+    devices_reap();
+    while (g_closing && monotonic_ns() < deadline) {
+        struct timeval tv = {0, 100000};
+        int rc = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            ERROR("Error during libusb event handling: %s", libusb_error_name(rc));
+            break;
+        }
+        devices_reap();
+    }
+    if (g_closing) {
+        // Freeing them now could let libusb write into freed memory
+        WARN("Transfers still pending after %d ms, leaving their devices open.", TEARDOWN_TIMEOUT_MS);
+    }
+    parked_expire(UINT64_MAX);
+    ipc_stop();
+
+    if (g_stats_fd >= 0) {
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+            if (g_control[i].fd >= 0) control_close(&g_control[i]);
+        }
+    }
+    loop_close();
+    if (g_idle_tfd >= 0) close(g_idle_tfd);
+    if (g_scan_tfd >= 0) close(g_scan_tfd);
+    if (g_stats_fd >= 0) {
+        close(g_stats_fd);
+        unlink(g_stats_path);
+    }
+    shm_ring_close();
+    if (g_capture) {
+        fclose(g_capture);
     }
 
     // Exit libusb
@@ -928,3 +3209,4 @@ int main() {
     printf("Hanvon userspace driver finished.\n");
     return EXIT_SUCCESS;
 }
+#endif // HANVON_NO_MAIN
@@ -0,0 +1,52 @@
+/*
+* =====================================================================================
+*
+*       Filename:  hanvon-profiles.h
+*
+*    Description:  Supported models, shared by libhanvon and the kernel driver
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#ifndef HANVON_PROFILES_H
+#define HANVON_PROFILES_H
+
+// Plain macros only, so hanvon.c can include this in kernel space. Each user
+// defines its own HANVON_PROFILE and expands HANVON_PROFILES(HANVON_PROFILE)
+// into whatever it needs: libhanvon its profile table and the PRODUCT_ID_*
+// constants, the kernel driver its model table and USB id table. A model
+// added here is supported by both.
+
+// Axis ranges of the protocol families
+#define AM_MAX_ABS_X            0x27DE
+#define AM_MAX_ABS_Y            0x1CFE
+#define AM_MAX_TILT_X           0x3F // Check if signed or unsigned
+#define AM_MAX_TILT_Y           0x7F // Check if signed or unsigned
+#define APPIV_MAX_ABS_X         0x5750
+#define APPIV_MAX_ABS_Y         0x3692 // Kernel driver uses this, not 0x5750
+
+// HANVON_PROFILE(model, product_id, name, family, max_x, max_y, pad)
+//   family  packet layout: am (ArtMaster, the original handle_default),
+//           gp0504, gp0906 or appiv
+//   pad     pad buttons: left4 (BTN_0-BTN_3), left4_right4 (BTN_0-BTN_7,
+//           two strips) or appiv (BTN_0 on the pen, BTN_1-BTN_7 on the tablet)
+#define HANVON_PROFILES(HANVON_PROFILE) \
+    HANVON_PROFILE(NXS1513,   0x8030, "Hanvon Nilox NXS1513",             am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(GP0504,    0x8037, "Hanvon Graphicpal 0504",           gp0504, AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(GP0806,    0x8039, "Hanvon Graphicpal 0806",           am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(GP0605A,   0x803a, "Hanvon Graphicpal 0605A",          am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(AM1209,    0x8501, "Hanvon ArtMaster AM1209",          am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4_right4) \
+    HANVON_PROFILE(AM0806,    0x8502, "Hanvon ArtMaster AM0806",          am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(AM0605,    0x8503, "Hanvon ArtMaster AM0605",          am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(AM1107,    0x8505, "Hanvon Art Master AM1107",         am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4_right4) \
+    HANVON_PROFILE(GP0806B,   0x8511, "Hanvon Graphicpal 0806B",          am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(GP0605,    0x8512, "Hanvon Graphicpal 0605",           am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(RL0504,    0x851d, "Hanvon Rollick 0504",              am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(RL0604,    0x851f, "Hanvon Rollick 0604",              am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(GP0906,    0x8521, "Hanvon Graphicpal 0906",           gp0906, AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(AM3M,      0x8528, "Hanvon Art Master III",            am,     AM_MAX_ABS_X,    AM_MAX_ABS_Y,    left4)        \
+    HANVON_PROFILE(APPIV0906, 0x8532, "Hanvon Art Painter Pro APPIV0906", appiv,  APPIV_MAX_ABS_X, APPIV_MAX_ABS_Y, appiv)
+
+#endif // HANVON_PROFILES_H
@@ -0,0 +1,115 @@
+/*
+* =====================================================================================
+*
+*       Filename:  hanvon-shm.h
+*
+*    Description:  Layout of the shared memory pen state ring (hvlusb -m)
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#ifndef HANVON_SHM_H
+#define HANVON_SHM_H
+
+// hvlusb publishes every decoded pen state of every tablet into one ring of
+// fixed size samples in POSIX shared memory (/dev/shm/<name>). There is a
+// single writer that never waits for readers: a reader that falls more than
+// HANVON_SHM_SLOTS samples behind loses the oldest ones and is told so. Each
+// slot is guarded by its own sequence counter (a seqlock), so readers need no
+// write access to the mapping and cannot disturb the writer or each other.
+//
+// Reader sketch (the object may be opened before hvlusb has sized it, wait
+// until fstat reports at least sizeof(struct hanvon_shm_ring) and for magic):
+//     int fd = shm_open("/hvlusb", O_RDONLY, 0);
+//     const struct hanvon_shm_ring *ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+//     uint64_t tail = hanvon_shm_head(ring);
+//     struct hanvon_shm_sample s;
+//     while (hanvon_shm_read(ring, &tail, &s) > 0) ...
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HANVON_SHM_MAGIC    0x31534856u // "HVS1"
+#define HANVON_SHM_VERSION  1
+#define HANVON_SHM_SLOTS    1024        // Power of two
+
+// One decoded pen state
+struct hanvon_shm_sample {
+    uint64_t time_ns;                   // CLOCK_MONOTONIC arrival of the packet
+    uint16_t product_id;                // Tablet model (vendor is always 0x0b57)
+    uint8_t bus, address;               // USB location, tells several tablets apart
+    int32_t x, y;                       // Raw coordinates, 0..profile max
+    int32_t pressure;                   // 0..2^pressure_bits-1
+    int32_t tilt_x, tilt_y;
+    uint16_t tool;                      // BTN_TOOL_PEN or BTN_TOOL_RUBBER
+    uint8_t in_range, touch;
+    uint8_t stylus, stylus2;
+    uint16_t reserved;
+    uint32_t pad;                       // Pad buttons, bit i is the profile's button i
+    int32_t wheel;                      // REL_WHEEL detents of this packet (accelerated)
+};
+
+struct hanvon_shm_slot {
+    _Atomic uint32_t seq;               // Odd while the writer is inside the slot
+    uint32_t reserved;
+    uint64_t index;                     // Sample number stored in the slot
+    struct hanvon_shm_sample sample;
+};
+
+struct hanvon_shm_ring {
+    uint32_t magic;                     // HANVON_SHM_MAGIC
+    uint32_t version;                   // HANVON_SHM_VERSION
+    uint32_t slots;                     // HANVON_SHM_SLOTS
+    uint32_t sample_size;               // sizeof(struct hanvon_shm_sample)
+    _Alignas(64) _Atomic uint64_t head; // Number of samples published so far
+    _Alignas(64) struct hanvon_shm_slot slot[HANVON_SHM_SLOTS];
+};
+
+// Writer side, single thread only
+static inline void hanvon_shm_write(struct hanvon_shm_ring *ring, const struct hanvon_shm_sample *sample) {
+    uint64_t index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct hanvon_shm_slot *slot = &ring->slot[index & (HANVON_SHM_SLOTS - 1)];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->index = index;
+    slot->sample = *sample;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, index + 1, memory_order_release);
+}
+
+static inline uint64_t hanvon_shm_head(const struct hanvon_shm_ring *ring) {
+    return atomic_load_explicit(&((struct hanvon_shm_ring *)ring)->head, memory_order_acquire);
+}
+
+// Reads the sample number *tail. Returns 1 and advances *tail when a sample
+// was copied, 0 when the reader is up to date, or -1 when samples were lost
+// (*tail is moved to the oldest sample still available).
+static inline int hanvon_shm_read(const struct hanvon_shm_ring *ring, uint64_t *tail,
+                                  struct hanvon_shm_sample *out) {
+    struct hanvon_shm_ring *r = (struct hanvon_shm_ring *)ring;
+    uint64_t head = hanvon_shm_head(ring);
+
+    if (*tail >= head) return 0;
+    if (head - *tail > HANVON_SHM_SLOTS - 1) {
+        *tail = head - (HANVON_SHM_SLOTS - 1);
+        return -1;
+    }
+    struct hanvon_shm_slot *slot = &r->slot[*tail & (HANVON_SHM_SLOTS - 1)];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    uint64_t index = slot->index;
+    *out = slot->sample;
+    atomic_thread_fence(memory_order_acquire);
+    if ((seq & 1) || seq != atomic_load_explicit(&slot->seq, memory_order_relaxed) || index != *tail) {
+        // Overwritten while copying: the writer lapped this reader
+        *tail = hanvon_shm_head(ring) - (HANVON_SHM_SLOTS - 1);
+        return -1;
+    }
+    (*tail)++;
+    return 1;
+}
+
+#endif // HANVON_SHM_H
@@ -2,10 +2,12 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/math64.h>
 #include <linux/usb/input.h>
-#include <asm/unaligned.h>
 
-#define DRIVER_VERSION "0.6"
+#include "hanvon-profiles.h"
+
+#define DRIVER_VERSION "0.7"
 #define DRIVER_AUTHOR "Ondra Havel <ondra.havel@gmail.com>"
 #define DRIVER_DESC "USB Hanvon tablet driver"
 #define DRIVER_LICENSE "GPL"
@@ -15,211 +17,326 @@ MODULE_DESCRIPTION(DRIVER_DESC);
 MODULE_LICENSE(DRIVER_LICENSE);
 
 #define USB_VENDOR_ID_HANVON	0x0b57
-#define USB_PRODUCT_ID_AM3M		0x8528
-#define USB_PRODUCT_ID_AM0806	0x8502
-#define USB_PRODUCT_ID_AM0605	0x8503
-#define USB_PRODUCT_ID_AM1107	0x8505
-#define USB_PRODUCT_ID_AM1209	0x8501
-#define USB_PRODUCT_ID_RL0604	0x851f
-#define USB_PRODUCT_ID_RL0504	0x851d
-#define USB_PRODUCT_ID_GP0806	0x8039
-#define USB_PRODUCT_ID_GP0806B	0x8511
-#define USB_PRODUCT_ID_GP0605	0x8512
-#define USB_PRODUCT_ID_GP0605A	0x803a
-#define USB_PRODUCT_ID_GP0504	0x8037
-#define USB_PRODUCT_ID_NXS1513	0x8030
-#define USB_PRODUCT_ID_GP0906	0x8521
-#define USB_PRODUCT_ID_APPIV0906	0x8532
-
-#define USB_AM_PACKET_LEN   10
-
-static int lbuttons[]={BTN_0,BTN_1,BTN_2,BTN_3};   /* reported on all AMs */
-static int rbuttons[]={BTN_4,BTN_5,BTN_6,BTN_7};   /* reported on AM1107+ */
-
-#define AM_WHEEL_THRESHOLD   4
-
-#define AM_MAX_TILT_X   0x3f
-#define AM_MAX_TILT_Y   0x7f
-#define AM_MAX_PRESSURE   0x400
+
+#define USB_AM_PACKET_LEN	10	/* report length of the original driver */
+#define USB_MAX_PACKET_LEN	64	/* largest full speed interrupt packet */
+#define AM_PEN_REPORT_LEN	9	/* PEN_EVENT bytes the AM/GP handlers read */
+
+#define BUTTON_EVENT_GP		0x01
+#define PEN_EVENT		0x02
+#define BUTTON_EVENT_0906	0x0c
+
+#define AM_WHEEL_THRESHOLD	4
+#define HANVON_WHEEL_HI_RES	120	/* REL_WHEEL_HI_RES units per REL_WHEEL detent */
+
+#define AM_MAX_PRESSURE		0x3ff	/* top 10 bits of the 16 bit pressure field */
+
+/*
+ * Coordinates are reported over 0..0xffff for every model. x * 0xffff / max
+ * is computed as (x * scale) >> 32 with scale rounded up at compile time,
+ * which is exact for every x below 2^16 and keeps the division out of the
+ * interrupt path.
+ */
+#define HANVON_ABS_MAX		0xffff
+#define HANVON_SCALE(max)	((((u64)HANVON_ABS_MAX << 32) + (max) - 1) / (max))
+
+/* Pad buttons of each layout, bit i of hanvon->pad is buttons[i] */
+static const int pad_left4[] = { BTN_0, BTN_1, BTN_2, BTN_3 };
+static const int pad_left4_right4[] = { BTN_0, BTN_1, BTN_2, BTN_3, BTN_4, BTN_5, BTN_6, BTN_7 };
+static const int pad_appiv[] = { BTN_0, BTN_1, BTN_2, BTN_3, BTN_4, BTN_5, BTN_6, BTN_7 };
+
+/* Pen and pad state, as decoded by the family handlers (libhanvon's hanvon_pen_state) */
+struct hanvon_pen {
+	int x, y, pressure, tilt_x, tilt_y;
+	int tool;			/* BTN_TOOL_PEN or BTN_TOOL_RUBBER */
+	bool in_range, touch, stylus, stylus2;
+	unsigned int pad;
+	int strip[2];			/* strip position of this report per pad side, -1 = none */
+};
+
+struct hanvon;
+
+struct hanvon_model {
+	const char *name;
+	void (*handle)(struct hanvon *hanvon, const unsigned char *data, int len);
+	const int *buttons;
+	int num_buttons;
+	int max_x, max_y;
+	u64 scale_x, scale_y;
+};
 
 struct hanvon {
 	unsigned char *data;
 	dma_addr_t data_dma;
+	int data_len;
 	struct input_dev *dev;
 	struct usb_device *usbdev;
 	struct urb *irq;
-	int old_wheel_pos;
+	const struct hanvon_model *model;
+	struct hanvon_pen pen;
+	int old_wheel_pos[2];
 	char phys[32];
 };
 
-static void report_buttons(struct hanvon *hanvon, int buttons[], unsigned char dta)
+static inline int be16(const unsigned char *p)
 {
-	struct input_dev *dev = hanvon->dev;
-
-	if((dta & 0xf0) == 0xa0) {
-		input_report_key(dev, buttons[1], dta & 0x02);
-		input_report_key(dev, buttons[2], dta & 0x04);
-		input_report_key(dev, buttons[3], dta & 0x08);
-	} else {
-		if(dta <= 0x3f) {   /* slider area active */
-			int diff = dta - hanvon->old_wheel_pos;
-			if(abs(diff) < AM_WHEEL_THRESHOLD)
-				input_report_rel(dev, REL_WHEEL, diff);
-
-			hanvon->old_wheel_pos = dta;
-		}
-	}
+	return (p[0] << 8) | p[1];
 }
 
-static inline void handle_default(struct hanvon *hanvon)
+static inline int le16(const unsigned char *p)
 {
-	unsigned char *data = hanvon->data;
-	struct input_dev *dev = hanvon->dev;
-
-#define AM_MAX_ABS_X   0x27de
-#define AM_MAX_ABS_Y   0x1cfe
+	return p[0] | (p[1] << 8);
+}
 
-	switch(data[0]) {
-		case 0x01:   /* button press */
-			if(data[1]==0x55)   /* left side */
-				report_buttons(hanvon, lbuttons,data[2]);
+/* AM/GP pad byte (data[2] or data[4]) of the side starting at pad bit base */
+static void report_buttons(struct hanvon *hanvon, int base, unsigned char dta)
+{
+	struct hanvon_pen *pen = &hanvon->pen;
 
-			if(data[3]==0xaa)   /* right side (am1107, am1209) */
-				report_buttons(hanvon, rbuttons,data[4]);
-			break;
+	if ((dta & 0xf0) == 0xa0) {
+		/* buttons 1-3 of the side, button 0 is not reported here */
+		unsigned int mask = 0x0eu << base;
 
-		case 0x02:   /* position change */
-			if((data[1] & 0xf0) != 0) {
-				input_report_abs(dev, ABS_X, get_unaligned_be16(&data[2]) * 0xffff / AM_MAX_ABS_X);
-				input_report_abs(dev, ABS_Y, get_unaligned_be16(&data[4]) * 0xffff / AM_MAX_ABS_Y);
-				input_report_abs(dev, ABS_TILT_X, data[7] & 0x3f);
-				input_report_abs(dev, ABS_TILT_Y, data[8]);
-				input_report_abs(dev, ABS_PRESSURE, get_unaligned_be16(&data[6])>>6);
-			}
-
-			input_report_key(dev, BTN_LEFT, data[1] & 0x01); /* pen touches the surface */
-			input_report_key(dev, BTN_RIGHT, data[1] & 0x02); /* stylus button pressed (right click) */
-			input_report_key(dev, lbuttons[0], data[1] & 0x20);	/* 'eraser' button */
-			break;
+		pen->pad = (pen->pad & ~mask) | ((dta & 0x0e) << base);
+	} else if (dta <= 0x3f) {	/* slider area active */
+		pen->strip[base ? 1 : 0] = dta;
 	}
 }
 
-static inline void handle_gp0504(struct hanvon *hanvon)
+static void handle_gp_buttons(struct hanvon *hanvon, const unsigned char *data, int len)
 {
-	unsigned char *data = hanvon->data;
-	struct input_dev *dev = hanvon->dev;
-
-#define AM_MAX_ABS_X   0x27de
-#define AM_MAX_ABS_Y   0x1cfe
+	if (len < 5)
+		return;
+	if (data[1] == 0x55)	/* left side */
+		report_buttons(hanvon, 0, data[2]);
+	if (data[3] == 0xaa)	/* right side (am1107, am1209) */
+		report_buttons(hanvon, 4, data[4]);
+}
 
-	switch(data[0]) {
-		case 0x01:   /* button press */
-			if(data[1]==0x55)   /* left side */
-				report_buttons(hanvon, lbuttons,data[2]);
+/*
+ * PEN_EVENT of the ArtMaster layout. data[1]: 0xf0 in proximity, 0x20 eraser,
+ * 0x02 side button, 0x01 touch. Pressure is the top 10 bits of data[6..7],
+ * tilt X the low 6 bits of data[7] and tilt Y data[8].
+ */
+static void handle_am_pen(struct hanvon *hanvon, const unsigned char *data)
+{
+	struct hanvon_pen *pen = &hanvon->pen;
+
+	pen->in_range = (data[1] & 0xf0) != 0;
+	if (pen->in_range) {
+		pen->x = be16(&data[2]);
+		pen->y = be16(&data[4]);
+		pen->pressure = be16(&data[6]) >> 6;
+		pen->tilt_x = data[7] & 0x3f;
+		pen->tilt_y = data[8];
+		pen->tool = (data[1] & 0x20) ? BTN_TOOL_RUBBER : BTN_TOOL_PEN;
+	}
+	pen->stylus = data[1] & 0x02;
+}
 
-			if(data[3]==0xaa)   /* right side (am1107, am1209) */
-				report_buttons(hanvon, rbuttons,data[4]);
+static void handle_am(struct hanvon *hanvon, const unsigned char *data, int len)
+{
+	switch (data[0]) {
+	case BUTTON_EVENT_GP:
+		handle_gp_buttons(hanvon, data, len);
+		break;
+	case PEN_EVENT:
+		if (len < AM_PEN_REPORT_LEN)
 			break;
+		handle_am_pen(hanvon, data);
+		hanvon->pen.touch = data[1] & 0x01;
+		break;
+	}
+}
 
-		case 0x02:   /* position change */
-            /*printk(KERN_INFO "Hanvon Test : 1x%04x 2x%04x 4x%04x 6x%04x 7x%04x 8x%04x\n\t\tClicked : %s %i/%04x\n", data[1], data[2], data[4], data[6], data[7], data[8], data[6] > 63 ? "true" : "false", data[6], get_unaligned_be16(&data[6]));*/
-
-			if((data[1] & 0xf0) != 0) {
-				input_report_abs(dev, ABS_X, get_unaligned_be16(&data[2]) * 0xffff / AM_MAX_ABS_X);
-				input_report_abs(dev, ABS_Y, get_unaligned_be16(&data[4]) * 0xffff / AM_MAX_ABS_Y);
-				input_report_abs(dev, ABS_TILT_X, data[7] & 0x3f);
-				input_report_abs(dev, ABS_TILT_Y, data[8]);
-				input_report_abs(dev, ABS_PRESSURE, get_unaligned_be16(&data[6])>>6);
-			}
-
-            /*printk(KERN_INFO "Hanvon Test : %i\n", data[6]);*/
-			input_report_key(dev, BTN_LEFT, data[6] > 68); /* pen touches the surface */
-			input_report_key(dev, BTN_RIGHT, data[1] & 0x02); /* stylus button pressed (right click) */
-			input_report_key(dev, lbuttons[0], data[1] & 0x20);	/* 'eraser' button */
+/* AM layout, but the touch flag is unreliable: contact is read from the pressure */
+static void handle_gp0504(struct hanvon *hanvon, const unsigned char *data, int len)
+{
+	switch (data[0]) {
+	case BUTTON_EVENT_GP:
+		handle_gp_buttons(hanvon, data, len);
+		break;
+	case PEN_EVENT:
+		if (len < AM_PEN_REPORT_LEN)
 			break;
+		handle_am_pen(hanvon, data);
+		hanvon->pen.touch = data[6] > 68;
+		break;
 	}
 }
 
-static inline void handle_gp0906(struct hanvon *hanvon)
-{
-	unsigned char *data = hanvon->data;
-	struct input_dev *dev = hanvon->dev;
 /*
-hanvon graphic pal 3, gp0906!
-
-- data definition. this is not official...
-[header, 1Byte][event type, 1Byte][x, 2Bytes][y, 2Bytes][pressure, 2Bytes][tilt, 2Bytes]
-*/
-
-	switch( data[0] ) {
-		case 0x02:	/* pen event */
-			if( ( data[1] & 0xe0) == 0xe0 ) {
-				if( data[1] & 0x01 )	/* pressure change */
-					input_report_abs(dev, ABS_PRESSURE, get_unaligned_be16(&data[6])>>6);
-				
-				if( data[1] & 0x04 )
-					input_report_key(dev, BTN_RIGHT, data[1] & 0x2);		/* stylus button pressed (right click)  */
-				
-				input_report_abs(dev, ABS_X, get_unaligned_be16(&data[2]) * 0xffff / AM_MAX_ABS_X);
-				input_report_abs(dev, ABS_Y, get_unaligned_be16(&data[4]) * 0xffff / AM_MAX_ABS_Y);
-
-				input_report_key(dev, lbuttons[0], data[6]);
-			} else {
-				if( data[1] == 0xc2)	/* pen enters */
-				{}
-				
-				if( data[1] == 0x80)	/* pen leaves */
-				{}
-			}
+ * hanvon graphic pal 3, gp0906!
+ * [header, 1Byte][event type, 1Byte][x, 2Bytes][y, 2Bytes][pressure, 2Bytes][tilt, 2Bytes]
+ */
+static void handle_gp0906(struct hanvon *hanvon, const unsigned char *data, int len)
+{
+	struct hanvon_pen *pen = &hanvon->pen;
+
+	switch (data[0]) {
+	case PEN_EVENT:
+		if (len < 8)
 			break;
-	
-	case 0x0c:	/* key press on the tablet */
-		input_report_key(dev, lbuttons[0], data[3] & 0x01);
-		input_report_key(dev, lbuttons[1], data[3] & 0x02);
-		input_report_key(dev, lbuttons[2], data[3] & 0x04);
-		input_report_key(dev, lbuttons[3], data[3] & 0x08);
+		if ((data[1] & 0xe0) == 0xe0) {
+			pen->in_range = true;
+			pen->tool = BTN_TOOL_PEN;
+			pen->x = be16(&data[2]);
+			pen->y = be16(&data[4]);
+			pen->touch = data[1] & 0x01;	/* pressure is only sent while touching */
+			pen->pressure = pen->touch ? be16(&data[6]) >> 6 : 0;
+			if (data[1] & 0x04)
+				pen->stylus = data[1] & 0x02;
+		} else if (data[1] == 0xc2) {	/* pen enters */
+			pen->in_range = true;
+		} else if (data[1] == 0x80) {	/* pen leaves */
+			pen->in_range = false;
+			pen->touch = false;
+			pen->pressure = 0;
+		}
+		break;
+	case BUTTON_EVENT_0906:	/* key press on the tablet */
+		if (len < 4)
+			break;
+		pen->pad = data[3] & 0x0f;
 		break;
 	}
 }
 
-static inline void handle_appiv0906(struct hanvon *hanvon)
+/* The pen button report has little endian coordinates, PEN_EVENT big endian ones */
+static void handle_appiv(struct hanvon *hanvon, const unsigned char *data, int len)
 {
-	unsigned char *data = hanvon->data;
-	struct input_dev *dev = hanvon->dev;
+	struct hanvon_pen *pen = &hanvon->pen;
 
-#define APPIV_XMAX	0x5750
-#define APPIV_YMAX	0x3692
-
-	switch(data[0]) {
-		case 0x01:	/* pen button event */
-			input_report_abs(dev, ABS_X, get_unaligned_le16(&data[2]) * 0xffff / APPIV_XMAX);
-			input_report_abs(dev, ABS_Y, get_unaligned_le16(&data[4]) * 0xffff / APPIV_YMAX);
-			input_report_key(dev, BTN_LEFT, data[1] & 0x01); /* pen touches the surface */
-			input_report_key(dev, BTN_RIGHT, data[1] & 0x02); /* stylus button pressed (right click) */
-			input_report_key(dev, BTN_MIDDLE, data[1] & 0x04); /* stylus button pressed (right click) */
-			input_report_key(dev, BTN_0, data[1] & 0x08); /* stylus button pressed (right click) */
+	switch (data[0]) {
+	case BUTTON_EVENT_GP:	/* pen button event */
+		if (len < 6)
 			break;
+		pen->in_range = true;
+		pen->tool = BTN_TOOL_PEN;
+		pen->x = le16(&data[2]);
+		pen->y = le16(&data[4]);
+		pen->touch = data[1] & 0x01;
+		pen->stylus = data[1] & 0x02;
+		pen->stylus2 = data[1] & 0x04;
+		pen->pad = (pen->pad & ~1u) | ((data[1] >> 3) & 1u);	/* BTN_0 */
+		break;
+	case PEN_EVENT:
+		if (len < 8)
+			break;
+		pen->in_range = true;
+		pen->tool = BTN_TOOL_PEN;
+		pen->x = be16(&data[2]);
+		pen->y = be16(&data[4]);
+		if (data[1] & 1)
+			pen->pressure = be16(&data[6]) >> 6;
+		break;
+	case BUTTON_EVENT_0906:	/* tablet buttons BTN_1-BTN_7 */
+		if (len < 4)
+			break;
+		pen->pad = (pen->pad & 1u) | ((data[3] & 0x7f) << 1);
+		break;
+	}
+}
 
-		case 0x02:	/* pen event */
-			input_report_abs(dev, ABS_X, get_unaligned_be16(&data[2]) * 0xffff / APPIV_XMAX);
-			input_report_abs(dev, ABS_Y, get_unaligned_be16(&data[4]) * 0xffff / APPIV_YMAX);
+/* Model table and USB id table, both generated from hanvon-profiles.h */
+enum {
+#define HANVON_MODEL_INDEX(model, ...) HANVON_MODEL_##model,
+	HANVON_PROFILES(HANVON_MODEL_INDEX)
+#undef HANVON_MODEL_INDEX
+};
 
-			if(data[1] & 1)
-				input_report_abs(dev, ABS_PRESSURE, get_unaligned_be16(&data[6])>>6);
+static const struct hanvon_model hanvon_models[] = {
+#define HANVON_MODEL(model, product_id, name, family, max_x, max_y, pad) \
+	[HANVON_MODEL_##model] = { name, handle_##family, pad_##pad, ARRAY_SIZE(pad_##pad), \
+				   max_x, max_y, HANVON_SCALE(max_x), HANVON_SCALE(max_y) },
+	HANVON_PROFILES(HANVON_MODEL)
+#undef HANVON_MODEL
+};
+
+static const struct usb_device_id hanvon_ids[] = {
+#define HANVON_USB_ID(model, product_id, ...) \
+	{ USB_DEVICE(USB_VENDOR_ID_HANVON, product_id), .driver_info = HANVON_MODEL_##model },
+	HANVON_PROFILES(HANVON_USB_ID)
+#undef HANVON_USB_ID
+	{}
+};
 
+MODULE_DEVICE_TABLE(usb, hanvon_ids);
 
-			break;
+/* Turns the strip positions of this report into wheel motion, as the original driver did */
+static void report_wheel(struct hanvon *hanvon)
+{
+	struct hanvon_pen *pen = &hanvon->pen;
+	int wheel = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int diff;
+
+		if (pen->strip[i] < 0)
+			continue;
+		diff = pen->strip[i] - hanvon->old_wheel_pos[i];
+		if (abs(diff) < AM_WHEEL_THRESHOLD)
+			wheel += diff;
+		hanvon->old_wheel_pos[i] = pen->strip[i];
+		pen->strip[i] = -1;
+	}
+	if (wheel) {
+		input_report_rel(hanvon->dev, REL_WHEEL_HI_RES, wheel * HANVON_WHEEL_HI_RES);
+		input_report_rel(hanvon->dev, REL_WHEEL, wheel);
+	}
+}
 
-		case 0x0c:	/* tablet button event */
-			input_report_key(dev, BTN_1, data[3] & 0x01);
-			input_report_key(dev, BTN_2, data[3] & 0x02);
-			input_report_key(dev, BTN_3, data[3] & 0x04);
-			input_report_key(dev, BTN_4, data[3] & 0x08);
-			input_report_key(dev, BTN_5, data[3] & 0x10);
-			input_report_key(dev, BTN_6, data[3] & 0x20);
-			input_report_key(dev, BTN_7, data[3] & 0x40);
-			break;
+/*
+ * Same events as the userspace driver's hanvon_emit; the input core drops
+ * the ones whose value did not change
+ */
+static void hanvon_report(struct hanvon *hanvon)
+{
+	const struct hanvon_model *model = hanvon->model;
+	const struct hanvon_pen *pen = &hanvon->pen;
+	struct input_dev *dev = hanvon->dev;
+	int i;
+
+	input_report_key(dev, BTN_TOOL_PEN, pen->in_range && pen->tool == BTN_TOOL_PEN);
+	input_report_key(dev, BTN_TOOL_RUBBER, pen->in_range && pen->tool == BTN_TOOL_RUBBER);
+	if (pen->in_range) {
+		input_report_abs(dev, ABS_X, mul_u64_u32_shr(model->scale_x, pen->x, 32));
+		input_report_abs(dev, ABS_Y, mul_u64_u32_shr(model->scale_y, pen->y, 32));
+		input_report_abs(dev, ABS_PRESSURE, pen->pressure);
+		input_report_abs(dev, ABS_TILT_X, pen->tilt_x);
+		input_report_abs(dev, ABS_TILT_Y, pen->tilt_y);
 	}
+	input_report_key(dev, BTN_TOUCH, pen->touch);
+	input_report_key(dev, BTN_STYLUS, pen->stylus);
+	input_report_key(dev, BTN_STYLUS2, pen->stylus2);
+	for (i = 0; i < model->num_buttons; i++)
+		input_report_key(dev, model->buttons[i], (pen->pad >> i) & 1);
+	report_wheel(hanvon);
+	input_sync(dev);
+}
+
+/*
+ * A URB sized from wMaxPacketSize can carry several reports of
+ * USB_AM_PACKET_LEN bytes. Each of them is decoded and reported as its own
+ * frame, like the userspace driver's process_packet does.
+ */
+static void hanvon_process(struct hanvon *hanvon, const unsigned char *data, int len)
+{
+	int i;
+
+	if (len < 2 * USB_AM_PACKET_LEN) {
+		hanvon->model->handle(hanvon, data, len);
+		hanvon_report(hanvon);
+		return;
+	}
+	for (i = 0; i + USB_AM_PACKET_LEN <= len; i += USB_AM_PACKET_LEN) {
+		hanvon->model->handle(hanvon, data + i, USB_AM_PACKET_LEN);
+		hanvon_report(hanvon);
+	}
+	if (len % USB_AM_PACKET_LEN)
+		dev_dbg(&hanvon->usbdev->dev, "%s - dropped %d trailing bytes of a %d byte transfer\n",
+			__func__, len % USB_AM_PACKET_LEN, len);
 }
 
 static void hanvon_irq(struct urb *urb)
@@ -228,67 +345,35 @@ static void hanvon_irq(struct urb *urb)
 	int retval;
 
 	switch (urb->status) {
-		case 0:
-			/* success */
-			switch( hanvon->usbdev->descriptor.idProduct ) {
-				case USB_PRODUCT_ID_GP0906:
-					handle_gp0906(hanvon);
-					break;
-				case USB_PRODUCT_ID_APPIV0906:
-					handle_appiv0906(hanvon);
-					break;
-				case USB_PRODUCT_ID_GP0504:
-				    handle_gp0504(hanvon);
-				    break;
-				default:
-					handle_default(hanvon);
-					break;
-				}
-			break;
-		case -ECONNRESET:
-		case -ENOENT:
-		case -ESHUTDOWN:
-			/* this urb is terminated, clean up */
-			printk("%s - urb shutting down with status: %d", __func__, urb->status);
-			return;
-		default:
-			printk("%s - nonzero urb status received: %d", __func__, urb->status);
-			break;
+	case 0:
+		/* success */
+		if (urb->actual_length > 0)
+			hanvon_process(hanvon, hanvon->data, urb->actual_length);
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* this urb is terminated, clean up */
+		dev_dbg(&hanvon->usbdev->dev, "%s - urb shutting down with status: %d\n", __func__, urb->status);
+		return;
+	default:
+		dev_dbg(&hanvon->usbdev->dev, "%s - nonzero urb status received: %d\n", __func__, urb->status);
+		break;
 	}
 
-	input_sync(hanvon->dev);
-
-	retval = usb_submit_urb (urb, GFP_ATOMIC);
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
 	if (retval)
-		printk("%s - usb_submit_urb failed with result %d", __func__, retval);
+		dev_err(&hanvon->usbdev->dev, "%s - usb_submit_urb failed with result %d\n", __func__, retval);
 }
 
-static struct usb_device_id hanvon_ids[] = {
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_AM3M) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_AM1209) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_AM1107) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_AM0806) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_AM0605) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_RL0604) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_RL0504) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0806) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0806B) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0605) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0605A) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0504) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_NXS1513) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_GP0906) },
-	{ USB_DEVICE(USB_VENDOR_ID_HANVON, USB_PRODUCT_ID_APPIV0906)},
-	{}
-};
-
-MODULE_DEVICE_TABLE(usb, hanvon_ids);
-
 static int hanvon_open(struct input_dev *dev)
 {
 	struct hanvon *hanvon = input_get_drvdata(dev);
 
-	hanvon->old_wheel_pos = -AM_WHEEL_THRESHOLD-1;
+	memset(&hanvon->pen, 0, sizeof(hanvon->pen));
+	hanvon->pen.tool = BTN_TOOL_PEN;
+	hanvon->pen.strip[0] = hanvon->pen.strip[1] = -1;
+	hanvon->old_wheel_pos[0] = hanvon->old_wheel_pos[1] = -AM_WHEEL_THRESHOLD - 1;
 	hanvon->irq->dev = hanvon->usbdev;
 	if (usb_submit_urb(hanvon->irq, GFP_KERNEL))
 		return -EIO;
@@ -307,16 +392,28 @@ static int hanvon_probe(struct usb_interface *intf, const struct usb_device_id *
 {
 	struct usb_device *dev = interface_to_usbdev(intf);
 	struct usb_endpoint_descriptor *endpoint;
+	const struct hanvon_model *model = &hanvon_models[id->driver_info];
 	struct hanvon *hanvon;
 	struct input_dev *input_dev;
-	int error = -ENOMEM, i;
+	int error, i;
 
+	/* the original driver took endpoint 0 on trust */
+	error = usb_find_int_in_endpoint(intf->cur_altsetting, &endpoint);
+	if (error)
+		return error;
+
+	error = -ENOMEM;
 	hanvon = kzalloc(sizeof(struct hanvon), GFP_KERNEL);
 	input_dev = input_allocate_device();
 	if (!hanvon || !input_dev)
 		goto fail1;
 
-	hanvon->data = (unsigned char *)usb_alloc_coherent(dev, USB_AM_PACKET_LEN, GFP_KERNEL, &hanvon->data_dma);
+	hanvon->model = model;
+	hanvon->data_len = usb_endpoint_maxp(endpoint);
+	if (hanvon->data_len <= 0 || hanvon->data_len > USB_MAX_PACKET_LEN)
+		hanvon->data_len = USB_AM_PACKET_LEN;
+
+	hanvon->data = (unsigned char *)usb_alloc_coherent(dev, hanvon->data_len, GFP_KERNEL, &hanvon->data_dma);
 	if (!hanvon->data)
 		goto fail1;
 
@@ -330,7 +427,7 @@ static int hanvon_probe(struct usb_interface *intf, const struct usb_device_id *
 	usb_make_path(dev, hanvon->phys, sizeof(hanvon->phys));
 	strlcat(hanvon->phys, "/input0", sizeof(hanvon->phys));
 
-	input_dev->name = "Hanvon tablet";
+	input_dev->name = model->name;
 	input_dev->phys = hanvon->phys;
 	usb_to_input_id(dev, &input_dev->id);
 	input_dev->dev.parent = &intf->dev;
@@ -340,26 +437,27 @@ static int hanvon_probe(struct usb_interface *intf, const struct usb_device_id *
 	input_dev->open = hanvon_open;
 	input_dev->close = hanvon_close;
 
-	input_dev->evbit[0] |= BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS) | BIT_MASK(EV_REL);
-	input_dev->keybit[BIT_WORD(BTN_DIGI)] |= BIT_MASK(BTN_TOOL_PEN) | BIT_MASK(BTN_TOUCH);
-	input_dev->keybit[BIT_WORD(BTN_LEFT)] |= BIT_MASK(BTN_LEFT) | BIT_MASK(BTN_RIGHT) | BIT_MASK(BTN_MIDDLE);
-	for(i=0;i<sizeof(lbuttons)/sizeof(lbuttons[0]);i++)
-	  __set_bit(lbuttons[i], input_dev->keybit);
-	for(i=0;i<sizeof(rbuttons)/sizeof(rbuttons[0]);i++)
-	  __set_bit(rbuttons[i], input_dev->keybit);
-
-	input_set_abs_params(input_dev, ABS_X, 0, 0xffff, 4, 0);
-	input_set_abs_params(input_dev, ABS_Y, 0, 0xffff, 4, 0);
+	__set_bit(INPUT_PROP_POINTER, input_dev->propbit);
+	__set_bit(INPUT_PROP_DIRECT, input_dev->propbit);
+	input_set_capability(input_dev, EV_KEY, BTN_TOOL_PEN);
+	input_set_capability(input_dev, EV_KEY, BTN_TOOL_RUBBER);
+	input_set_capability(input_dev, EV_KEY, BTN_TOUCH);
+	input_set_capability(input_dev, EV_KEY, BTN_STYLUS);
+	input_set_capability(input_dev, EV_KEY, BTN_STYLUS2);
+	for (i = 0; i < model->num_buttons; i++)
+		input_set_capability(input_dev, EV_KEY, model->buttons[i]);
+
+	input_set_abs_params(input_dev, ABS_X, 0, HANVON_ABS_MAX, 4, 0);
+	input_set_abs_params(input_dev, ABS_Y, 0, HANVON_ABS_MAX, 4, 0);
 	input_set_abs_params(input_dev, ABS_TILT_X, 0, AM_MAX_TILT_X, 0, 0);
 	input_set_abs_params(input_dev, ABS_TILT_Y, 0, AM_MAX_TILT_Y, 0, 0);
 	input_set_abs_params(input_dev, ABS_PRESSURE, 0, AM_MAX_PRESSURE, 0, 0);
 	input_set_capability(input_dev, EV_REL, REL_WHEEL);
-
-	endpoint = &intf->cur_altsetting->endpoint[0].desc;
+	input_set_capability(input_dev, EV_REL, REL_WHEEL_HI_RES);
 
 	usb_fill_int_urb(hanvon->irq, dev,
 			usb_rcvintpipe(dev, endpoint->bEndpointAddress),
-			hanvon->data, USB_AM_PACKET_LEN,
+			hanvon->data, hanvon->data_len,
 			hanvon_irq, hanvon, endpoint->bInterval);
 	hanvon->irq->transfer_dma = hanvon->data_dma;
 	hanvon->irq->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
@@ -372,7 +470,7 @@ static int hanvon_probe(struct usb_interface *intf, const struct usb_device_id *
 	return 0;
 
 fail3:   usb_free_urb(hanvon->irq);
-fail2:   usb_free_coherent(dev, USB_AM_PACKET_LEN, hanvon->data, hanvon->data_dma);
+fail2:   usb_free_coherent(dev, hanvon->data_len, hanvon->data, hanvon->data_dma);
 fail1:   input_free_device(input_dev);
 	kfree(hanvon);
 	return error;
@@ -387,7 +485,7 @@ static void hanvon_disconnect(struct usb_interface *intf)
 		usb_kill_urb(hanvon->irq);
 		input_unregister_device(hanvon->dev);
 		usb_free_urb(hanvon->irq);
-		usb_free_coherent(interface_to_usbdev(intf), USB_AM_PACKET_LEN, hanvon->data, hanvon->data_dma);
+		usb_free_coherent(interface_to_usbdev(intf), hanvon->data_len, hanvon->data, hanvon->data_dma);
 		kfree(hanvon);
 	}
 }
@@ -0,0 +1,660 @@
+/*
+* =====================================================================================
+*
+*       Filename:  libhanvon.c
+*
+*    Description:  Hanvon tablet protocol core (profiles, decoders, events)
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#include <stdlib.h> // For abs
+#include <string.h> // For memset
+#include <errno.h>
+#include <math.h>   // For fabsf
+
+#include "libhanvon.h"
+
+// Structure overlay for PEN_EVENT (AM/GP layout, as read by the kernel driver)
+// Note: Endianness of shorts depends on device protocol (often Big Endian)
+struct hanvon_pen_message {
+    unsigned char msgtype;      // Should be PEN_EVENT (0x02)
+    unsigned char status;       // Contains flags for proximity, touch, buttons
+    unsigned char x_hi;         // X coordinate high byte
+    unsigned char x_lo;         // X coordinate low byte
+    unsigned char y_hi;         // Y coordinate high byte
+    unsigned char y_lo;         // Y coordinate low byte
+    unsigned char pressure_hi;  // Pressure bits 9..2
+    unsigned char pressure_lo;  // Pressure bits 1..0 in the top 2 bits, tilt X in the low 6 bits
+    unsigned char tilt_x;       // Tilt Y value (the kernel reads it as ABS_TILT_Y)
+    unsigned char tilt_y;       // Unused
+};
+
+static int decode_am(struct hanvon_decoder *dec, const unsigned char *data, int len);
+static int decode_gp0504(struct hanvon_decoder *dec, const unsigned char *data, int len);
+static int decode_gp0906(struct hanvon_decoder *dec, const unsigned char *data, int len);
+static int decode_appiv(struct hanvon_decoder *dec, const unsigned char *data, int len);
+
+// Pad buttons of each layout (pen tool/touch/stylus keys are always enabled)
+static const int buttons_left4[]  = {BTN_0, BTN_1, BTN_2, BTN_3};
+static const int buttons_left4_right4[] = {BTN_0, BTN_1, BTN_2, BTN_3, BTN_4, BTN_5, BTN_6, BTN_7};
+// APPIV0906: BTN_0 is the fourth pen button, BTN_1-BTN_7 tablet buttons (from kernel driver)
+static const int buttons_appiv[]  = {BTN_0, BTN_1, BTN_2, BTN_3, BTN_4, BTN_5, BTN_6, BTN_7};
+
+#define BUTTONS(b) (b), sizeof(b)/sizeof((b)[0])
+
+// Motion filter tuning. Speeds are in tablet counts per second, so the
+// higher resolution APPIV0906 needs a smaller beta for the same feel. The
+// GP families share the ArtMaster tuning.
+static const struct hanvon_filter_params filter_am    = { 1.0f, 0.01f,  1.0f, 0 };
+static const struct hanvon_filter_params filter_appiv = { 1.0f, 0.005f, 1.0f, 0 };
+#define filter_gp0504 filter_am
+#define filter_gp0906 filter_am
+
+// Profile table, one entry per model of hanvon-profiles.h.
+// The decoder follows the kernel driver: GP0504, GP0906 and APPIV0906 have
+// their own handlers, every other model uses the ArtMaster layout.
+#define HANVON_PROFILE_ENTRY(model, product_id, name, family, max_x, max_y, pad) \
+    { product_id, name, max_x, max_y, AM_MAX_TILT_X, AM_MAX_TILT_Y, 10, BUTTONS(buttons_##pad), \
+      decode_##family, &filter_##family },
+static const struct hanvon_profile g_profiles[] = {
+    HANVON_PROFILES(HANVON_PROFILE_ENTRY)
+};
+#undef HANVON_PROFILE_ENTRY
+
+// Returns the profile of a Hanvon product ID, or NULL if it is not supported
+const struct hanvon_profile *hanvon_profile_lookup(uint16_t product_id) {
+    for (size_t i = 0; i < sizeof(g_profiles)/sizeof(g_profiles[0]); i++) {
+        if (g_profiles[i].product_id == product_id) {
+            return &g_profiles[i];
+        }
+    }
+    return NULL;
+}
+
+const struct hanvon_profile *hanvon_profiles(size_t *count) {
+    *count = sizeof(g_profiles)/sizeof(g_profiles[0]);
+    return g_profiles;
+}
+
+void hanvon_decoder_init(struct hanvon_decoder *dec, const struct hanvon_profile *profile) {
+    memset(dec, 0, sizeof(*dec));
+    dec->profile = profile;
+    dec->decode = profile->decode;
+    dec->pressure_shift = 16 - profile->pressure_bits;
+    dec->pen.tool = BTN_TOOL_PEN;
+    for (int i = 0; i < 2; i++) dec->strip[i].sample = dec->strip[i].position = -1;
+}
+
+// Updates the pad state from an AM/GP button byte (data[2] or data[4]).
+// base is the hanvon_pen_state.pad bit of the first button of that side;
+// a strip position is left to hanvon_wheel_apply, which knows the time.
+static inline void report_buttons( struct hanvon_decoder *dec,
+                                   int base,          // First pad bit of this side
+                                   unsigned char data) // Byte containing button flags
+{
+    struct hanvon_pen_state *pen = &dec->pen;
+
+    // Check specific pattern for AM/GP buttons (data[2] or data[4])
+    if ((data & 0xf0) == 0xa0) {
+        // These map to buttons 1, 2, 3 of the side (flags 0x02, 0x04, 0x08)
+        unsigned int mask = 0x0eu << base;
+        pen->pad = (pen->pad & ~mask) | (((unsigned int)data & 0x0e) << base);
+    } else if (data <= 0x3f) {   /* slider/wheel area active */
+        dec->strip[base ? 1 : 0].sample = data;
+    }
+    // Note: Button 0 of each side is not reported in this message
+}
+
+// BUTTON_EVENT_GP: AM/GP pad buttons and touch strip
+static inline int decode_gp_buttons(struct hanvon_decoder *dec,
+                                    const unsigned char *data, int len) {
+    if (len < 5) return -EBADMSG;
+    // Left side buttons/wheel use data[2]
+    if (data[1] == 0x55) report_buttons(dec, 0, data[2]);
+    // Right side buttons/wheel use data[4] (AM1107, AM1209)
+    if (data[3] == 0xAA) report_buttons(dec, 4, data[4]);
+    return 0;
+}
+
+// PEN_EVENT of the AM/GP layout. data[1] contains status flags:
+// 0xf0: Pen in proximity (any of the high bits)
+// 0x20: Eraser end active
+// 0x02: Pen side button pressed
+// 0x01: Pen touching surface
+// Pressure is the top 10 bits of data[6..7], tilt X the low 6 bits of
+// data[7] and tilt Y data[8], as in the kernel driver.
+static inline void decode_am_pen(struct hanvon_decoder *dec, struct hanvon_pen_state *pen,
+                                 const unsigned char *data) {
+    pen->in_range = (data[1] & 0xf0) != 0;
+    if (pen->in_range) {
+        pen->x = ((unsigned int)data[2] << 8) | data[3];
+        pen->y = ((unsigned int)data[4] << 8) | data[5];
+        pen->pressure = (((unsigned int)data[6] << 8) | data[7]) >> dec->pressure_shift;
+        pen->tilt_x = data[7] & 0x3f;
+        pen->tilt_y = data[8];
+        pen->tool = (data[1] & 0x20) ? BTN_TOOL_RUBBER : BTN_TOOL_PEN;
+    }
+    pen->stylus = (data[1] & 0x02) != 0;
+}
+
+// AM (ArtMaster/Rollick/GraphicPal except GP0504/GP0906), kernel handle_default
+static int decode_am(struct hanvon_decoder *dec, const unsigned char *data, int len) {
+    struct hanvon_pen_state *pen = &dec->pen;
+
+    switch (data[0]) {
+        case BUTTON_EVENT_GP:
+            return decode_gp_buttons(dec, data, len);
+        case PEN_EVENT:
+            if (len < AM_PEN_REPORT_LEN) return -EBADMSG;
+            decode_am_pen(dec, pen, data);
+            pen->touch = data[1] & 0x01;
+            return 0;
+        default:
+            return -ENOMSG;
+    }
+}
+
+// GP0504, kernel handle_gp0504: AM layout, but the touch flag is unreliable
+// and contact is derived from the pressure high byte instead
+static int decode_gp0504(struct hanvon_decoder *dec, const unsigned char *data, int len) {
+    struct hanvon_pen_state *pen = &dec->pen;
+
+    switch (data[0]) {
+        case BUTTON_EVENT_GP:
+            return decode_gp_buttons(dec, data, len);
+        case PEN_EVENT:
+            if (len < AM_PEN_REPORT_LEN) return -EBADMSG;
+            decode_am_pen(dec, pen, data);
+            pen->touch = data[6] > 68;
+            return 0;
+        default:
+            return -ENOMSG;
+    }
+}
+
+// GP0906, kernel handle_gp0906:
+// [header][event type][x BE16][y BE16][pressure BE16][tilt BE16]
+static int decode_gp0906(struct hanvon_decoder *dec, const unsigned char *data, int len) {
+    struct hanvon_pen_state *pen = &dec->pen;
+
+    switch (data[0]) {
+        case PEN_EVENT:
+            if (len < 8) return -EBADMSG;
+            if ((data[1] & 0xe0) == 0xe0) {
+                pen->in_range = 1;
+                pen->tool = BTN_TOOL_PEN;
+                pen->x = ((unsigned int)data[2] << 8) | data[3];
+                pen->y = ((unsigned int)data[4] << 8) | data[5];
+                pen->touch = data[1] & 0x01;  // Pressure is only sent while touching
+                pen->pressure = pen->touch ? (((unsigned int)data[6] << 8) | data[7]) >> dec->pressure_shift : 0;
+                if (data[1] & 0x04) pen->stylus = (data[1] & 0x02) != 0;
+            } else if (data[1] == 0xc2) {     // Pen enters
+                pen->in_range = 1;
+            } else if (data[1] == 0x80) {     // Pen leaves
+                pen->in_range = 0;
+                pen->touch = 0;
+                pen->pressure = 0;
+            }
+            return 0;
+        case BUTTON_EVENT_0906:
+            if (len < 4) return -EBADMSG;
+            pen->pad = data[3] & 0x0f;
+            return 0;
+        default:
+            return -ENOMSG;
+    }
+}
+
+// APPIV0906, kernel handle_appiv0906. The pen button report carries little
+// endian coordinates, PEN_EVENT big endian ones.
+static int decode_appiv(struct hanvon_decoder *dec, const unsigned char *data, int len) {
+    struct hanvon_pen_state *pen = &dec->pen;
+
+    switch (data[0]) {
+        case BUTTON_EVENT_GP:           // Pen button event
+            if (len < 6) return -EBADMSG;
+            pen->in_range = 1;
+            pen->tool = BTN_TOOL_PEN;
+            pen->x = ((unsigned int)data[3] << 8) | data[2];
+            pen->y = ((unsigned int)data[5] << 8) | data[4];
+            pen->touch = data[1] & 0x01;
+            pen->stylus = (data[1] & 0x02) != 0;
+            pen->stylus2 = (data[1] & 0x04) != 0;
+            pen->pad = (pen->pad & ~1u) | ((data[1] >> 3) & 1u); // BTN_0
+            return 0;
+        case PEN_EVENT:
+            if (len < 8) return -EBADMSG;
+            pen->in_range = 1;
+            pen->tool = BTN_TOOL_PEN;
+            pen->x = ((unsigned int)data[2] << 8) | data[3];
+            pen->y = ((unsigned int)data[4] << 8) | data[5];
+            if (data[1] & 1)
+                pen->pressure = (((unsigned int)data[6] << 8) | data[7]) >> dec->pressure_shift;
+            return 0;
+        case BUTTON_EVENT_0906:         // Tablet buttons BTN_1-BTN_7
+            if (len < 4) return -EBADMSG;
+            pen->pad = (pen->pad & 1u) | (((unsigned int)data[3] & 0x7f) << 1);
+            return 0;
+        default:
+            return -ENOMSG;
+    }
+}
+
+// Touch strip acceleration: below AM_WHEEL_ACCEL_SPEED strip steps per
+// second every step is one detent, above it the gain grows linearly up to
+// AM_WHEEL_ACCEL_MAX, so a swipe over the 64 step strip scrolls hundreds of
+// lines and a slow stroke still lands on a single one
+#define AM_WHEEL_ACCEL_SPEED    30.0f
+#define AM_WHEEL_ACCEL_SLOPE    (1.0f / 30.0f)
+#define AM_WHEEL_ACCEL_MAX      10.0f
+#define AM_WHEEL_SPEED_ALPHA    0.5f   // Weight of the newest step in the smoothed speed
+
+void hanvon_wheel_apply(struct hanvon_decoder *dec, uint64_t time_ns) {
+    struct hanvon_pen_state *pen = &dec->pen;
+    int hi_res = 0;
+
+    for (int i = 0; i < 2; i++) {
+        struct hanvon_strip *s = &dec->strip[i];
+        if (s->sample < 0) continue;
+
+        int delta = s->sample - s->position;
+        int touching = s->position >= 0 && time_ns > s->last_ns &&
+                       time_ns - s->last_ns < AM_WHEEL_RELEASE_NS;
+        float dt = touching ? (time_ns - s->last_ns) * 1e-9f : 0.0f;
+        // The strip reports absolute positions, so the first report of a
+        // touch can be anywhere. Within a stroke a jump is only plausible as
+        // far as the finger's speed carries it; the kernel driver drops every
+        // step of AM_WHEEL_THRESHOLD or more, and with it all fast swipes.
+        if (!touching) s->speed = 0.0f;
+        if (s->position < 0 || abs(delta) >= AM_WHEEL_THRESHOLD + 2.0f * s->speed * dt) {
+            s->speed = 0.0f;
+            dec->wheel_remainder = 0;
+        } else if (touching) {
+            s->speed += AM_WHEEL_SPEED_ALPHA * (abs(delta) / dt - s->speed);
+            float gain = 1.0f + (s->speed - AM_WHEEL_ACCEL_SPEED) * AM_WHEEL_ACCEL_SLOPE;
+            gain = gain < 1.0f ? 1.0f : gain > AM_WHEEL_ACCEL_MAX ? AM_WHEEL_ACCEL_MAX : gain;
+            hi_res += (int)lroundf(delta * HANVON_WHEEL_HI_RES * gain);
+        } else {
+            hi_res += delta * HANVON_WHEEL_HI_RES; // A small step after a pause
+        }
+        s->position = s->sample;
+        s->last_ns = time_ns;
+    }
+
+    if (hi_res == 0) return;
+    dec->wheel_remainder += hi_res;
+    pen->wheel_hi_res = hi_res;
+    pen->wheel = dec->wheel_remainder / HANVON_WHEEL_HI_RES;
+    dec->wheel_remainder -= pen->wheel * HANVON_WHEEL_HI_RES;
+}
+
+// Smoothing factor of a first order low pass with the given cutoff
+static inline float filter_alpha(float cutoff, float dt) {
+    float r = 2.0f * (float)M_PI * cutoff * dt;
+    return r / (r + 1.0f);
+}
+
+static inline void filter_axis(struct hanvon_filter_axis *a, const struct hanvon_filter_params *p,
+                               float raw, float dt) {
+    float speed = (raw - a->value) / dt;
+    a->speed += filter_alpha(p->d_cutoff, dt) * (speed - a->speed);
+    float cutoff = p->min_cutoff + p->beta * fabsf(a->speed);
+    a->value += filter_alpha(cutoff, dt) * (raw - a->value);
+}
+
+static inline int filter_output(const struct hanvon_filter_axis *a, float horizon, int max) {
+    int v = (int)(a->value + a->speed * horizon + 0.5f);
+    return v < 0 ? 0 : v > max ? max : v;
+}
+
+void hanvon_filter_apply(struct hanvon_decoder *dec, const struct hanvon_tuning *t, uint64_t time_ns) {
+    struct hanvon_filter *f = &dec->filter;
+    const struct hanvon_pen_state *pen = &dec->pen;
+
+    if (!t || !t->filter_enabled || !pen->in_range) {
+        f->primed = 0;                  // Start afresh at the next proximity
+        return;
+    }
+    float dt = (time_ns - f->last_ns) * 1e-9f;
+    // Restart on the first sample and after a pause much longer than the
+    // report interval, smoothing across it would drag the pen from the past
+    if (!f->primed || time_ns <= f->last_ns || dt > 0.1f) {
+        f->x.value = pen->x;
+        f->y.value = pen->y;
+        f->x.speed = f->y.speed = 0.0f;
+        f->primed = 1;
+    } else {
+        filter_axis(&f->x, &t->filter, pen->x, dt);
+        filter_axis(&f->y, &t->filter, pen->y, dt);
+    }
+    f->last_ns = time_ns;
+
+    float horizon = t->filter.predict_us * 1e-6f;
+    f->out_x = filter_output(&f->x, horizon, dec->profile->max_x);
+    f->out_y = filter_output(&f->y, horizon, dec->profile->max_y);
+}
+
+// Cubic Bezier from (0,0) over (x1,y1) and (x2,y2) to (1,1), the same
+// pressure curve form the X.org wacom driver uses
+static float bezier(float t, float p1, float p2) {
+    float u = 1.0f - t;
+    return 3.0f * u * u * t * p1 + 3.0f * u * t * t * p2 + t * t * t;
+}
+
+static float curve_eval(const float curve[4], float x) {
+    float lo = 0.0f, hi = 1.0f;
+    for (int i = 0; i < 32; i++) {      // x(t) is monotonic for control points in 0..1
+        float t = (lo + hi) / 2;
+        if (bezier(t, curve[0], curve[2]) < x) lo = t; else hi = t;
+    }
+    return bezier((lo + hi) / 2, curve[1], curve[3]);
+}
+
+static int mapping_init(struct hanvon_mapping *m, const struct hanvon_profile *profile,
+                        const struct hanvon_mapping_params *params) {
+    memset(m, 0, sizeof(*m));
+    if (!params) return 0;
+    if (profile->pressure_bits > HANVON_PRESSURE_BITS_MAX) return -EINVAL;
+
+    int x0 = 0, y0 = 0, x1 = profile->max_x, y1 = profile->max_y;
+    if (params->area[0] || params->area[1] || params->area[2] || params->area[3]) {
+        x0 = params->area[0];
+        y0 = params->area[1];
+        x1 = params->area[2];
+        y1 = params->area[3];
+    }
+    if (x1 <= x0 || y1 <= y0) return -EINVAL;
+
+    int quarter = params->rotation == HANVON_ROTATE_CW || params->rotation == HANVON_ROTATE_CCW;
+    m->rotation = params->rotation;
+    m->x0 = x0;
+    m->y0 = y0;
+    m->max_x = quarter ? profile->max_y : profile->max_x;
+    m->max_y = quarter ? profile->max_x : profile->max_y;
+    // X of the tablet ends up on the output Y axis after a quarter turn
+    m->max_u = quarter ? m->max_y : m->max_x;
+    m->max_v = quarter ? m->max_x : m->max_y;
+    m->scale_x = ((uint64_t)m->max_u << 16) / (x1 - x0);
+    m->scale_y = ((uint64_t)m->max_v << 16) / (y1 - y0);
+
+    int levels = 1 << profile->pressure_bits;
+    for (int i = 0; i < levels; i++) {
+        float y = curve_eval(params->curve, (float)i / (levels - 1));
+        int v = (int)(y * (levels - 1) + 0.5f);
+        m->pressure[i] = v < 0 ? 0 : v >= levels ? levels - 1 : v;
+    }
+    m->enabled = 1;
+    return 0;
+}
+
+static inline int pad_is_modifier(int code) {
+    switch (code) {
+        case KEY_LEFTCTRL: case KEY_RIGHTCTRL: case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT:
+        case KEY_LEFTALT: case KEY_RIGHTALT: case KEY_LEFTMETA: case KEY_RIGHTMETA:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Press combo of button i: the configured one, or the model's key
+static struct hanvon_pad_combo pad_press(const struct hanvon_pad_params *params,
+                                         const struct hanvon_profile *profile, size_t i) {
+    struct hanvon_pad_combo combo = { { 0 } };
+    if (params->press[i].key[0]) return params->press[i];
+    combo.key[0] = profile->buttons[i];
+    return combo;
+}
+
+static int pad_key_index(const struct hanvon_pad_map *map, uint16_t code) {
+    for (int i = 0; i < map->num_keys; i++) {
+        if (map->keys[i] == code) return i;
+    }
+    return -1;
+}
+
+// Numbers the new keys of combo, only its modifiers or only the others
+static int pad_add_keys(struct hanvon_pad_map *map, const struct hanvon_pad_combo *combo, int modifiers) {
+    for (int k = 0; k < HANVON_PAD_COMBO_KEYS && combo->key[k]; k++) {
+        uint16_t code = combo->key[k];
+        if (pad_is_modifier(code) != modifiers || pad_key_index(map, code) >= 0) continue;
+        if (map->num_keys == HANVON_PAD_KEYS_MAX) return -ENOSPC;
+        map->keys[map->num_keys++] = code;
+    }
+    return 0;
+}
+
+static uint32_t pad_mask(const struct hanvon_pad_map *map, const struct hanvon_pad_combo *combo) {
+    uint32_t mask = 0;
+    for (int k = 0; k < HANVON_PAD_COMBO_KEYS && combo->key[k]; k++) {
+        mask |= 1u << pad_key_index(map, combo->key[k]);
+    }
+    return mask;
+}
+
+// Compiles the pad mapping of a model. Chords of buttons the model does not
+// have are left out. Only enabled when something goes beyond one plain key
+// per button, that case stays on tuning->buttons.
+static int pad_map_init(struct hanvon_pad_map *map, const struct hanvon_profile *profile,
+                        const struct hanvon_pad_params *params) {
+    size_t n = profile->num_buttons < HANVON_MAX_BUTTONS ? profile->num_buttons : HANVON_MAX_BUTTONS;
+    uint32_t all = n < 32 ? (1u << n) - 1 : ~0u;
+    int combos = 0;
+
+    memset(map, 0, sizeof(*map));
+    if (!params) return 0;
+    for (int modifiers = 1; modifiers >= 0; modifiers--) {
+        for (size_t i = 0; i < n; i++) {
+            struct hanvon_pad_combo press = pad_press(params, profile, i);
+            if (pad_add_keys(map, &press, modifiers) < 0 ||
+                pad_add_keys(map, &params->hold[i], modifiers) < 0) {
+                return -ENOSPC;
+            }
+        }
+        for (int c = 0; c < params->num_chords && c < HANVON_PAD_CHORDS; c++) {
+            uint32_t buttons = params->chord[c].buttons;
+            if (!buttons || (buttons & ~all)) continue;
+            if (pad_add_keys(map, &params->chord[c].combo, modifiers) < 0) return -ENOSPC;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        struct hanvon_pad_combo press = pad_press(params, profile, i);
+        map->press[i] = pad_mask(map, &press);
+        map->hold[i] = pad_mask(map, &params->hold[i]);
+        if (map->hold[i]) map->deferred |= 1u << i;
+        combos |= press.key[1] != 0;
+    }
+    for (int c = 0; c < params->num_chords && c < HANVON_PAD_CHORDS; c++) {
+        uint32_t buttons = params->chord[c].buttons;
+        if (!buttons || (buttons & ~all)) continue;
+        map->chord_buttons[map->num_chords] = buttons;
+        map->chord_keys[map->num_chords++] = pad_mask(map, &params->chord[c].combo);
+        map->deferred |= buttons;
+    }
+    map->hold_ns = (uint64_t)(params->hold_ms > 0 ? params->hold_ms : HANVON_PAD_HOLD_MS) * 1000000;
+    map->enabled = combos || map->deferred;
+    return 0;
+}
+
+int hanvon_pad_count_keys(const struct hanvon_pad_params *params, const struct hanvon_profile *profile) {
+    struct hanvon_pad_map map;
+    int rc = pad_map_init(&map, profile, params);
+    return rc < 0 ? rc : map.num_keys;
+}
+
+int hanvon_tuning_init(struct hanvon_tuning *tuning, const struct hanvon_profile *profile,
+                       const struct hanvon_mapping_params *mapping,
+                       const struct hanvon_filter_params *filter, const struct hanvon_pad_params *pad) {
+    static uint64_t generation;
+
+    memset(tuning, 0, sizeof(*tuning));
+    // A freed tuning's address comes back for the next one, so the pad
+    // engine tells tunings apart by this instead of their pointer
+    tuning->generation = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    int rc = mapping_init(&tuning->map, profile, mapping);
+    if (rc < 0) return rc;
+    if (filter) {
+        tuning->filter_enabled = 1;
+        tuning->filter = *filter;
+    }
+    for (size_t i = 0; i < profile->num_buttons && i < HANVON_MAX_BUTTONS; i++) {
+        tuning->buttons[i] = pad && pad->press[i].key[0] ? pad->press[i].key[0] : profile->buttons[i];
+    }
+    return pad_map_init(&tuning->pad, profile, pad);
+}
+
+// Moves the pad engine to the tuning t (map m, NULL when disabled). Keys the
+// previous tuning holds are released first with a packet of their own
+// (returns 0 then). Buttons down at the switch stay silent until released.
+static int pad_switch(struct hanvon_pad_state *s, const struct hanvon_tuning *t,
+                      const struct hanvon_pad_map *m, unsigned int pad) {
+    int release = s->keys && !s->stale;
+
+    s->generation = t ? t->generation : 0;
+    s->stale = release;
+    s->prev = s->consumed = pad;
+    s->pending = s->held = s->chords = s->keys = 0;
+    if (release) return 0;
+    s->num_codes = m ? m->num_keys : 0;
+    if (m) memcpy(s->codes, m->keys, sizeof(s->codes));
+    return 1;
+}
+
+void hanvon_pad_apply(struct hanvon_decoder *dec, const struct hanvon_tuning *t, uint64_t time_ns) {
+    const struct hanvon_pad_map *m = t && t->pad.enabled ? &t->pad : NULL;
+    struct hanvon_pad_state *s = &dec->pad;
+    unsigned int pad = dec->pen.pad;
+
+    s->pulse = 0;
+    uint64_t generation = t ? t->generation : 0;
+    if (__builtin_expect(s->generation != generation || s->stale, 0) && !pad_switch(s, t, m, pad)) return;
+    if (!m) return;
+
+    uint32_t up = s->prev & ~pad, down = pad & ~s->prev;
+    s->prev = pad;
+    if (!(up | down | s->pending)) return; // Nothing to resolve, the keys stay
+
+    // A pending button that is released was a tap (of its hold action when
+    // it was down long enough, but no packet came in between)
+    for (uint32_t b = up & s->pending; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        uint32_t hold = m->hold[i] ? m->hold[i] : m->press[i];
+        s->pulse |= time_ns - s->down_ns[i] >= m->hold_ns ? hold : m->press[i];
+    }
+    s->pending &= pad;
+    s->held &= pad;
+    s->consumed &= pad;
+    for (uint32_t c = s->chords; c; c &= c - 1) {
+        int i = __builtin_ctz(c);
+        if (m->chord_buttons[i] & ~pad) s->chords &= ~(1u << i);
+    }
+
+    for (uint32_t b = down & m->deferred; b; b &= b - 1) s->down_ns[__builtin_ctz(b)] = time_ns;
+    s->pending |= down & m->deferred;
+    // A chord completes while all of its buttons are pending
+    for (int i = 0; i < m->num_chords; i++) {
+        uint32_t buttons = m->chord_buttons[i];
+        if ((s->pending & buttons) == buttons) {
+            s->chords |= 1u << i;
+            s->pending &= ~buttons;
+            s->consumed |= buttons;
+        }
+    }
+    for (uint32_t b = s->pending; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        if (time_ns - s->down_ns[i] >= m->hold_ns) {
+            s->pending &= ~(1u << i);
+            s->held |= 1u << i;
+        }
+    }
+
+    uint32_t keys = 0;
+    for (uint32_t b = pad & ~m->deferred & ~s->consumed; b; b &= b - 1) keys |= m->press[__builtin_ctz(b)];
+    for (uint32_t b = s->held; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        keys |= m->hold[i] ? m->hold[i] : m->press[i];
+    }
+    for (uint32_t c = s->chords; c; c &= c - 1) keys |= m->chord_keys[__builtin_ctz(c)];
+    s->keys = keys;
+}
+
+void hanvon_pad_release(struct hanvon_decoder *dec) {
+    struct hanvon_pad_state *s = &dec->pad;
+    s->prev = 0;
+    s->pending = s->held = s->consumed = s->chords = 0;
+    s->keys = s->pulse = 0;
+}
+
+static inline int map_axis(int raw, int origin, uint32_t scale, int max) {
+    int64_t v = ((int64_t)(raw - origin) * scale) >> 16;
+    return v < 0 ? 0 : v > max ? max : (int)v;
+}
+
+void hanvon_emit(const struct hanvon_decoder *dec, const struct hanvon_tuning *t, struct hanvon_frame *frame) {
+    const struct hanvon_pen_state *pen = &dec->pen;
+    const struct hanvon_profile *profile = dec->profile;
+    int filtered = t && t->filter_enabled && dec->filter.primed;
+    int x = filtered ? dec->filter.out_x : pen->x;
+    int y = filtered ? dec->filter.out_y : pen->y;
+    int pressure = pen->pressure;
+
+    if (t && t->map.enabled) {
+        const struct hanvon_mapping *m = &t->map;
+        int u = map_axis(x, m->x0, m->scale_x, m->max_u);
+        int v = map_axis(y, m->y0, m->scale_y, m->max_v);
+        switch (m->rotation) {
+            case HANVON_ROTATE_NONE: x = u;            y = v;            break;
+            case HANVON_ROTATE_CW:   x = m->max_x - v; y = u;            break;
+            case HANVON_ROTATE_HALF: x = m->max_x - u; y = m->max_y - v; break;
+            case HANVON_ROTATE_CCW:  x = v;            y = m->max_y - u; break;
+        }
+        pressure = m->pressure[pressure & ((1 << profile->pressure_bits) - 1)];
+    }
+
+    hanvon_frame_push(frame, EV_KEY, BTN_TOOL_PEN, pen->in_range && pen->tool == BTN_TOOL_PEN);
+    hanvon_frame_push(frame, EV_KEY, BTN_TOOL_RUBBER, pen->in_range && pen->tool == BTN_TOOL_RUBBER);
+    if (pen->in_range) {
+        hanvon_frame_push(frame, EV_ABS, ABS_X, x);
+        hanvon_frame_push(frame, EV_ABS, ABS_Y, y);
+        hanvon_frame_push(frame, EV_ABS, ABS_PRESSURE, pressure);
+        hanvon_frame_push(frame, EV_ABS, ABS_TILT_X, pen->tilt_x);
+        hanvon_frame_push(frame, EV_ABS, ABS_TILT_Y, pen->tilt_y);
+    }
+    hanvon_frame_push(frame, EV_KEY, BTN_TOUCH, pen->touch);
+    hanvon_frame_push(frame, EV_KEY, BTN_STYLUS, pen->stylus);
+    hanvon_frame_push(frame, EV_KEY, BTN_STYLUS2, pen->stylus2);
+
+    if (!t || !t->pad.enabled) {
+        const int *buttons = t ? t->buttons : profile->buttons;
+        for (size_t i = 0; i < profile->num_buttons; i++) {
+            hanvon_frame_push(frame, EV_KEY, buttons[i], (pen->pad >> i) & 1);
+        }
+    }
+    // Pad engine keys, also while it releases the keys of a previous tuning
+    const struct hanvon_pad_state *ps = &dec->pad;
+    if (ps->num_codes) {
+        for (int j = 0; j < ps->num_codes; j++) {
+            hanvon_frame_push(frame, EV_KEY, ps->codes[j], (ps->keys >> j) & 1);
+        }
+        uint32_t pulse = ps->pulse & ~ps->keys;
+        if (pulse) {
+            for (uint32_t b = pulse; b; b &= b - 1) {
+                hanvon_frame_push(frame, EV_KEY, ps->codes[__builtin_ctz(b)], 1);
+            }
+            hanvon_frame_push(frame, EV_SYN, SYN_REPORT, 0);
+            for (int j = ps->num_codes - 1; j >= 0; j--) {
+                if ((pulse >> j) & 1) hanvon_frame_push(frame, EV_KEY, ps->codes[j], 0);
+            }
+        }
+    }
+    if (pen->wheel_hi_res != 0) {
+        hanvon_frame_push(frame, EV_REL, REL_WHEEL_HI_RES, pen->wheel_hi_res);
+    }
+    if (pen->wheel != 0) {
+        hanvon_frame_push(frame, EV_REL, REL_WHEEL, pen->wheel);
+    }
+}
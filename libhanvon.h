@@ -0,0 +1,409 @@
+/*
+* =====================================================================================
+*
+*       Filename:  libhanvon.h
+*
+*    Description:  Hanvon tablet protocol core: device profiles, packet
+*                  decoding and evdev event generation, without any USB or
+*                  uinput dependency
+*
+*       Compiler:  gcc
+*
+* =====================================================================================
+*/
+
+#ifndef LIBHANVON_H
+#define LIBHANVON_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#include "hanvon-profiles.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VENDOR_ID_HANVON        0x0b57
+
+// PRODUCT_ID_<model> of every model in hanvon-profiles.h
+enum hanvon_product_id {
+#define HANVON_PRODUCT_ID(model, product_id, ...) PRODUCT_ID_##model = product_id,
+    HANVON_PROFILES(HANVON_PRODUCT_ID)
+#undef HANVON_PRODUCT_ID
+};
+
+#define AM_PACKET_LEN           10 // Report length of the original driver
+#define AM_PEN_REPORT_LEN       9  // PEN_EVENT bytes the AM/GP decoders read, longer reports are fine
+#define AM_RESOLUTION           40 // Dots per mm? Check kernel driver or specs
+#define AM_WHEEL_THRESHOLD      4  // Strip steps a report may jump without being taken as a new touch
+#define AM_WHEEL_RELEASE_NS     150000000ull // A strip report this long after the last one starts a new touch
+#define HANVON_WHEEL_HI_RES     120 // REL_WHEEL_HI_RES units per REL_WHEEL detent
+#define HANVON_FRAME_MAX_EVENTS 64 // Events per frame (one write), including the SYN_REPORTs
+#define HANVON_PRESSURE_BITS_MAX 12 // Largest profile->pressure_bits the pressure LUT supports
+#define HANVON_MAX_BUTTONS      32 // Pad buttons, one bit each in hanvon_pen_state.pad
+#define HANVON_PAD_COMBO_KEYS   4  // Keys of one pad combo, e.g. KEY_LEFTCTRL+KEY_LEFTSHIFT+KEY_Z
+#define HANVON_PAD_CHORDS       8  // Button chords per tablet
+#define HANVON_PAD_KEYS_MAX     12 // Distinct keys all pad actions of a tablet may send
+#define HANVON_PAD_HOLD_MS      300 // Default time that tells a hold from a tap
+
+// Message types from device
+#define BUTTON_EVENT_GP         0x01 // General purpose button/wheel event
+#define PEN_EVENT               0x02 // Pen movement/status event
+#define BUTTON_EVENT_0906       0x0C // Specific button event for GP0906/APPIV0906
+
+// Pen and pad state shared by all protocol families. The family decoders
+// update it from a packet, hanvon_emit turns it into events and the delta
+// filter only lets the differences through.
+struct hanvon_pen_state {
+    int x, y;                           // Raw coordinates
+    int pressure;                       // Scaled to profile->pressure_bits
+    int tilt_x, tilt_y;
+    int tool;                           // BTN_TOOL_PEN or BTN_TOOL_RUBBER
+    unsigned char in_range;             // Pen in proximity
+    unsigned char touch;                // Tip touches the surface
+    unsigned char stylus, stylus2;      // Barrel buttons
+    unsigned int pad;                   // Bit i is profile->buttons[i]
+    int wheel;                          // REL_WHEEL detents of the current packet
+    int wheel_hi_res;                   // REL_WHEEL_HI_RES units of the current packet
+};
+
+// Last key and absolute axis values written to the input device. Used to
+// drop events that would not change the kernel's view of the device, so a
+// frame with nothing new costs no syscall at all.
+struct hanvon_emit_state {
+    int valid;                          // 0 until a frame was written successfully
+    unsigned char key[KEY_CNT];         // Last EV_KEY value per code
+    int abs[ABS_CNT];                   // Last EV_ABS value per code
+};
+
+// Frame of evdev events collected while decoding one packet. The whole frame,
+// terminated by SYN_REPORT, can be handed to the kernel with a single write().
+struct hanvon_frame {
+    struct input_event ev[HANVON_FRAME_MAX_EVENTS];
+    int count;
+    struct hanvon_emit_state *state;    // Delta filter, NULL to emit everything
+};
+
+// Tuning of the optional motion filter (see hanvon_tuning_init). The
+// filter is a One-Euro filter: an exponential low pass on X/Y whose cutoff
+// rises with pen speed, smooth at rest and responsive in fast strokes. With
+// beta = 0 it is plain exponential smoothing. The speed estimate also drives
+// a linear position prediction that hides predict_us of pipeline delay.
+struct hanvon_filter_params {
+    float min_cutoff;                   // Hz, cutoff at rest (lower is smoother)
+    float beta;                         // Cutoff increase per count/s of speed
+    float d_cutoff;                     // Hz, cutoff of the speed estimate
+    int predict_us;                     // Prediction horizon, 0 for none
+};
+
+// One-Euro state of one axis
+struct hanvon_filter_axis {
+    float value;                        // Filtered position
+    float speed;                        // Filtered speed, counts/s
+};
+
+struct hanvon_filter {
+    int primed;                         // 0 until the first in-range sample
+    uint64_t last_ns;                   // Time of the previous sample
+    struct hanvon_filter_axis x, y;
+    int out_x, out_y;                   // Filtered (and predicted) position to emit
+};
+
+// Orientation of the tablet, the mapping turns the axes back
+enum hanvon_rotation {
+    HANVON_ROTATE_NONE,
+    HANVON_ROTATE_CW,                   // Tablet turned 90 degrees clockwise
+    HANVON_ROTATE_HALF,                 // Tablet upside down
+    HANVON_ROTATE_CCW,                  // Tablet turned 90 degrees counterclockwise
+};
+
+// User mapping of pressure and position (see hanvon_tuning_init)
+struct hanvon_mapping_params {
+    float curve[4];                     // Pressure curve Bezier control points x1,y1,x2,y2 in 0..1
+    int area[4];                        // Active area x0,y0,x1,y1 in tablet counts, all 0 for the whole tablet
+    enum hanvon_rotation rotation;
+};
+
+// Fixed point form of the mapping, computed once at attach so the packet
+// path only does table lookups and multiply-shifts
+struct hanvon_mapping {
+    int enabled;
+    enum hanvon_rotation rotation;
+    int x0, y0;                         // Active area origin
+    uint32_t scale_x, scale_y;          // 16.16 factors from area counts to output counts
+    int max_u, max_v;                   // Output range of the scaled X and Y before rotation
+    int max_x, max_y;                   // ABS_X/ABS_Y maximum after rotation
+    uint16_t pressure[1 << HANVON_PRESSURE_BITS_MAX]; // Pressure curve
+};
+
+// Keys sent together, modifiers first; unused entries are 0
+struct hanvon_pad_combo {
+    uint16_t key[HANVON_PAD_COMBO_KEYS];
+};
+
+// Buttons (bit i is pad button i) that send combo while all are held
+struct hanvon_pad_chord {
+    uint32_t buttons;
+    struct hanvon_pad_combo combo;
+};
+
+// User mapping of the pad buttons (see hanvon_tuning_init). A button whose
+// press combo is empty keeps the model's key. A button with a hold combo, or
+// one that is part of a chord, is resolved when it is released (a tap sends
+// press once), held for hold_ms (press or hold stays down until it is
+// released) or completes a chord with the other buttons of the chord while
+// none of them was resolved yet. Other buttons hold press down while held.
+struct hanvon_pad_params {
+    struct hanvon_pad_combo press[HANVON_MAX_BUTTONS];
+    struct hanvon_pad_combo hold[HANVON_MAX_BUTTONS];
+    struct hanvon_pad_chord chord[HANVON_PAD_CHORDS];
+    int num_chords;
+    int hold_ms;                        // 0 for HANVON_PAD_HOLD_MS
+};
+
+// Compiled form of the pad mapping: every action is a mask over the
+// tablet's distinct output keys, so the packet path dispatches with bit
+// operations only. Modifiers get the lowest indices and are pressed first.
+struct hanvon_pad_map {
+    int enabled;                        // More than one plain key per button, see hanvon_pad_apply
+    int num_keys;
+    uint16_t keys[HANVON_PAD_KEYS_MAX]; // Output key codes
+    uint32_t press[HANVON_MAX_BUTTONS]; // Output keys of each button
+    uint32_t hold[HANVON_MAX_BUTTONS];  // 0 when the button has no hold action
+    uint32_t deferred;                  // Buttons resolved as tap, hold or chord
+    int num_chords;
+    uint32_t chord_buttons[HANVON_PAD_CHORDS];
+    uint32_t chord_keys[HANVON_PAD_CHORDS];
+    uint64_t hold_ns;
+};
+
+// Everything about a tablet the user can tune, precomputed for the packet
+// path. A decoder reads it through one pointer and never writes it, so a
+// new tuning is built aside and swapped in whole (hanvon_decoder_set_tuning).
+struct hanvon_tuning {
+    uint64_t generation;                // Unique per hanvon_tuning_init, never 0
+    struct hanvon_mapping map;          // Pressure curve and area/rotation mapping
+    int filter_enabled;
+    struct hanvon_filter_params filter; // Motion filter, when filter_enabled
+    int buttons[HANVON_MAX_BUTTONS];    // Code of every pad button
+    struct hanvon_pad_map pad;          // Combos, tap/hold and chords, when pad.enabled
+};
+
+struct hanvon_decoder;
+
+// Decodes one interrupt packet into the decoder's pen state.
+// Returns 0, -EBADMSG for a packet too short for its type, or -ENOMSG for
+// an unknown message type.
+typedef int (*hanvon_decode_fn)(struct hanvon_decoder *dec, const unsigned char *data, int len);
+
+// Static description of one supported model
+struct hanvon_profile {
+    uint16_t product_id;
+    const char *name;                   // Input device name
+    int max_x, max_y;                   // ABS_X/ABS_Y maximum
+    int max_tilt_x, max_tilt_y;         // ABS_TILT_X/ABS_TILT_Y maximum
+    int pressure_bits;                  // Significant (top) bits of the 16 bit pressure field
+    const int *buttons;                 // Pad button codes, indexed by hanvon_pen_state.pad bit
+    size_t num_buttons;
+    hanvon_decode_fn decode;            // Decoder of the protocol family
+    const struct hanvon_filter_params *filter; // Motion filter tuning of the model
+};
+
+// Touch strip of one pad side. The family decoders only store the position
+// a packet reported, hanvon_wheel_apply turns it into scroll motion.
+struct hanvon_strip {
+    int sample;                         // Position reported by the current packet, -1 if none
+    int position;                       // Last position, -1 before the first report
+    uint64_t last_ns;                   // Arrival of the last report
+    float speed;                        // Smoothed strip steps per second
+};
+
+// Pad engine state of one tablet (hanvon_pad_apply). Output keys are bits
+// over codes, a copy of the keys of the map in use, so a reload can still
+// release what the previous tuning pressed.
+struct hanvon_pad_state {
+    uint64_t generation;                // Of the tuning the state belongs to, 0 for none
+    int stale;                          // Keys of the previous tuning are being released
+    unsigned int prev;                  // pen.pad of the previous packet
+    uint32_t pending;                   // Deferred buttons down and not resolved yet
+    uint32_t held;                      // Deferred buttons resolved as a hold
+    uint32_t consumed;                  // Buttons silent until released (chord members)
+    uint32_t chords;                    // Active chords
+    uint64_t down_ns[HANVON_MAX_BUTTONS]; // Press time of each pending button
+    uint32_t keys;                      // Output keys held down
+    uint32_t pulse;                     // Output keys tapped by the current packet
+    int num_codes;
+    uint16_t codes[HANVON_PAD_KEYS_MAX];
+};
+
+// Decoding state of one tablet. Everything model specific is looked up once
+// from the profile by hanvon_decoder_init, so the per-packet path never
+// re-derives it.
+struct hanvon_decoder {
+    const struct hanvon_profile *profile;
+    hanvon_decode_fn decode;            // profile->decode, cached for the hot path
+    int pressure_shift;                 // 16 - profile->pressure_bits
+    struct hanvon_strip strip[2];       // Left and right touch strip
+    int wheel_remainder;                // Hi-res units not yet reported as a REL_WHEEL detent
+    struct hanvon_pen_state pen;        // Decoded state, persists across packets
+    struct hanvon_emit_state emitted;   // Last values emitted, for delta suppression
+    struct hanvon_filter filter;        // State of the optional smoothing/prediction of X/Y
+    struct hanvon_pad_state pad;        // Pad engine, idle unless the tuning enables it
+    const struct hanvon_tuning *tuning; // NULL for the model defaults, see hanvon_decoder_set_tuning
+};
+
+// Returns the profile of a Hanvon product ID, or NULL if it is not supported
+const struct hanvon_profile *hanvon_profile_lookup(uint16_t product_id);
+
+// Returns the table of all supported models and its length
+const struct hanvon_profile *hanvon_profiles(size_t *count);
+
+// Resets dec for a tablet of the given model
+void hanvon_decoder_init(struct hanvon_decoder *dec, const struct hanvon_profile *profile);
+
+// Decodes one packet into dec->pen. The returned error is informational, the
+// pen state stays consistent (unchanged fields) whatever the packet holds.
+static inline int hanvon_decode(struct hanvon_decoder *dec, const unsigned char *data, int len) {
+    if (len < 1) return -EBADMSG;
+    dec->pen.wheel = 0;
+    dec->pen.wheel_hi_res = 0;
+    dec->strip[0].sample = dec->strip[1].sample = -1;
+    return dec->decode(dec, data, len);
+}
+
+// Builds the tuning of a tablet of the given model: the pressure curve LUT
+// and fixed point area/rotation mapping (identity with mapping == NULL), the
+// motion filter (off with filter == NULL, normally profile->filter) and the
+// pad mapping (model keys with pad == NULL). Returns -EINVAL for an empty
+// active area or a model with more than HANVON_PRESSURE_BITS_MAX pressure
+// bits, -ENOSPC when the pad actions use more than HANVON_PAD_KEYS_MAX keys.
+// Uses floating point, keep it off the packet path.
+int hanvon_tuning_init(struct hanvon_tuning *tuning, const struct hanvon_profile *profile,
+                       const struct hanvon_mapping_params *mapping,
+                       const struct hanvon_filter_params *filter, const struct hanvon_pad_params *pad);
+
+// Number of distinct keys the pad actions of params send on the model of
+// profile, including the model keys of unmapped buttons, or -ENOSPC
+int hanvon_pad_count_keys(const struct hanvon_pad_params *params, const struct hanvon_profile *profile);
+
+// Makes the decoder use tuning from its next packet on (NULL restores the
+// model defaults). The store is atomic, so it may run on another thread than
+// the decoder; the previous tuning must stay valid until that thread is
+// known to be done with its current packet.
+static inline void hanvon_decoder_set_tuning(struct hanvon_decoder *dec, const struct hanvon_tuning *tuning) {
+    __atomic_store_n(&dec->tuning, tuning, __ATOMIC_RELEASE);
+}
+
+// The tuning for the next packet. Load it once per packet and hand the same
+// pointer to hanvon_filter_apply, hanvon_pad_apply and hanvon_emit, so a
+// swap in between cannot split one packet across two tunings.
+static inline const struct hanvon_tuning *hanvon_decoder_tuning(const struct hanvon_decoder *dec) {
+    return __atomic_load_n(&dec->tuning, __ATOMIC_ACQUIRE);
+}
+
+// Runs the motion filter over the pen position of the packet that arrived at
+// time_ns; constant time, no allocation. hanvon_emit then reports the
+// filtered position, dec->pen keeps the raw one. A no-op when the tuning t
+// has no filter.
+void hanvon_filter_apply(struct hanvon_decoder *dec, const struct hanvon_tuning *t, uint64_t time_ns);
+
+// Turns the touch strip positions of the packet that arrived at time_ns into
+// wheel motion: pen.wheel_hi_res in REL_WHEEL_HI_RES units and pen.wheel in
+// whole detents, with the remainder carried to the next packet. Slow strokes
+// scroll one detent per strip step, faster ones are accelerated from the
+// strip speed. Call it after every hanvon_decode, or the strip stays silent.
+void hanvon_wheel_apply(struct hanvon_decoder *dec, uint64_t time_ns);
+
+// Runs the pad engine over the buttons of the packet that arrived at time_ns:
+// resolves taps, holds and chords and sets the keys hanvon_emit sends. Holds
+// are recognised at the first packet after hold_ms; a button released later
+// with no packet in between sends its hold action as a tap. Constant time,
+// no allocation, a no-op unless the pad map of the tuning t is enabled. Call
+// it after every hanvon_decode.
+void hanvon_pad_apply(struct hanvon_decoder *dec, const struct hanvon_tuning *t, uint64_t time_ns);
+
+// Releases every key the pad engine holds and forgets the buttons, without
+// tapping anything (the tablet went away). The next hanvon_emit sends it.
+void hanvon_pad_release(struct hanvon_decoder *dec);
+
+// ABS_X/ABS_Y maximum of the events hanvon_emit produces (swapped by a
+// quarter turn rotation), for setting up the input device
+static inline void hanvon_output_range(const struct hanvon_decoder *dec, int *max_x, int *max_y) {
+    const struct hanvon_tuning *t = hanvon_decoder_tuning(dec);
+    *max_x = t && t->map.enabled ? t->map.max_x : dec->profile->max_x;
+    *max_y = t && t->map.enabled ? t->map.max_y : dec->profile->max_y;
+}
+
+// Starts an empty frame. With delta suppression (state != NULL, normally
+// &dec->emitted) events equal to the last emitted value are dropped.
+static inline void hanvon_frame_begin(struct hanvon_frame *frame, struct hanvon_emit_state *state) {
+    frame->count = 0;
+    frame->state = state;
+}
+
+// Appends one event to the frame (silently drops it if the frame is full).
+// EV_KEY/EV_ABS events equal to the last emitted value are skipped.
+static inline void hanvon_frame_push(struct hanvon_frame *frame,
+                                     unsigned int type, unsigned int code, int value) {
+    struct hanvon_emit_state *state = frame->state;
+    if (state && state->valid) {
+        if (type == EV_KEY && code < KEY_CNT && state->key[code] == !!value) return;
+        if (type == EV_ABS && code < ABS_CNT && state->abs[code] == value) return;
+    }
+    if (frame->count >= HANVON_FRAME_MAX_EVENTS - 1 && type != EV_SYN) { // Keep room for SYN_REPORT
+        return;
+    }
+    if (state) {
+        if (type == EV_KEY && code < KEY_CNT) state->key[code] = !!value;
+        else if (type == EV_ABS && code < ABS_CNT) state->abs[code] = value;
+    }
+    struct input_event *ev = &frame->ev[frame->count++];
+    // uinput ignores the timestamp, the kernel stamps events on injection
+    ev->time.tv_sec = 0;
+    ev->time.tv_usec = 0;
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+// Terminates a non-empty frame with SYN_REPORT. Returns the number of events
+// to write, 0 if everything was filtered out.
+static inline int hanvon_frame_end(struct hanvon_frame *frame) {
+    if (frame->count == 0) return 0;
+    hanvon_frame_push(frame, EV_SYN, SYN_REPORT, 0);
+    return frame->count;
+}
+
+// Stamps a non-empty frame with the arrival time of its packet: appends
+// MSC_TIMESTAMP (microseconds, wrapping at 32 bits as the kernel drivers do)
+// and sets the time of every event. uinput replaces the latter with the
+// injection time, consumers of the frame itself get the arrival time.
+static inline void hanvon_frame_stamp(struct hanvon_frame *frame, uint64_t time_ns) {
+    if (frame->count == 0) return;
+    hanvon_frame_push(frame, EV_MSC, MSC_TIMESTAMP, (int)(uint32_t)(time_ns / 1000));
+    for (int i = 0; i < frame->count; i++) {
+        frame->ev[i].time.tv_sec = time_ns / 1000000000;
+        frame->ev[i].time.tv_usec = (time_ns % 1000000000) / 1000;
+    }
+}
+
+// Reports whether the frame reached the kernel. After a failed write the
+// kernel state is unknown, so the next frame re-sends everything.
+static inline void hanvon_frame_written(struct hanvon_frame *frame, int ok) {
+    if (frame->state) frame->state->valid = ok;
+}
+
+// Appends the events of dec->pen, as tuned by t, to the frame. Every axis and
+// key is pushed; the delta filter of the frame drops whatever did not change.
+// Pad taps add a press, a SYN_REPORT and the release, so the frame holds two
+// reports.
+void hanvon_emit(const struct hanvon_decoder *dec, const struct hanvon_tuning *t, struct hanvon_frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBHANVON_H